@@ -41,13 +41,25 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <curl/curl.h>
-#include <openssl/hmac.h>
-#include <openssl/evp.h>
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
+/// The signing code keeps precomputed digest states in the low-level
+/// SHA contexts, which OpenSSL 3 marks deprecated
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+#include <openssl/md5.h>
+#ifdef ENABLE_GZIP
+#include <zlib.h>
+#endif
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "aws4c.h"
 
@@ -59,34 +71,217 @@
 
 static int debug = 0;   /// <flag to control debugging options
 static int useRrs = 0;  /// <Use reduced redundancy storage
+static int sigV4  = 0;  /// <Sign requests with AWS Signature Version 4
+static int checksums = 0; /// <AWS_CHECKSUM_* flags to verify transfers with
+static int timing = 0;    /// <fill IOBuf timing after each request
+static int metricsOn = 0; /// <count requests in the metrics registry
+static AwsHooks hooks;    /// <lifecycle hooks
+static int hooksOn   = 0; /// <hooks are set
+static int traceOn   = 0; /// <record events in the trace ring
+static AwsRateControl rateConf; /// <client side rate control
+static int rateOn    = 0; /// <rate control is set
+static int lbCount   = 0; /// <number of endpoints set by s3_set_endpoints
+static int lbPolicy  = 0; /// <AWS_LB_* used to pick an endpoint
+static int coalesceOn = 0; /// <concurrent s3_get of one object share a request
+static int negOn     = 0; /// <s3_get remembers objects that were not found
+static int s3Compress  = 0; /// <AWS_COMPRESS_* method for S3 objects
+static int s3Level     = 0; /// <compression level for S3, 0 for default
+static int sqsCompress = 0; /// <AWS_COMPRESS_* method for SQS messages
+static int sqsLevel    = 0; /// <compression level for SQS, 0 for default
 static char * ID       = NULL;  /// <Current ID
 static char * awsKeyID = NULL;  /// <AWS Key ID
 static char * awsKey   = NULL;  /// <AWS Key Material
 static char * S3Host     = "s3.amazonaws.com";     /// <AWS S3 host
 /// \todo Use SQSHost in SQS functions
 static char * SQSHost  = "queue.amazonaws.com";  /// <AWS SQS host
+static char * Region   = "us-east-1";            /// <Region for SigV4 scope
 static char * Bucket   = NULL;
 static char * MimeType = NULL;
 static char * AccessControl = NULL;
 
+/// Allocator used for all memory the library allocates, see aws_set_allocator
+static void * (*awsMalloc)  ( size_t )         = malloc;
+static void * (*awsRealloc) ( void *, size_t ) = realloc;
+static void   (*awsFree)    ( void * )         = free;
+
+/// Copy a string with the library allocator
+static char * __aws_strdup ( const char * s )
+{
+  size_t n = strlen ( s ) + 1;
+  char * d = awsMalloc ( n );
+  if ( d ) memcpy ( d, s, n );
+  return d;
+}
+
+/// Maximum number of x-amz-* headers of an S3 request
+#define AMZ_MAX_HEADERS 8
+
+/// x-amz-* headers of an S3 request.  They are signed and sent as is
+typedef struct
+{
+  int  n;                           /// <number of headers
+  char name[AMZ_MAX_HEADERS][32];   /// <lower case names, sorted
+  char value[AMZ_MAX_HEADERS][96];  /// <values
+  char md5[32];                     /// <Content-MD5 sent along, empty for none
+} AmzHeaders;
+
+/// Growable string buffer
+typedef struct
+{
+  char * buf;   /// <NUL terminated contents
+  int    len;   /// <length of the contents
+  int    size;  /// <allocated size
+} StrBuf;
+
+/// Size of the output pieces produced by the codecs
+#define CODEC_CHUNK 65536
+
+/// Receiver of codec output
+typedef int (*CodecSink) ( void * ctx, const char * d, int len );
+
+/// Streaming compressor or decompressor.  Besides the library's own
+/// state it only needs one CODEC_CHUNK output buffer on the stack
+typedef struct
+{
+  int  method;      /// <AWS_COMPRESS_* in use, 0 if not active
+  int  decompress;  /// <decompressing rather than compressing
+  int  ended;       /// <end of the compressed stream has been seen
+#ifdef ENABLE_GZIP
+  z_stream z;
+#endif
+#ifdef ENABLE_ZSTD
+  ZSTD_CStream * zc;
+  ZSTD_DStream * zd;
+#endif
+} AwsCodec;
+
+/// Size of the aws-chunked frames used to send the checksum trailer
+#define XFER_CHUNK 65536
+
+/// Largest body room made up front from Content-Length, so a bogus
+/// header can't make the client allocate before any data arrives.
+/// Larger bodies grow node by node as they come.
+#define XFER_PREALLOC_MAX  ( 16 << 20 )
+
+/// State of a transfer in progress, handed to the curl callbacks
+typedef struct
+{
+  IOBuf *  b;          /// <I/O buffer of the request
+  StrBuf * packed;     /// <compressed body sent instead of b, or NULL
+  int      packedPos;  /// <next byte of packed to send
+  AwsCodec dec;        /// <decoder of a compressed response body
+  int      decode;     /// <decode a compressed response body
+  int      prealloc;   /// <size b for the body from Content-Length
+  int      discard;    /// <drop the body of a response that will be retried
+  int      decodeErr;  /// <response body could not be decoded
+  long     up;         /// <body bytes sent
+  long     down;       /// <body bytes received
+  int      retries;    /// <number of times the request was resent
+  int      op;         /// <AWS_OP_* of the request
+  int      metered;    /// <request is counted in the metrics
+  unsigned long start; /// <start of the request in microseconds
+  const char * key;    /// <object or queue the request works on
+  int      hooked;     /// <lifecycle hooks are called for the request
+  int      gotFirst;   /// <first response byte has been seen
+  int      follow;     /// <curl follows redirects
+  int      redirect;   /// <response coming in is a redirect curl may follow
+  int      held;       /// <headers hook held back until curl is done with
+                       ///  the redirect
+  CURL *   ch;         /// <curl handle, for the timing handed to the hooks
+  unsigned long sentAt;  /// <last body bytes went to curl, for rate control
+  unsigned long replyAt; /// <status line of the last response came in
+  AwsHookEvent ev;     /// <state handed to the hooks
+  IOBufNode * startNode; /// <read position of b before the first attempt
+  char *   startPos;
+  int      startLen;
+  int      startLeft;
+  struct _Endpoint * node; /// <endpoint the request was sent to
+  int      sums;       /// <AWS_CHECKSUM_* computed while transferring
+  MD5_CTX  md5;        /// <running MD5 of the body
+  unsigned crc;        /// <running CRC32C of the body
+  char     crcHdr[16]; /// <x-amz-checksum-crc32c received from the server
+
+  int      chunked;    /// <body is framed as aws-chunked with a trailer
+  int      done;       /// <trailer has been queued
+  int      left;       /// <body bytes not sent yet
+  int      chunkLeft;  /// <bytes of the current frame not sent yet
+  char     frame[96];  /// <framing bytes waiting to be sent
+  int      framePos;   /// <next byte of frame to send
+  int      frameLen;   /// <length of frame
+} AwsXfer;
+
 static void __debug ( char *fmt, ... ) ;
 static char * __aws_get_iso_date ();
 static char * __aws_get_httpdate ();
+static char * __aws_get_amzdate ();
 static FILE * __aws_getcfg ();
-static int s3_do_get ( IOBuf *b, char * const signature, 
-			  char * const date, char * const resource );
-static int s3_do_put ( IOBuf *b, char * const signature, 
-			  char * const date, char * const resource );
-static int s3_do_delete ( IOBuf *b, char * const signature, 
-			  char * const date, char * const resource );
-static char* __aws_sign ( char * const str );
+static int s3_do_get ( IOBuf *b, char * const auth, 
+			  char * const date, char * const resource,
+			  const AmzHeaders * amz, const char * range );
+static int s3_do_put ( IOBuf *b, char * const auth, 
+			  char * const date, char * const resource,
+			  const AmzHeaders * amz, StrBuf * packed );
+static int s3_do_delete ( IOBuf *b, char * const auth, 
+			  char * const date, char * const resource,
+			  const AmzHeaders * amz );
+static int s3_do_post ( IOBuf *b, char * const auth, 
+			char * const date, char * const resource,
+			const AmzHeaders * amz, const char * body, int len );
+static void __aws_sign ( char * const str, char * sig, int sigSize );
+static int  __aws_urlencode_n ( const char * src, int len, 
+				char * dest, int nDest, int keepSlash );
+static void __aws_sign_setkey ( char * const key );
+static void __aws_sign_v4 ( char * const amzDate, char * const region,
+			    char * const service, char * const canonReq,
+			    char * sigHex );
 static void __chomp ( char  * str );
+static void __hexify ( const unsigned char * d, int len, char * out );
+static int  __aws_iobuf_read ( IOBuf * B, char * d, int size );
+static int  __strbuf_append ( StrBuf * sb, const char * d, int len );
+static void __strbuf_free ( StrBuf * sb );
+static int  __codec_from_encoding ( const char * value );
+static int  __codec_init ( AwsCodec * c, int method, int level, int decompress );
+static int  __codec_run ( AwsCodec * c, const char * in, int len, int finish,
+			  CodecSink sink, void * ctx );
+static void __codec_end ( AwsCodec * c );
+static int  __codec_supported ( int method );
+static const char * __codec_name ( int method );
+static int  __codec_compress_iobuf ( IOBuf * b, StrBuf * out, 
+				     int method, int level );
+static int  __sink_iobuf ( void * ctx, const char * d, int len );
+static void __metrics_begin ( AwsXfer * x );
+static void __metrics_end ( AwsXfer * x, int sc );
+static void __hook_fire ( AwsXfer * x, AwsHook fn, int result );
+static void __aws_get_timing ( CURL * ch, AwsXfer * x, AwsTiming * t );
+static void __trace ( int ev, int op, long long a0, long long a1 );
+static void __iobuf_set ( IOBuf * b, char ** field, const char * s );
+static int  __iobuf_reserve ( IOBuf * B, int n );
+static void * __iobuf_alloc ( IOBuf * B, int n );
+static void * __arena_alloc ( AwsArena ** a, int n );
+static void __arena_rewind ( AwsArena ** a, AwsArena * keep );
+static int  __rate_perform ( CURL * ch, AwsXfer * x );
+static unsigned long __aws_now_us ();
+static void __lb_begin ( CURL * ch, AwsXfer * x );
+static void __lb_end ( AwsXfer * x, int sc );
+static const char * __lb_host ( const AwsXfer * x );
+static CURL * __curl_get ();
+static void __curl_put ( CURL * ch );
+static int  __coalesce_get ( IOBuf * b, char * const file );
+static unsigned long long __neg_key ( const char * file );
+static int  __neg_lookup ( unsigned long long fp );
+static unsigned __neg_epoch ( unsigned long long fp );
+static void __neg_insert ( unsigned long long fp, unsigned epoch );
+static void __neg_forget ( unsigned long long fp );
+static IOBufNode * __iobuf_unshare ( IOBuf * B, IOBufNode * first );
+
+/// Record a trace event if tracing is on
+#define TRACE(ev,op,a0,a1)  do { if ( traceOn ) __trace ( ev, op, a0, a1 ); } while ( 0 )
 
 #ifdef ENABLE_UNBASE64
 /// Decode base64 into binary
 /// \param input base64 text
 /// \param length length of the input text
-/// \return decoded data in  newly allocated buffer
+/// \return decoded data in  newly allocated buffer or NULL on error
 /// \internal
 ///
 /// This function allocates a buffer of the same size as the input
@@ -95,53 +290,20 @@ static void __chomp ( char  * str );
 /// the caller's responsibility to free this buffer
 static char *unbase64(unsigned char *input, int length)
 {
-  BIO *b64, *bmem;
-
   /// Allocate and zero the buffer
-  char *buffer = (char *)malloc(length);
-  memset(buffer, 0, length);
+  char *buffer = (char *)awsMalloc(length+1);
+  memset(buffer, 0, length+1);
 
   /// Decode the input into the newly allocated buffer
-  /// \todo Check for errors during decode
-  b64 = BIO_new(BIO_f_base64());
-  bmem = BIO_new_mem_buf(input, length);
-  bmem = BIO_push(b64, bmem);
-
-  BIO_read(bmem, buffer, length);
-
-  BIO_free_all(bmem);
+  if ( aws_b64_decode ( (char*)input, length, 
+			(unsigned char*)buffer, length+1 ) < 0 )
+    { awsFree ( buffer ); return NULL; }
 
   /// Return the decoded text
   return buffer;
 }
 #endif /* ENABLE_UNBASE64 */
 
-/// Encode a binary into base64 buffer
-/// \param input binary data  text
-/// \param length length of the input text
-/// \internal
-/// \return a newly allocated buffer with base64 encoded data 
-static char *__b64_encode(const unsigned char *input, int length)
-{
-  BIO *bmem, *b64;
-  BUF_MEM *bptr;
-
-  b64 = BIO_new(BIO_f_base64());
-  bmem = BIO_new(BIO_s_mem());
-  b64 = BIO_push(b64, bmem);
-  BIO_write(b64, input, length);
-  if(BIO_flush(b64)) ; /* make gcc 4.1.2 happy */
-  BIO_get_mem_ptr(b64, &bptr);
-
-  char *buff = (char *)malloc(bptr->length);
-  memcpy(buff, bptr->data, bptr->length-1);
-  buff[bptr->length-1] = 0;
-
-  BIO_free_all(b64);
-
-  return buff;
-}
-
 /// Chomp (remove the trailing '\n' from the string
 /// \param str string
 static void __chomp ( char  * str )
@@ -155,16 +317,180 @@ static void __chomp ( char  * str )
   if ( str[ln] == '\r' ) str[ln] = 0;
 }
 
+/// Prepare transfer state
+/// \param x transfer state
+/// \param b I/O buffer of the request
+/// \param sums AWS_CHECKSUM_* flags to compute
+static void __xfer_init ( AwsXfer * x, IOBuf * b, int sums )
+{
+  memset ( x, 0, sizeof(AwsXfer));
+  x->b    = b;
+  x->sums = sums;
+  if ( sums & AWS_CHECKSUM_MD5 ) MD5_Init ( &x->md5 );
+}
+
+/// Feed transferred body bytes into the checksums
+static void __xfer_update ( AwsXfer * x, const void * d, int len )
+{
+  if ( x->sums & AWS_CHECKSUM_MD5 )    MD5_Update ( &x->md5, d, len );
+  if ( x->sums & AWS_CHECKSUM_CRC32C ) x->crc = aws_crc32c ( x->crc, d, len );
+}
+
+/// Encode CRC32C the way x-amz-checksum-crc32c carries it
+/// \param crc checksum
+/// \param out output buffer, at least 9 bytes
+static void __crc32c_b64 ( unsigned crc, char * out )
+{
+  unsigned char be[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+  aws_b64_encode ( be, 4, out, 9 );
+}
+
+/// Compare computed checksums with the ones reported by the server
+/// \param x finished transfer
+/// \return 0 if they match or can't be checked, otherwise AWS_ERR_CHECKSUM
+///
+/// The ETag of a single part object without SSE-KMS is the MD5 of 
+/// its body.  The CRC32C is only checked if the server returned it.
+static int __xfer_verify ( AwsXfer * x )
+{
+  IOBuf * b = x->b;
+
+  if ( b->code != 200 ) return 0;
+
+  if (( x->sums & AWS_CHECKSUM_MD5 ) && b->eTag && 
+      strlen ( b->eTag ) == 34 && b->eTag[0] == '"' )
+    {
+      unsigned char md[MD5_DIGEST_LENGTH];
+      char hex[2*MD5_DIGEST_LENGTH+1];
+      MD5_Final ( md, &x->md5 );
+      __hexify ( md, sizeof(md), hex );
+      if ( strncasecmp ( b->eTag + 1, hex, 32 ))
+	{
+	  __debug ( "MD5 mismatch: computed %s, server %s", hex, b->eTag );
+	  return AWS_ERR_CHECKSUM;
+	}
+    }
+
+  if (( x->sums & AWS_CHECKSUM_CRC32C ) && x->crcHdr[0] )
+    {
+      char mine[16];
+      __crc32c_b64 ( x->crc, mine );
+      if ( strcmp ( mine, x->crcHdr ))
+	{
+	  __debug ( "CRC32C mismatch: computed %s, server %s", mine, x->crcHdr );
+	  return AWS_ERR_CHECKSUM;
+	}
+    }
+  return 0;
+}
+
+/// Read the next piece of the request body
+/// \param x transfer state
+/// \param d output buffer
+/// \param size size of the output buffer
+/// \return number of bytes read
+static int __xfer_read_body ( AwsXfer * x, char * d, int size )
+{
+  if ( x->packed == NULL ) return __aws_iobuf_read ( x->b, d, size );
+
+  int n = x->packed->len - x->packedPos;
+  if ( n > size ) n = size;
+  memcpy ( d, x->packed->buf + x->packedPos, n );
+  x->packedPos += n;
+  return n;
+}
+
+/// Size of the body framed as aws-chunked with the CRC32C trailer
+/// \param len length of the payload
+/// \return number of bytes to be sent
+static int __xfer_chunked_len ( int len )
+{
+  char tmp[16];
+  int  n = 0;
+  while ( len > 0 )
+    {
+      int c = len < XFER_CHUNK ? len : XFER_CHUNK;
+      n += snprintf ( tmp, sizeof(tmp), "%x", c ) + 2 + c + 2;
+      len -= c;
+    }
+  /// "0\r\n" "x-amz-checksum-crc32c:" base64 "\r\n" "\r\n"
+  return n + 3 + 22 + 8 + 2 + 2;
+}
+
+/// Produce the next piece of an aws-chunked body
+/// \param x transfer state
+/// \param out output buffer
+/// \param room size of the output buffer
+/// \return number of bytes produced
+///
+/// The payload is cut into XFER_CHUNK sized frames and the CRC32C 
+/// computed on the way is sent in the trailer after the last frame.
+static size_t __xfer_read_chunked ( AwsXfer * x, char * out, size_t room )
+{
+  size_t n = 0;
+
+  while ( n < room )
+    {
+      if ( x->framePos < x->frameLen )
+	{
+	  int k = x->frameLen - x->framePos;
+	  if ( k > (int)(room - n)) k = room - n;
+	  memcpy ( out + n, x->frame + x->framePos, k );
+	  x->framePos += k; n += k;
+	  continue;
+	}
+      if ( x->done ) break;
+
+      x->framePos = 0;
+      if ( x->chunkLeft > 0 )
+	{
+	  int want = x->chunkLeft < (int)(room - n) ? x->chunkLeft : (int)(room - n);
+	  int got = __xfer_read_body ( x, out + n, want );
+	  if ( got <= 0 ) return CURL_READFUNC_ABORT;
+	  __xfer_update ( x, out + n, got );
+	  n += got; x->chunkLeft -= got; x->left -= got;
+	  x->frameLen = 0;
+	  if ( x->chunkLeft == 0 ) 
+	    x->frameLen = snprintf ( x->frame, sizeof(x->frame), "\r\n" );
+	}
+      else if ( x->left > 0 )
+	{
+	  x->chunkLeft = x->left < XFER_CHUNK ? x->left : XFER_CHUNK;
+	  x->frameLen = snprintf ( x->frame, sizeof(x->frame), "%x\r\n", x->chunkLeft );
+	}
+      else
+	{
+	  char crc[16];
+	  __crc32c_b64 ( x->crc, crc );
+	  x->frameLen = snprintf ( x->frame, sizeof(x->frame), 
+				   "0\r\nx-amz-checksum-crc32c:%s\r\n\r\n", crc );
+	  x->done = 1;
+	}
+    }
+  return n;
+}
+
 /// Handles reception of the data
 /// \param ptr pointer to the incoming data
 /// \param size size of the data member
 /// \param nmemb number of data memebers
-/// \param stream pointer to I/O buffer
+/// \param stream pointer to transfer state
 /// \return number of bytes processed
 static size_t writefunc ( void * ptr, size_t size, size_t nmemb, void * stream )
 {
+  AwsXfer * x = stream;
   __debug ( "DATA RCVD %d items of size %d ",  nmemb, size );
-  aws_iobuf_append ( stream, ptr, nmemb*size );
+  if ( x->discard ) return nmemb * size;
+  x->down += nmemb*size;
+  TRACE ( AWS_TRACE_RECV, x->op, nmemb*size, x->down );
+  __xfer_update ( x, ptr, nmemb*size );
+  if ( x->dec.method )
+    {
+      if ( __codec_run ( &x->dec, ptr, nmemb*size, 0, __sink_iobuf, x->b ))
+	{ x->decodeErr = 1; return 0; }
+    }
+  else
+    aws_iobuf_append ( x->b, ptr, nmemb*size );
   return nmemb * size;
 }
 
@@ -178,13 +504,25 @@ static size_t writedummyfunc ( void * ptr, size_t size, size_t nmemb, void * str
 /// \param ptr pointer to the incoming data
 /// \param size size of the data member
 /// \param nmemb number of data memebers
-/// \param stream pointer to I/O buffer
+/// \param stream pointer to transfer state
 /// \return number of bytes written
 static size_t readfunc ( void * ptr, size_t size, size_t nmemb, void * stream )
 {
-  char * Ln = ptr;
-  int sz = aws_iobuf_getline ( stream, ptr, size*nmemb);
-  __debug ( "Sent[%3d] %s", sz, Ln );
+  AwsXfer * x = stream;
+  if ( rateOn ) x->sentAt = __aws_now_us ();
+  if ( x->chunked ) 
+    {
+      size_t n = __xfer_read_chunked ( x, ptr, size*nmemb );
+      if ( n != CURL_READFUNC_ABORT ) x->up += n;
+      TRACE ( AWS_TRACE_SEND, x->op, n, x->up );
+      return n;
+    }
+
+  int sz = __xfer_read_body ( x, ptr, size*nmemb );
+  x->up += sz;
+  TRACE ( AWS_TRACE_SEND, x->op, sz, x->up );
+  __xfer_update ( x, ptr, sz );
+  __debug ( "Sent[%3d]", sz );
   return sz;
 }
 
@@ -192,49 +530,283 @@ static size_t readfunc ( void * ptr, size_t size, size_t nmemb, void * stream )
 /// \param ptr pointer to the incoming data
 /// \param size size of the data member
 /// \param nmemb number of data memebers
-/// \param stream pointer to I/O buffer
+/// \param stream pointer to transfer state
 /// \return number of bytes processed
 static size_t header ( void * ptr, size_t size, size_t nmemb, void * stream )
 {
-  IOBuf * b = stream;
+  AwsXfer * x = stream;
+  IOBuf * b = x->b;
+
+  if ( x->hooked )
+    {
+      if ( !x->gotFirst ) 
+	{ x->gotFirst = 1; __hook_fire ( x, hooks.firstByte, 0 ); }
+      /// Skip the header block of 100 Continue.  Hold back the one of
+      /// a redirect, only the final response counts
+      if ( b->code >= 200 && size*nmemb <= 2 && *(char*)ptr == '\r' ) 
+	{
+	  if ( x->redirect ) x->held = 1;
+	  else __hook_fire ( x, hooks.headers, 0 );
+	}
+    }
+
+  /// At the end of the headers make room for the whole body, so it
+  /// arrives in one piece.  206 responses give the size of the range.
+  if ( x->prealloc && b->contentLen > 0 && b->contentLen <= XFER_PREALLOC_MAX &&
+       b->code / 100 == 2 && !x->dec.method && size*nmemb <= 2 && *(char*)ptr == '\r' )
+    __iobuf_reserve ( b, b->contentLen );
 
   if (!strncmp ( ptr, "HTTP/1.1", 8 ))
     {
-      b->result = strdup ( ptr + 9 );
+      __iobuf_set ( b, &b->result, ptr + 9 );
       __chomp(b->result);
       b->code   = atoi ( ptr + 9 );
+      x->redirect = x->held = 0;
+      if ( rateOn ) x->replyAt = __aws_now_us ();
+      /// The body of a throttled response would be mixed with the retry
+      x->discard = rateOn && ( b->code == 503 || b->code == 429 ) && 
+	x->retries < rateConf.retries;
+      TRACE ( AWS_TRACE_STATUS, x->op, b->code, 0 );
     }
   else if ( !strncmp ( ptr, "ETag: ", 6 ))
     {
-      b->eTag = strdup ( ptr + 6 );
+      __iobuf_set ( b, &b->eTag, ptr + 6 );
       __chomp(b->eTag);
     }
   else if ( !strncmp ( ptr, "Last-Modified: ", 14 ))
     {
-      b->lastMod = strdup ( ptr + 15 );
+      __iobuf_set ( b, &b->lastMod, ptr + 15 );
       __chomp(b->lastMod);
     }
+  else if ( !strncasecmp ( ptr, "Location:", 9 ))
+    {
+      x->redirect = x->follow && b->code / 100 == 3;
+    }
+  else if ( !strncasecmp ( ptr, "Content-Range: ", 15 ))
+    {
+      /// bytes first-last/size
+      char * slash = memchr ( ptr, '/', size*nmemb );
+      if ( slash ) b->totalLen = atol ( slash + 1 );
+    }
   else if ( !strncmp ( ptr, "Content-Length: ", 15 ))
     {
-      b->contentLen = atoi ( ptr + 16 );
+      /// Lengths that don't fit an int are left unknown
+      char * end;
+      errno = 0;
+      long n = strtol ( ptr + 16, &end, 10 );
+      b->contentLen = errno || end == (char*) ptr + 16 || n < 0 || n > INT_MAX ? 0 : n;
+    }
+  else if ( !strncasecmp ( ptr, "x-amz-checksum-crc32c: ", 23 ))
+    {
+      snprintf ( x->crcHdr, sizeof(x->crcHdr), "%.*s", 
+		 (int)( size*nmemb - 23 ), (char*)ptr + 23 );
+      __chomp ( x->crcHdr );
+    }
+  else if ( x->decode && b->code / 100 == 2 && !x->dec.method &&
+	    !strncasecmp ( ptr, "Content-Encoding: ", 18 ))
+    {
+      char enc[64];
+      snprintf ( enc, sizeof(enc), "%.*s", (int)( size*nmemb - 18 ), (char*)ptr + 18 );
+      int m = __codec_from_encoding ( enc );
+      if ( m && __codec_init ( &x->dec, m, 0, 1 ))
+	{ x->decodeErr = 1; return 0; }
     }
 
   return nmemb * size;
 }
 
 
+/// Current monotonic time in microseconds
+static unsigned long __aws_now_us ()
+{
+  struct timespec ts;
+  clock_gettime ( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/// Call one of the lifecycle hooks of a request
+/// \param x transfer state
+/// \param fn hook to call, may be NULL
+/// \param result curl result code for the complete hook
+static void __hook_fire ( AwsXfer * x, AwsHook fn, int result )
+{
+  AwsHookEvent * e = &x->ev;
+  if ( fn == NULL ) return;
+  e->op        = x->op;
+  e->key       = x->key;
+  e->b         = x->b;
+  e->elapsed   = ( __aws_now_us () - x->start ) / 1e6;
+  e->bytesUp   = x->up;
+  e->bytesDown = x->down;
+  e->retries   = x->retries;
+  e->result    = result;
+  if ( x->ch ) __aws_get_timing ( x->ch, x, &e->timing );
+  fn ( e, hooks.user );
+}
+
+/// Copy curl's timing of a request, final once it is finished
+/// \param t where to copy it, the timing of the I/O buffer or of
+///          a hook event
+static void __aws_get_timing ( CURL * ch, AwsXfer * x, AwsTiming * t )
+{
+  curl_easy_getinfo ( ch, CURLINFO_NAMELOOKUP_TIME,    &t->nameLookup );
+  curl_easy_getinfo ( ch, CURLINFO_CONNECT_TIME,       &t->connect );
+  curl_easy_getinfo ( ch, CURLINFO_APPCONNECT_TIME,    &t->appConnect );
+  curl_easy_getinfo ( ch, CURLINFO_PRETRANSFER_TIME,   &t->preTransfer );
+  curl_easy_getinfo ( ch, CURLINFO_STARTTRANSFER_TIME, &t->startTransfer );
+  curl_easy_getinfo ( ch, CURLINFO_TOTAL_TIME,         &t->total );
+  t->bytesUp   = x->up;
+  t->bytesDown = x->down;
+  t->retries   = x->retries;
+}
+
+/// Curl handle kept by the calling thread between requests
+static __thread CURL * curlMine = NULL;
+
+/// Get a curl handle for a request.  Reusing the handle of the 
+/// previous request keeps its connections and DNS cache.
+static CURL * __curl_get ()
+{
+  CURL * ch = curlMine;
+  if ( ch == NULL ) return curl_easy_init ();
+  curlMine = NULL;
+  curl_easy_reset ( ch );
+  return ch;
+}
+
+/// Done with a curl handle, keep it for the next request
+static void __curl_put ( CURL * ch )
+{
+  if ( curlMine == NULL ) curlMine = ch;
+  else curl_easy_cleanup ( ch );
+}
+
+/// Free the handle kept by the calling thread, for threads of the
+/// library that exit
+static void __curl_release ()
+{
+  if ( curlMine ) curl_easy_cleanup ( curlMine );
+  curlMine = NULL;
+}
+
+/// Send a prepared request once
+/// \return curl result code
+static int __aws_attempt ( CURL * ch, AwsXfer * x )
+{
+  TRACE ( AWS_TRACE_START, x->op, x->packed ? x->packed->len : x->b->len, 0 );
+  int sc = curl_easy_perform ( ch );
+  __debug ( "Return Code: %d ", sc );
+  TRACE ( AWS_TRACE_END, x->op, sc, x->b->code );
+  return sc;
+}
+
+/// Run a prepared request.  Every request goes through here.
+/// \param ch curl handle
+/// \param x transfer state
+/// \return curl result code
+static int __aws_perform ( CURL * ch, AwsXfer * x )
+{
+  x->ch = ch;
+  if ( metricsOn ) __metrics_begin ( x );
+  if ( hooksOn )
+    {
+      if ( !x->metered ) x->start = __aws_now_us ();
+      x->hooked = 1;
+      __hook_fire ( x, hooks.start, 0 );
+    }
+  if ( lbCount && x->op < AWS_OP_SQS_CREATE_QUEUE ) __lb_begin ( ch, x );
+  int sc = rateOn ? __rate_perform ( ch, x ) : __aws_attempt ( ch, x );
+  if ( x->node ) __lb_end ( x, sc );
+  if ( timing ) __aws_get_timing ( ch, x, &x->b->timing );
+  if ( x->metered ) __metrics_end ( x, sc );
+  /// A redirect curl did not follow is the final response after all
+  if ( x->held ) __hook_fire ( x, hooks.headers, 0 );
+  if ( x->hooked ) __hook_fire ( x, hooks.complete, sc );
+  return sc;
+}
+
+
+/// Request timestamps formatted for one second
+typedef struct
+{
+  time_t t;           /// <second the strings below were formatted for
+  char   http[32];    /// <HTTP date for the Date header
+  char   iso[24];     /// <ISO 8601 date for SQS Timestamp parameter
+  char   amz[20];     /// <ISO 8601 basic date for SigV4 x-amz-date
+} AwsTimestamp;
+
+/// Each thread formats its own timestamps, so there is no shared 
+/// static buffer to race on
+static __thread AwsTimestamp tsCache;
+
+/// Write zero padded decimal number
+/// \param p output position
+/// \param v value
+/// \param digits number of digits to write
+/// \return position after the last digit
+static char * __fmt_digits ( char * p, int v, int digits )
+{
+  int i;
+  for ( i = digits - 1 ; i >= 0 ; i -- ) { p[i] = '0' + v % 10; v /= 10; }
+  return p + digits;
+}
+
+/// Get current request timestamps
+/// \internal
+/// \return per thread cache refreshed at most once a second
+///
+/// The strings are formatted by hand rather than with strftime, which
+/// is slower and localizes day and month names.
+static const AwsTimestamp * __aws_timestamp ()
+{
+  static const char * wDay[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char * mon[]  = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
+				 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  time_t t = time(NULL);
+  struct tm g;
+
+  if ( t == tsCache.t ) return &tsCache;
+
+  gmtime_r ( &t, &g );
+  int Y = g.tm_year + 1900, M = g.tm_mon + 1;
+
+  char * p = tsCache.http;
+  memcpy ( p, wDay[g.tm_wday], 3 );    p += 3;
+  *p++ = ','; *p++ = ' ';
+  p = __fmt_digits ( p, g.tm_mday, 2 ); *p++ = ' ';
+  memcpy ( p, mon[g.tm_mon], 3 );      p += 3;
+  *p++ = ' ';
+  p = __fmt_digits ( p, Y, 4 );        *p++ = ' ';
+  p = __fmt_digits ( p, g.tm_hour, 2 ); *p++ = ':';
+  p = __fmt_digits ( p, g.tm_min, 2 );  *p++ = ':';
+  p = __fmt_digits ( p, g.tm_sec, 2 );
+  memcpy ( p, " +0000", 7 );
+
+  p = tsCache.iso;
+  p = __fmt_digits ( p, Y, 4 );         *p++ = '-';
+  p = __fmt_digits ( p, M, 2 );         *p++ = '-';
+  p = __fmt_digits ( p, g.tm_mday, 2 ); *p++ = 'T';
+  p = __fmt_digits ( p, g.tm_hour, 2 ); *p++ = ':';
+  p = __fmt_digits ( p, g.tm_min, 2 );  *p++ = ':';
+  p = __fmt_digits ( p, g.tm_sec, 2 );  *p++ = 'Z'; *p = 0;
+
+  p = tsCache.amz;
+  p = __fmt_digits ( p, Y, 4 );
+  p = __fmt_digits ( p, M, 2 );
+  p = __fmt_digits ( p, g.tm_mday, 2 ); *p++ = 'T';
+  p = __fmt_digits ( p, g.tm_hour, 2 );
+  p = __fmt_digits ( p, g.tm_min, 2 );
+  p = __fmt_digits ( p, g.tm_sec, 2 );  *p++ = 'Z'; *p = 0;
+  tsCache.t = t;
+  __debug ( "Request Time: %s", tsCache.http );
+  return &tsCache;
+}
+
 /// Get Data for authentication of SQS request
 /// \return date in ISO format
 static char * __aws_get_iso_date ()
 {
-  static char dTa[256];
-  time_t t = time(NULL);
-  struct tm * gTime = gmtime ( & t );
-
-  memset ( dTa, 0 , sizeof(dTa));
-  strftime ( dTa, sizeof(dTa), "%FT%H:%M:%SZ", gTime );
-  __debug ( "Request Time: %s", dTa );
-  return dTa;
+  return (char*) __aws_timestamp()->iso;
 }
 
 #ifdef ENABLE_DUMP
@@ -275,13 +847,15 @@ static void __debug ( char *fmt, ... ) {
 /// \return date in HTTP format
 static char * __aws_get_httpdate ()
 {
-  static char dTa[256];
-  time_t t = time(NULL);
-  struct tm * gTime = gmtime ( & t );
-  memset ( dTa, 0 , sizeof(dTa));
-  strftime ( dTa, sizeof(dTa), "%a, %d %b %Y %H:%M:%S +0000", gTime );
-  __debug ( "Request Time: %s", dTa );
-  return dTa;
+  return (char*) __aws_timestamp()->http;
+}
+
+/// Get Request Date for Signature Version 4
+/// \internal
+/// \return date in ISO8601 basic format (YYYYMMDDTHHMMSSZ)
+static char * __aws_get_amzdate ()
+{
+  return (char*) __aws_timestamp()->amz;
 }
 
 /// Internal function to get configuration file
@@ -312,6 +886,188 @@ static FILE * __aws_getcfg ()
 }
 
 
+/// Value of a hex digit
+/// \internal
+/// \return 0..15 or -1 if c is not a hex digit
+static int __hexval ( char c )
+{
+  if ( c >= '0' && c <= '9' ) return c - '0';
+  if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+  if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+  return -1;
+}
+
+/// Undo URL encoding in place
+/// \internal
+/// \param s string to decode
+/// \return length of the decoded string
+static int __aws_urldecode ( char * s )
+{
+  char * d = s;
+  char * p = s;
+  while ( *p )
+    {
+      int hi = p[0] == '%' ? __hexval ( p[1] ) : -1;
+      int lo = hi >= 0 ? __hexval ( p[2] ) : -1;
+      if ( lo >= 0 ) { *d++ = hi << 4 | lo; p += 3; }
+      else *d++ = *p++;
+    }
+  *d = 0;
+  return d - s;
+}
+
+/// Build the canonical query string for Signature Version 4
+/// \internal
+/// \param query raw query string (without the leading '?')
+/// \param dest  buffer for the canonical query
+/// \param nDest size of the dest buffer
+///
+/// Names and values are URI encoded, whether or not the query already
+/// was, and the parameters are sorted by name, then by value.  Each 
+/// parameter gets an explicit '=' so that sub-resources like "uploads" 
+/// sign as "uploads=".
+static void __aws_canonical_query ( const char * query, char * dest, int nDest )
+{
+  char   copy[2048];
+  char   enc[6144];
+  char * name[64];
+  char * value[64];
+  int    n = 0;
+  int    e = 0;
+  int    i, j;
+
+  dest[0] = 0;
+  if ( query == NULL || query[0] == 0 ) return;
+
+  snprintf ( copy, sizeof(copy), "%s", query );
+  char * p = strtok ( copy, "&" );
+  while ( p && n < (int)(sizeof(name)/sizeof(name[0])) )
+    {
+      char * v = strchr ( p, '=' );
+      if ( v ) *v++ = 0;
+      else v = p + strlen ( p );
+      int ln = __aws_urldecode ( p );
+      int lv = __aws_urldecode ( v );
+
+      int k = __aws_urlencode_n ( p, ln, enc + e, sizeof(enc) - e, 0 );
+      if ( k < 0 ) break;
+      name[n] = enc + e; e += k + 1;
+      k = __aws_urlencode_n ( v, lv, enc + e, sizeof(enc) - e, 0 );
+      if ( k < 0 ) break;
+      value[n++] = enc + e; e += k + 1;
+      p = strtok ( NULL, "&" );
+    }
+
+  /// Insertion sort, there are only ever a handful of parameters
+  for ( i = 1 ; i < n ; i ++ )
+    for ( j = i ; j > 0 ; j -- )
+      {
+	int c = strcmp ( name[j-1], name[j] );
+	if ( c < 0 || ( c == 0 && strcmp ( value[j-1], value[j] ) <= 0 )) break;
+	char * t = name[j];  name[j]  = name[j-1];  name[j-1]  = t;
+	t = value[j]; value[j] = value[j-1]; value[j-1] = t;
+      }
+
+  int ln = 0;
+  for ( i = 0 ; i < n && ln < nDest ; i ++ )
+    ln += snprintf ( dest + ln, nDest - ln, "%s%s=%s", i ? "&" : "",
+		     name[i], value[i] );
+}
+
+/// Add or replace an x-amz-* header of an S3 request
+/// \internal
+/// \param a header list
+/// \param name lower case header name
+/// \param value header value
+///
+/// The list is kept sorted by name, which is the order both signature
+/// versions want the headers in.
+static void __amz_set ( AmzHeaders * a, const char * name, const char * value )
+{
+  int i, j;
+  for ( i = 0 ; i < a->n ; i ++ )
+    {
+      int c = strcmp ( a->name[i], name );
+      if ( c == 0 ) break;
+      if ( c > 0 )
+	{
+	  if ( a->n == AMZ_MAX_HEADERS ) return;
+	  for ( j = a->n ; j > i ; j -- )
+	    {
+	      memcpy ( a->name[j], a->name[j-1], sizeof(a->name[j]));
+	      memcpy ( a->value[j], a->value[j-1], sizeof(a->value[j]));
+	    }
+	  a->n ++;
+	  break;
+	}
+    }
+  if ( i == a->n ) 
+    {
+      if ( a->n == AMZ_MAX_HEADERS ) return;
+      a->n ++;
+    }
+  snprintf ( a->name[i], sizeof(a->name[i]), "%s", name );
+  snprintf ( a->value[i], sizeof(a->value[i]), "%s", value );
+}
+
+/// Get value of an x-amz-* header
+/// \internal
+/// \return header value or NULL if the header is not set
+static const char * __amz_get ( const AmzHeaders * a, const char * name )
+{
+  int i;
+  for ( i = 0 ; i < a->n ; i ++ )
+    if ( !strcmp ( a->name[i], name )) return a->value[i];
+  return NULL;
+}
+
+/// Compute Signature Version 4 Authorization header for S3 request
+/// \param method -- HTTP method
+/// \param resource -- URI of the object, may include a query string
+/// \param amz -- x-amz-* headers, including x-amz-date and 
+///               x-amz-content-sha256
+/// \param auth -- buffer for the Authorization header value
+/// \param authSize -- size of the auth buffer
+static void __s3_sign_v4 ( char * const method, char * const resource,
+			   const AmzHeaders * amz, char * auth, int authSize )
+{
+  char  canonReq[4096];
+  char  path[2048];
+  char  query[2048];
+  char  signedHeaders[512];
+  char  sig[2*SHA256_DIGEST_LENGTH+1];
+  int   i;
+
+  /// The path is signed with every segment URI encoded, S3 does the
+  /// same with the key it receives
+  char * q = strchr ( resource, '?' );
+  int pathLen = q ? (int)(q - resource) : (int)strlen ( resource );
+  if ( __aws_urlencode_n ( resource, pathLen, path, sizeof(path), 1 ) < 0 )
+    path[0] = 0;
+  __aws_canonical_query ( q ? q + 1 : NULL, query, sizeof(query));
+
+  int n = snprintf ( canonReq, sizeof(canonReq), "%s\n/%s\n%s\nhost:%s\n",
+		     method, path, query, S3Host );
+  int h = snprintf ( signedHeaders, sizeof(signedHeaders), "host" );
+  for ( i = 0 ; i < amz->n ; i ++ )
+    {
+      n += snprintf ( canonReq + n, sizeof(canonReq) - n, "%s:%s\n",
+		      amz->name[i], amz->value[i] );
+      h += snprintf ( signedHeaders + h, sizeof(signedHeaders) - h, ";%s",
+		      amz->name[i] );
+    }
+  snprintf ( canonReq + n, sizeof(canonReq) - n, "\n%s\n%s",
+	     signedHeaders, __amz_get ( amz, "x-amz-content-sha256" ));
+
+  const char * date = __amz_get ( amz, "x-amz-date" );
+  __aws_sign_v4 ( (char*)date, Region, "s3", canonReq, sig );
+
+  snprintf ( auth, authSize, 
+	     "AWS4-HMAC-SHA256 Credential=%s/%.8s/%s/s3/aws4_request, "
+	     "SignedHeaders=%s, Signature=%s",
+	     awsKeyID, date, Region, signedHeaders, sig );
+}
+
 /// Get S3 Request signature
 /// \internal
 /// \param resource -- URI of the object
@@ -320,21 +1076,29 @@ static FILE * __aws_getcfg ()
 /// \param method -- HTTP method
 /// \param bucket -- bucket 
 /// \param file --  file
-/// \return fills up resource and date parameters, also 
-///         returns request signature to be used with Authorization header
-static char * GetStringToSign ( char * resource,  int resSize, 
-			     char ** date,
-			     char * const method,
-			     char * const bucket,
-			     char * const file )
+/// \param amz -- x-amz-* headers sent with the request
+/// \param auth -- buffer for the Authorization header value
+/// \param authSize -- size of the auth buffer
+///
+/// Fills up resource and date parameters, also 
+/// places the value of the Authorization header into auth. 
+/// With Signature Version 4 the x-amz-date and x-amz-content-sha256 
+/// headers are added to amz, otherwise date has to be sent in the 
+/// Date header.
+static void GetStringToSign ( char * resource,  int resSize, 
+			      char ** date,
+			      char * const method,
+			      char * const bucket,
+			      char * const file,
+			      AmzHeaders * amz,
+			      char * auth, int authSize )
 {
   char  reqToSign[2048];
-  char  acl[32];
-  char  rrs[64];
+  char  amzHdrs[1024];
+  char  sig[64];
+  int   i, n;
 
-  /// \todo Change the way RRS is handled.  Need to pass it in
-  
-  * date = __aws_get_httpdate();
+  * date = sigV4 ? __aws_get_amzdate() : __aws_get_httpdate();
 
   memset ( resource,0,resSize);
   if ( bucket != NULL )
@@ -342,109 +1106,367 @@ static char * GetStringToSign ( char * resource,  int resSize,
   else
     snprintf ( resource, resSize,"%s", file );
 
-  if (AccessControl)
-    snprintf( acl, sizeof(acl), "x-amz-acl:%s\n", AccessControl);
-  else
-    acl[0] = 0;
-
-  if (useRrs)
-    strncpy( rrs, "x-amz-storage-class:REDUCED_REDUNDANCY\n", sizeof(rrs));  
-  else
-    rrs[0] = 0;
+  if ( sigV4 )
+    {
+      // EU: If bucket is in virtual host name, remove bucket from path
+      if (bucket && strncmp(S3Host, bucket, strlen(bucket)) == 0)
+	snprintf ( resource, resSize,"%s", file );
+      __amz_set ( amz, "x-amz-date", *date );
+      if ( __amz_get ( amz, "x-amz-content-sha256" ) == NULL )
+	__amz_set ( amz, "x-amz-content-sha256", "UNSIGNED-PAYLOAD" );
+      __s3_sign_v4 ( method, resource, amz, auth, authSize );
+      return;
+    }
 
+  for ( i = 0, n = 0, amzHdrs[0] = 0 ; i < amz->n ; i ++ )
+    n += snprintf ( amzHdrs + n, sizeof(amzHdrs) - n, "%s:%s\n",
+		    amz->name[i], amz->value[i] );
 
-  snprintf ( reqToSign, sizeof(reqToSign),"%s\n\n%s\n%s\n%s%s/%s",
+  snprintf ( reqToSign, sizeof(reqToSign),"%s\n%s\n%s\n%s\n%s/%s",
 	     method,
-	     MimeType ? MimeType : "",
+	     amz->md5,
+	     MimeType && !strcmp ( method, "PUT" ) ? MimeType : "",
 	     *date,
-	     acl,
-	     rrs,
+	     amzHdrs,
 	     resource );
 
   // EU: If bucket is in virtual host name, remove bucket from path
   if (bucket && strncmp(S3Host, bucket, strlen(bucket)) == 0)
     snprintf ( resource, resSize,"%s", file );
 
-  return __aws_sign(reqToSign);
+  __aws_sign ( reqToSign, sig, sizeof(sig) );
+  snprintf ( auth, authSize, "AWS %s:%s", awsKeyID, sig );
 }
 
-static void __aws_urlencode ( char * src, char * dest, int nDest )
+/// Append signing headers of an S3 request
+/// \internal
+/// \param slist header list
+/// \param auth Authorization header value from GetStringToSign
+/// \param date request date from GetStringToSign
+/// \param amz x-amz-* headers signed by GetStringToSign
+/// \return updated header list
+static struct curl_slist * __s3_auth_headers ( struct curl_slist * slist,
+					       char * const auth,
+					       char * const date,
+					       const AmzHeaders * amz )
 {
-  int i;
-  int n;
-  memset ( dest, 0, nDest );
-  __debug ( "Encoding: %s", src );
-  const char * badChrs = " \n$&+,/:;=?@";
-  const char * hexDigit = "0123456789ABCDEF";
+  char Buf[1024];
+  int  i;
 
-  n = 0;
-  for ( i = 0 ; src[i] ; i ++ )
+  if ( ! sigV4 )
     {
-      if ( n + 5 > nDest ) 
-	{ puts ( "URLEncode:: Dest buffer to small.. can't continue \n" ); exit(0); }
-      if ( strchr ( badChrs, src[i] ))
-	{
-	  unsigned char c = src[i];
-	  dest[n++] = '%'; 
-	  dest[n++] = hexDigit [(c >> 4 ) & 0xF ];
-	  dest[n++] = hexDigit [c & 0xF ];
-	}
-      else dest[n++] = src[i];
+      snprintf ( Buf, sizeof(Buf), "Date: %s", date );
+      slist = curl_slist_append(slist, Buf );
     }
-  __debug ( "Encoded To: %s", dest );
+  for ( i = 0 ; i < amz->n ; i ++ )
+    {
+      snprintf ( Buf, sizeof(Buf), "%s: %s", amz->name[i], amz->value[i] );
+      slist = curl_slist_append(slist, Buf );
+    }
+  if ( amz->md5[0] )
+    {
+      snprintf ( Buf, sizeof(Buf), "Content-MD5: %s", amz->md5 );
+      slist = curl_slist_append(slist, Buf );
+    }
+  snprintf ( Buf, sizeof(Buf), "Authorization: %s", auth );
+  return curl_slist_append(slist, Buf );
 }
 
-static int SQSRequest ( IOBuf *b, char * verb, char * const url )
+/// Make room for more data in the string buffer
+/// \param sb string buffer
+/// \param extra number of bytes to be added (not counting NUL)
+/// \return 0 on success, AWS_ERR_NOMEM if memory can't be allocated
+static int __strbuf_reserve ( StrBuf * sb, int extra )
 {
-  CURL* ch =  curl_easy_init( );
-  struct curl_slist *slist=NULL;
+  if ( sb->len + extra + 1 <= sb->size ) return 0;
+  int size = sb->size ? sb->size : 256;
+  while ( size < sb->len + extra + 1 ) size *= 2;
+  char * nb = awsRealloc ( sb->buf, size );
+  if ( nb == NULL ) return AWS_ERR_NOMEM;
+  sb->buf  = nb;
+  sb->size = size;
+  return 0;
+}
 
-  curl_easy_setopt ( ch, CURLOPT_URL, url );
-  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, b );
-  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
-  curl_easy_setopt ( ch, CURLOPT_INFILESIZE, b->len );
-  curl_easy_setopt ( ch, CURLOPT_POST, 1 );
-  curl_easy_setopt ( ch, CURLOPT_POSTFIELDSIZE , 0 );
-  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
-  curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writefunc );
-  curl_easy_setopt ( ch, CURLOPT_WRITEDATA, b );
-  curl_easy_setopt ( ch, CURLOPT_READFUNCTION, readfunc );
-  curl_easy_setopt ( ch, CURLOPT_READDATA, b );
+/// Append data to the string buffer
+/// \param sb string buffer
+/// \param d data to be appended
+/// \param len length of the data
+/// \return 0 on success, AWS_ERR_NOMEM if memory can't be allocated
+static int __strbuf_append ( StrBuf * sb, const char * d, int len )
+{
+  if ( __strbuf_reserve ( sb, len )) return AWS_ERR_NOMEM;
+  memcpy ( sb->buf + sb->len, d, len );
+  sb->len += len;
+  sb->buf[sb->len] = 0;
+  return 0;
+}
 
-  int  sc  = curl_easy_perform(ch);
-  /** \todo check the return code  */
-  __debug ( "Return Code: %d ", sc );
-  
-  curl_slist_free_all(slist);
+/// Append printf formatted text to the string buffer
+/// \param sb string buffer
+/// \param fmt printf like formating string
+/// \return 0 on success, AWS_ERR_NOMEM if memory can't be allocated
+static int __strbuf_printf ( StrBuf * sb, const char * fmt, ... )
+{
+  va_list args;
+  int n;
 
-  return sc;
+  va_start ( args, fmt );
+  n = vsnprintf ( sb->buf ? sb->buf + sb->len : NULL, 
+		  sb->buf ? sb->size - sb->len : 0, fmt, args );
+  va_end ( args );
+  if ( n < 0 ) return AWS_ERR_NOMEM;
+  if ( sb->buf && sb->len + n < sb->size ) { sb->len += n; return 0; }
+
+  if ( __strbuf_reserve ( sb, n )) return AWS_ERR_NOMEM;
+  va_start ( args, fmt );
+  vsnprintf ( sb->buf + sb->len, sb->size - sb->len, fmt, args );
+  va_end ( args );
+  sb->len += n;
+  return 0;
 }
 
-static char * SQSSign ( char * str )
+/// Release memory held by the string buffer
+static void __strbuf_free ( StrBuf * sb )
 {
-  char RealSign[1024];
-  char * signature = __aws_sign(str);
-
-  __aws_urlencode ( signature, RealSign, sizeof(RealSign));
-    
-  free ( signature );
-  return strdup(RealSign);
+  awsFree ( sb->buf );
+  memset ( sb, 0, sizeof(StrBuf));
 }
 
+/// String buffers kept by each thread for the request functions,
+/// and how much memory each may keep between requests
+#define STRBUF_SCRATCH       2
+#define STRBUF_SCRATCH_KEEP  65536
 
+static __thread StrBuf strbufScratch[STRBUF_SCRATCH];
 
-/*!
-  \}
-*/
+/// Borrow an empty string buffer of the calling thread.  It keeps its
+/// memory from the last use, return it with __strbuf_scratch_done.
+/// \param i which one, callers must not borrow one twice
+static StrBuf * __strbuf_scratch ( int i )
+{
+  StrBuf * sb = &strbufScratch[i];
+  sb->len = 0;
+  if ( sb->buf ) sb->buf[0] = 0;
+  return sb;
+}
 
+/// Done with a scratch buffer, release its memory if it grew large
+static void __strbuf_scratch_done ( StrBuf * sb )
+{ if ( sb->size > STRBUF_SCRATCH_KEEP ) __strbuf_free ( sb ); }
+
+/// Characters that RFC 3986 allows unencoded: ALPHA DIGIT - . _ ~
+static const unsigned char urlUnreserved[256] = {
+  ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1,
+  ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
+  ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+  ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+  ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+  ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1,
+  ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+  ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+  ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1,
+  ['7'] = 1, ['8'] = 1, ['9'] = 1,
+  ['-'] = 1, ['.'] = 1, ['_'] = 1, ['~'] = 1
+};
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+/// Classify 16 bytes at once
+/// \param p data to classify
+/// \param keepSlash when non-zero '/' counts as unreserved
+/// \return bit mask with a bit set for each unreserved byte
+static inline unsigned __url_unreserved_mask ( const char * p, int keepSlash )
+{
+  __m128i c = _mm_loadu_si128 ( (const __m128i*)p );
+  /// Fold lower case onto upper case for the letter range check
+  __m128i up = _mm_and_si128 ( c, _mm_set1_epi8 ( (char)0xDF ));
+  /// Biasing by 0x80 turns the signed compares into unsigned range checks
+  __m128i alpha = _mm_cmplt_epi8 ( _mm_add_epi8 ( up, _mm_set1_epi8 ( (char)(0x80 - 'A'))),
+				   _mm_set1_epi8 ( (char)(0x80 + 26)));
+  __m128i digit = _mm_cmplt_epi8 ( _mm_add_epi8 ( c, _mm_set1_epi8 ( (char)(0x80 - '0'))),
+				   _mm_set1_epi8 ( (char)(0x80 + 10)));
+  __m128i other = _mm_or_si128 
+    ( _mm_or_si128 ( _mm_cmpeq_epi8 ( c, _mm_set1_epi8 ( '-' )),
+		     _mm_cmpeq_epi8 ( c, _mm_set1_epi8 ( '.' ))),
+      _mm_or_si128 ( _mm_cmpeq_epi8 ( c, _mm_set1_epi8 ( '_' )),
+		     _mm_cmpeq_epi8 ( c, _mm_set1_epi8 ( '~' ))));
+  if ( keepSlash )
+    other = _mm_or_si128 ( other, _mm_cmpeq_epi8 ( c, _mm_set1_epi8 ( '/' )));
+  return _mm_movemask_epi8 ( _mm_or_si128 ( _mm_or_si128 ( alpha, digit ), other ));
+}
+#endif
+
+/// Compute the exact length of URL encoded string
+/// \param src source string
+/// \param len length of the source
+/// \param keepSlash when non-zero '/' is not encoded
+/// \return length of the encoded string (not counting NUL)
+static int __aws_urlencode_len ( const char * src, int len, int keepSlash )
+{
+  int n = len;
+  int i = 0;
+#ifdef __SSE2__
+  for ( ; i + 16 <= len ; i += 16 )
+    n += 2 * __builtin_popcount ( ~__url_unreserved_mask ( src + i, keepSlash ) & 0xFFFF );
+#endif
+  for ( ; i < len ; i ++ )
+    if ( ! urlUnreserved [ (unsigned char)src[i] ] && 
+	 ! ( keepSlash && src[i] == '/' )) n += 2;
+  return n;
+}
 
-/*!
-  \defgroup conf Configuration Functions
-  \{
-*/
+/// URL encode (RFC 3986) a block of data
+/// \param src source data
+/// \param len length of the source
+/// \param dest destination buffer
+/// \param nDest size of the destination buffer
+/// \param keepSlash when non-zero '/' is not encoded (for URI paths)
+/// \return length of the encoded string or AWS_ERR_ENCODE 
+///         if the destination is too small
+static int __aws_urlencode_n ( const char * src, int len, 
+			       char * dest, int nDest, int keepSlash )
+{
+  const char * hexDigit = "0123456789ABCDEF";
+  int i = 0;
+  int n = 0;
 
-/// Initialize  the library 
-void aws_init () { curl_global_init (CURL_GLOBAL_ALL); }
+  if ( __aws_urlencode_len ( src, len, keepSlash ) >= nDest ) 
+    {
+      __debug ( "URLEncode:: Dest buffer too small" );
+      return AWS_ERR_ENCODE;
+    }
+
+  while ( i < len )
+    {
+#ifdef __SSE2__
+      /// Copy runs of unreserved bytes 16 at a time
+      if ( i + 16 <= len )
+	{
+	  unsigned m = __url_unreserved_mask ( src + i, keepSlash );
+	  if ( m == 0xFFFF ) 
+	    { memcpy ( dest + n, src + i, 16 ); i += 16; n += 16; continue; }
+	  int run = __builtin_ctz ( ~m );
+	  memcpy ( dest + n, src + i, run ); 
+	  i += run; n += run;
+	}
+#endif
+      unsigned char c = src[i++];
+      if ( urlUnreserved[c] || ( keepSlash && c == '/' )) dest[n++] = c;
+      else
+	{
+	  dest[n++] = '%'; 
+	  dest[n++] = hexDigit [ c >> 4 ];
+	  dest[n++] = hexDigit [ c & 0xF ];
+	}
+    }
+  dest[n] = 0;
+  return n;
+}
+
+/// URL encode (RFC 3986) a string
+/// \param src source string
+/// \param dest destination buffer
+/// \param nDest size of the destination buffer
+/// \return length of the encoded string or AWS_ERR_ENCODE 
+///         if the destination is too small
+static int __aws_urlencode ( char * src, char * dest, int nDest )
+{
+  return __aws_urlencode_n ( src, strlen(src), dest, nDest, 0 );
+}
+
+/// URL encode the tail of a string buffer in place
+/// \param sb string buffer
+/// \param start offset of the first byte to encode
+/// \return 0 on success, AWS_ERR_NOMEM if memory can't be allocated
+///
+/// The buffer is grown to the exact encoded size and the data is
+/// encoded back to front, so no temporary copy is needed.
+static int __aws_urlencode_inplace ( StrBuf * sb, int start )
+{
+  const char * hexDigit = "0123456789ABCDEF";
+  int len = sb->len - start;
+  int extra = __aws_urlencode_len ( sb->buf + start, len, 0 ) - len;
+
+  if ( extra == 0 ) return 0;
+  if ( __strbuf_reserve ( sb, extra )) return AWS_ERR_NOMEM;
+
+  char * s = sb->buf + sb->len;
+  char * d = s + extra;
+  *d = 0;
+  while ( s > sb->buf + start )
+    {
+      unsigned char c = *--s;
+      if ( urlUnreserved[c] ) *--d = c;
+      else
+	{
+	  *--d = hexDigit [ c & 0xF ];
+	  *--d = hexDigit [ c >> 4 ];
+	  *--d = '%';
+	}
+    }
+  sb->len += extra;
+  return 0;
+}
+
+static int SQSRequest ( IOBuf *b, char * verb, char * const url, 
+			int op, const char * key )
+{
+  CURL* ch =  __curl_get ( );
+  struct curl_slist *slist=NULL;
+  AwsXfer x;
+
+  __xfer_init ( &x, b, 0 );
+  x.op  = op;
+  x.key = key;
+  x.prealloc = 1;
+  curl_easy_setopt ( ch, CURLOPT_URL, url );
+  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+  curl_easy_setopt ( ch, CURLOPT_INFILESIZE, b->len );
+  curl_easy_setopt ( ch, CURLOPT_POST, 1 );
+  curl_easy_setopt ( ch, CURLOPT_POSTFIELDSIZE , 0 );
+  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
+  curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writefunc );
+  curl_easy_setopt ( ch, CURLOPT_WRITEDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_READFUNCTION, readfunc );
+  curl_easy_setopt ( ch, CURLOPT_READDATA, &x );
+
+  int  sc  = __aws_perform ( ch, &x );
+  /** \todo check the return code  */
+  
+  curl_slist_free_all(slist);
+  __curl_put ( ch );
+
+  return sc;
+}
+
+/// Sign SQS request
+/// \param str string to sign
+/// \param sig buffer for URL encoded signature
+/// \param sigSize size of the sig buffer
+static void SQSSign ( char * str, char * sig, int sigSize )
+{
+  char signature[64];
+  __aws_sign ( str, signature, sizeof(signature) );
+
+  if ( __aws_urlencode ( signature, sig, sigSize ) < 0 ) sig[0] = 0;
+}
+
+
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup conf Configuration Functions
+  \{
+*/
+
+/// Initialize  the library 
+void aws_init () { curl_global_init (CURL_GLOBAL_ALL); }
 
 /// Set debuging output
 /// \param d  when non-zero causes debugging output to be printed
@@ -456,23 +1478,115 @@ void aws_set_debug (int d)
 /// \brief Set AWS account ID to be read from .awsAuth file
 /// \param id new account ID
 void aws_set_id ( char * const id )     
-{ ID = id == NULL ? NULL : strdup(id); }
+{ ID = id == NULL ? NULL : __aws_strdup(id); }
 
 /// Set AWS account access key
 /// \param key new AWS authentication key
 void aws_set_key ( char * const key )   
-{ awsKey = key == NULL ? NULL : strdup(key); }
+{ 
+  awsKey = key == NULL ? NULL : __aws_strdup(key); 
+  __aws_sign_setkey ( awsKey );
+}
 
 /// Set AWS account access key ID
 /// \param keyid new AWS key ID
 void aws_set_keyid ( char * const keyid ) 
-{ awsKeyID = keyid == NULL ? NULL :  strdup(keyid);}
+{ awsKeyID = keyid == NULL ? NULL :  __aws_strdup(keyid);}
 
 /// Set reduced redundancy storage
 /// \param r  when non-zero causes puts to use RRS
 void aws_set_rrs (int r) 
 { useRrs = r; }
 
+/// Select request signing scheme for S3
+/// \param v  when non-zero requests are signed with AWS Signature
+///           Version 4, otherwise with Version 2
+void aws_set_sigv4 ( int v )
+{ sigV4 = v; }
+
+/// Select checksums used to verify S3 transfers
+/// \param flags  combination of AWS_CHECKSUM_MD5 and AWS_CHECKSUM_CRC32C
+///
+/// Uploads compute the checksums before the body goes out and send
+/// them with it: MD5 as Content-MD5, CRC32C as x-amz-checksum-crc32c
+/// or, with Signature Version 4, in an aws-chunked trailer.  S3
+/// refuses a body that does not match with 400 BadDigest and does 
+/// not store it.
+///
+/// Downloads compute the checksums while the data comes in.  MD5 is
+/// compared with the ETag and, with Signature Version 4, S3 is asked
+/// to return the CRC32C.  This happens after the fact: on a mismatch
+/// the data is already in the buffer and the call fails with 
+/// AWS_ERR_CHECKSUM.
+void aws_set_checksum ( int flags )
+{ checksums = flags; }
+
+/// Record timing of every request in the timing field of its IOBuf
+/// \param t 1 to turn on, 0 to turn off
+void aws_set_timing ( int t )
+{ timing = t; }
+
+/// Set the allocator used for all memory the library allocates.  
+/// Set it before anything else, memory is released with the
+/// allocator current at the time.
+/// \param alloc malloc replacement, NULL to go back to the C library
+/// \param resize realloc replacement
+/// \param release free replacement
+void aws_set_allocator ( void * (*alloc) ( size_t ), 
+			 void * (*resize) ( void *, size_t ),
+			 void (*release) ( void * ))
+{
+  awsMalloc  = alloc   ? alloc   : malloc;
+  awsRealloc = resize  ? resize  : realloc;
+  awsFree    = release ? release : free;
+}
+
+/// Count requests in the metrics registry, see aws_metrics_snapshot
+/// \param on 1 to turn on, 0 to turn off
+void aws_set_metrics ( int on )
+{ metricsOn = on; }
+
+/// Set hooks called as each request goes through its lifecycle, 
+/// e.g. to feed a tracing system.  The hooks run on the thread
+/// making the request and should return quickly.  Set them before
+/// requests start.
+/// \param h hooks to copy, NULL to remove them
+void aws_set_hooks ( const AwsHooks * h )
+{
+  hooksOn = 0;
+  if ( h == NULL ) return;
+  hooks   = *h;
+  hooksOn = 1;
+}
+
+/// Record request events in a per thread ring buffer that 
+/// aws_trace_dump writes out.  Unlike aws_set_debug it is cheap
+/// enough to leave on under load.
+/// \param on 1 to turn on, 0 to turn off
+void aws_set_trace ( int on )
+{ traceOn = on; }
+
+/// Pace requests per endpoint and per key prefix (the object path 
+/// up to its last '/', or the queue for SQS).  Each keeps a token
+/// bucket and an in-flight cap shared by all threads.  Both grow
+/// while requests succeed and are cut by 30% on 503 or 429 responses, 
+/// which are then resent after a backoff.  Growth pauses while 
+/// latency is well above the fastest seen.  Set it before requests
+/// start.
+/// \param rc limits to start from, NULL to turn rate control off
+void aws_set_rate_control ( const AwsRateControl * rc )
+{
+  rateOn = 0;
+  if ( rc == NULL ) return;
+  rateConf = *rc;
+  rateOn   = 1;
+}
+
+/// Set AWS region used in the Signature Version 4 credential scope
+/// \param str region name, e.g. "us-east-1"
+void aws_set_region ( char * const str )
+{ Region = str == NULL ? "us-east-1" : __aws_strdup(str); }
+
 
 
 
@@ -553,57 +1667,199 @@ int aws_read_config ( char * const id )
 /// Select current S3 bucket
 /// \param str bucket ID
 void s3_set_bucket ( char * const str ) 
-{ Bucket = str == NULL ? NULL : strdup(str); }
+{ Bucket = str == NULL ? NULL : __aws_strdup(str); }
 
 /// Set S3 host
 void s3_set_host ( char * const str )  
-{ S3Host = str == NULL ? NULL :  strdup(str); }
+{ S3Host = str == NULL ? NULL :  __aws_strdup(str); }
 
 /// Set S3 MimeType
 void s3_set_mime ( char * const str )
-{ MimeType = str ? strdup(str) : NULL; }
+{ MimeType = str ? __aws_strdup(str) : NULL; }
 
 /// Set S3 AccessControl
 void s3_set_acl ( char * const str )
-{ AccessControl = str ? strdup(str) : NULL; }
+{ AccessControl = str ? __aws_strdup(str) : NULL; }
+
+/// Compress uploads and decompress downloads
+/// \param method AWS_COMPRESS_* method, AWS_COMPRESS_NONE to turn it off
+/// \param level compression level of the method, 0 for its default
+/// \return 0 or AWS_ERR_UNSUPPORTED if the method is not compiled in
+///
+/// Objects are stored with Content-Encoding set to the method.  While
+/// it is on, s3_get decodes any gzip or zstd encoded object it can.
+int s3_set_compression ( int method, int level )
+{
+  if ( !__codec_supported ( method )) return AWS_ERR_UNSUPPORTED;
+  s3Compress = method;
+  s3Level    = level;
+  return 0;
+}
+
+
+/// Compute checksums of an upload body before it goes out and set
+/// the headers that carry them, so that S3 refuses a body that was 
+/// corrupted on the way.  Content-MD5 is always sent.  With 
+/// Signature Version 4 the CRC32C goes in the aws-chunked trailer 
+/// instead of x-amz-checksum-crc32c.
+/// \internal
+/// \param b I/O buffer, its unread data is the body
+/// \param packed compressed body sent instead, or NULL
+/// \param amz headers of the request
+static void __put_checksums ( IOBuf * b, const StrBuf * packed, AmzHeaders * amz )
+{
+  unsigned char md[MD5_DIGEST_LENGTH];
+  unsigned crc = 0;
+  int md5 = checksums & AWS_CHECKSUM_MD5;
+  int crc32c = ( checksums & AWS_CHECKSUM_CRC32C ) && !sigV4;
+  IOBufNode * N;
+  char * p;
+  MD5_CTX m;
+
+  MD5_Init ( &m );
+  if ( packed )
+    {
+      if ( md5 ) MD5_Update ( &m, packed->buf, packed->len );
+      if ( crc32c ) crc = aws_crc32c ( crc, packed->buf, packed->len );
+    }
+  else
+    for ( N = b->current, p = b->pos ; N ; N = N->next, p = N ? N->buf : NULL )
+      {
+	int k = N->buf + N->len - p;
+	if ( md5 ) MD5_Update ( &m, p, k );
+	if ( crc32c ) crc = aws_crc32c ( crc, p, k );
+      }
 
+  if ( md5 )
+    {
+      MD5_Final ( md, &m );
+      aws_b64_encode ( md, sizeof(md), amz->md5, sizeof(amz->md5));
+    }
+  if ( crc32c )
+    {
+      char v[16];
+      __crc32c_b64 ( crc, v );
+      __amz_set ( amz, "x-amz-checksum-crc32c", v );
+    }
+}
 
 /// Upload the file into currently selected bucket
-/// \param b I/O buffer
-/// \param file filename
-int s3_put ( IOBuf * b, char * const file )
+/// \internal
+/// \param compress s3Compress, or AWS_COMPRESS_NONE to store as is
+/// \param neg forget the object in the negative cache, 0 for parts
+///        of a multipart upload, which are no objects of their own
+static int __s3_put ( IOBuf * b, char * const file, int compress, int neg )
 {
   char * const method = "PUT";
   char  resource [1024];
   char * date = NULL;
+  char  auth [1024];
+  AmzHeaders amz = { 0 };
+  StrBuf packed = { NULL, 0, 0 };
+  int   len = b->len;
+  unsigned long long fp = negOn && neg ? __neg_key ( file ) : 0;
+
+  if ( compress )
+    {
+      /// Content-Length has to be known up front, so the body is 
+      /// compressed before the request starts
+      int rc = __codec_compress_iobuf ( b, &packed, compress, s3Level );
+      if ( rc ) { __strbuf_free ( &packed ); return rc; }
+      len = packed.len;
+    }
+
+  if ( AccessControl ) __amz_set ( &amz, "x-amz-acl", AccessControl );
+  if ( useRrs ) __amz_set ( &amz, "x-amz-storage-class", "REDUCED_REDUNDANCY" );
+  if ( checksums ) __put_checksums ( b, compress ? &packed : NULL, &amz );
+  if ( sigV4 && ( checksums & AWS_CHECKSUM_CRC32C ))
+    {
+      /// The CRC32C is computed while the body goes out and 
+      /// sent as a trailer after it
+      char decLen[16];
+      snprintf ( decLen, sizeof(decLen), "%d", len );
+      __amz_set ( &amz, "x-amz-content-sha256", "STREAMING-UNSIGNED-PAYLOAD-TRAILER" );
+      __amz_set ( &amz, "x-amz-decoded-content-length", decLen );
+      __amz_set ( &amz, "x-amz-trailer", "x-amz-checksum-crc32c" );
+    }
 
-  char * signature = GetStringToSign ( resource, sizeof(resource), 
-				       &date, method, Bucket, file ); 
-  int sc = s3_do_put( b, signature, date, resource ); 
-  free ( signature );
+  GetStringToSign ( resource, sizeof(resource), &date, method, Bucket, file,
+		    &amz, auth, sizeof(auth) ); 
+  /// A download that starts during the upload may still miss
+  /// the object, so it is forgotten on both sides
+  if ( fp ) __neg_forget ( fp );
+  int sc = s3_do_put( b, auth, date, resource, &amz, compress ? &packed : NULL ); 
+  if ( fp ) __neg_forget ( fp );
+  __strbuf_free ( &packed );
   return sc;
 
 }
 
+/// Upload the file into currently selected bucket
+/// \param b I/O buffer
+/// \param file filename
+int s3_put ( IOBuf * b, char * const file )
+{ return __s3_put ( b, file, s3Compress, 1 ); }
+
 
 /// Download the file from the current bucket
-/// \param b I/O buffer
-/// \param file filename 
-int s3_get ( IOBuf * b, char * const file )
+/// \internal
+/// \param range value of the Range header, NULL for the whole file
+static int __s3_get ( IOBuf * b, char * const file, const char * range )
 {
   char * const method = "GET";
   
   char  resource [1024];
   char * date = NULL;
+  char  auth [1024];
+  AmzHeaders amz = { 0 };
 
+  if (( checksums & AWS_CHECKSUM_CRC32C ) && range == NULL )
+    __amz_set ( &amz, "x-amz-checksum-mode", "ENABLED" );
   
-  char * signature = GetStringToSign ( resource, sizeof(resource), 
-				       &date, method, Bucket, file ); 
-  int sc = s3_do_get( b, signature, date, resource ); 
-  free ( signature );
+  GetStringToSign ( resource, sizeof(resource), &date, method, Bucket, file,
+		    &amz, auth, sizeof(auth) ); 
+  return s3_do_get( b, auth, date, resource, &amz, range ); 
+}
+
+/// Download the file from the current bucket
+/// \param b I/O buffer
+/// \param file filename 
+int s3_get ( IOBuf * b, char * const file )
+{
+  unsigned long long fp = 0;
+  unsigned epoch = 0;
+
+  if ( negOn )
+    {
+      fp = __neg_key ( file );
+      if ( __neg_lookup ( fp ))
+	{
+	  b->code = 404;
+	  __iobuf_set ( b, &b->result, "404 Not Found" );
+	  return 0;
+	}
+      epoch = __neg_epoch ( fp );
+    }
+  int sc = coalesceOn ? __coalesce_get ( b, file ) : __s3_get ( b, file, NULL );
+  if ( fp && sc == 0 && b->code == 404 ) __neg_insert ( fp, epoch );
   return sc;
 }
 
+/// Download part of the file from the current bucket.  The server
+/// answers with code 206 and the bytes in range, which may be fewer
+/// at the end of the file.  Checksums are not verified and the data
+/// is not decompressed, as both cover the whole file.
+/// \param b I/O buffer
+/// \param file filename 
+/// \param offset first byte to get
+/// \param len number of bytes to get, at least 1
+int s3_get_range ( IOBuf * b, char * const file, long offset, long len )
+{
+  char range[64];
+  snprintf ( range, sizeof(range), "bytes=%ld-%ld", offset, offset + len - 1 );
+  return __s3_get ( b, file, range );
+}
+
 /// Delete the file from the currently selected bucket
 /// \param file filename
 int s3_delete ( IOBuf * b, char * const file )
@@ -612,182 +1868,3822 @@ int s3_delete ( IOBuf * b, char * const file )
   
   char  resource [1024];
   char * date = NULL;
-  char * signature = GetStringToSign ( resource, sizeof(resource), 
-				       &date, method, Bucket, file ); 
-  int sc = s3_do_delete( b, signature, date, resource ); 
-  free ( signature );
+  char  auth [1024];
+  AmzHeaders amz = { 0 };
 
+  GetStringToSign ( resource, sizeof(resource), &date, method, Bucket, file,
+		    &amz, auth, sizeof(auth) ); 
+  return s3_do_delete( b, auth, date, resource, &amz ); 
 
+}
 
-  return sc;
+/// Send a POST to a file of the current bucket, e.g. to start or 
+/// complete a multipart upload
+/// \internal
+/// \param file filename with the query, e.g. "name?uploads"
+/// \param body request body, may be NULL
+/// \param len length of the body
+static int __s3_post ( IOBuf * b, char * const file, const char * body, int len )
+{
+  char * const method = "POST";
+  
+  char  resource [1024];
+  char * date = NULL;
+  char  auth [1024];
+  AmzHeaders amz = { 0 };
 
+  GetStringToSign ( resource, sizeof(resource), &date, method, Bucket, file,
+		    &amz, auth, sizeof(auth) ); 
+  return s3_do_post( b, auth, date, resource, &amz, body, len ); 
 }
 
 
 
-static int s3_do_put ( IOBuf *b, char * const signature, 
-		       char * const date, char * const resource )
+/// Presign a GET request for one object
+/// \internal
+/// \param file filename
+/// \param ts request timestamp shared by the whole batch
+/// \param expires validity of the URL in seconds
+/// \param url output buffer
+/// \param size size of the output buffer
+/// \return length of the URL or an error code
+static int __s3_presign ( char * const file, const AwsTimestamp * ts, 
+			  int expires, char * url, int size )
 {
-  char Buf[1024];
+  char  path[2048];
+  char  query[512];
+  char  canonReq[4096];
+  char  sig[2*SHA256_DIGEST_LENGTH+1];
+  int   n = 0;
+
+  /// EU: If bucket is in virtual host name, it is not part of the path
+  int inHost = Bucket && strncmp ( S3Host, Bucket, strlen(Bucket)) == 0;
+  if ( Bucket != NULL )
+    n = snprintf ( path, sizeof(path), "%s/", Bucket );
+  int k = __aws_urlencode_n ( file, strlen(file), path + n, sizeof(path) - n, 1 );
+  if ( k < 0 ) return k;
+  char * uriPath = inHost ? path + n : path;
+
+  if ( sigV4 )
+    {
+      snprintf ( query, sizeof(query), 
+		 "X-Amz-Algorithm=AWS4-HMAC-SHA256"
+		 "&X-Amz-Credential=%s%%2F%.8s%%2F%s%%2Fs3%%2Faws4_request"
+		 "&X-Amz-Date=%s&X-Amz-Expires=%d&X-Amz-SignedHeaders=host",
+		 awsKeyID, ts->amz, Region, ts->amz, expires );
+      snprintf ( canonReq, sizeof(canonReq), 
+		 "GET\n/%s\n%s\nhost:%s\n\nhost\nUNSIGNED-PAYLOAD",
+		 uriPath, query, S3Host );
+      __aws_sign_v4 ( (char*)ts->amz, Region, "s3", canonReq, sig );
+      n = snprintf ( url, size, "http://%s/%s?%s&X-Amz-Signature=%s",
+		     S3Host, uriPath, query, sig );
+    }
+  else
+    {
+      char  b64[64];
+      long  exp = (long) ts->t + expires;
+
+      snprintf ( canonReq, sizeof(canonReq), "GET\n\n\n%ld\n/%s", exp, path );
+      __aws_sign ( canonReq, b64, sizeof(b64) );
+      if ( __aws_urlencode ( b64, sig, sizeof(sig)) < 0 ) return AWS_ERR_ENCODE;
+      n = snprintf ( url, size, "http://%s/%s?AWSAccessKeyId=%s&Expires=%ld&Signature=%s",
+		     S3Host, uriPath, awsKeyID, exp, sig );
+    }
+
+  return n < size ? n : AWS_ERR_SPACE;
+}
+
+/// Generate presigned URL for downloading a file 
+/// from the currently selected bucket
+/// \param file filename
+/// \param expires validity of the URL in seconds
+/// \param url buffer for the URL
+/// \param size size of the url buffer
+/// \return length of the URL, AWS_ERR_SPACE if the buffer is too small
+///
+/// The URL uses query string authentication, so anyone holding it can
+/// GET the object until it expires without having the credentials.
+int s3_presign_url ( char * const file, int expires, char * url, int size )
+{
+  return __s3_presign ( file, __aws_timestamp (), expires, url, size );
+}
+
+/// Generate presigned URLs for a list of files
+/// \param files array of filenames
+/// \param n number of files
+/// \param expires validity of the URLs in seconds
+/// \param buf buffer the URLs are written to, one after another
+/// \param size size of the buffer
+/// \param urls array of n pointers, filled with the start of each URL
+/// \return number of bytes used in buf or 
+///         AWS_ERR_SPACE if the buffer is too small
+///
+/// All URLs in a batch share the same timestamp and signing state, 
+/// so a batch only costs one hash and one HMAC per URL.
+int s3_presign_urls ( char * const * files, int n, int expires,
+		      char * buf, int size, char ** urls )
+{
+  const AwsTimestamp * ts = __aws_timestamp ();
+  int used = 0;
+  int i;
+
+  for ( i = 0 ; i < n ; i ++ )
+    {
+      int rc = __s3_presign ( files[i], ts, expires, buf + used, size - used );
+      if ( rc < 0 ) return rc;
+      urls[i] = buf + used;
+      used += rc + 1;
+    }
+  return used;
+}
+
+
 
-  CURL* ch =  curl_easy_init( );
+static int s3_do_put ( IOBuf *b, char * const auth, 
+		       char * const date, char * const resource,
+		       const AmzHeaders * amz, StrBuf * packed )
+{
+  char Buf[2048];
+
+  CURL* ch =  __curl_get ( );
   struct curl_slist *slist=NULL;
+  AwsXfer x;
+
+  /// The other checksums were sent as headers by __put_checksums
+  __xfer_init ( &x, b, __amz_get ( amz, "x-amz-trailer" ) ? AWS_CHECKSUM_CRC32C : 0 );
+  x.op      = AWS_OP_S3_PUT;
+  x.key     = resource;
+  x.packed  = packed;
+  x.chunked = __amz_get ( amz, "x-amz-trailer" ) != NULL;
+  x.left    = packed ? packed->len : b->len;
 
   if (MimeType) {
     snprintf ( Buf, sizeof(Buf), "Content-Type: %s", MimeType );
     slist = curl_slist_append(slist, Buf );
   }
 
-  if (AccessControl) {
-    snprintf ( Buf, sizeof(Buf), "x-amz-acl: %s", AccessControl );
-    slist = curl_slist_append(slist, Buf );
-  }
+  if ( x.chunked || packed )
+    {
+      snprintf ( Buf, sizeof(Buf), "Content-Encoding: %s%s%s", 
+		 x.chunked ? "aws-chunked" : "", 
+		 x.chunked && packed ? "," : "",
+		 packed ? __codec_name ( s3Compress ) : "" );
+      slist = curl_slist_append(slist, Buf );
+    }
+
+  slist = __s3_auth_headers ( slist, auth, date, amz );
+
+  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host , resource );
+
+  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
+  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
+  curl_easy_setopt ( ch, CURLOPT_READDATA, &x );
+  if (!debug)
+    curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writedummyfunc );
+  curl_easy_setopt ( ch, CURLOPT_READFUNCTION, readfunc );
+  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
+  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+  curl_easy_setopt ( ch, CURLOPT_UPLOAD, 1 );
+  curl_easy_setopt ( ch, CURLOPT_INFILESIZE, 
+		     x.chunked ? __xfer_chunked_len ( x.left ) : x.left );
+  curl_easy_setopt ( ch, CURLOPT_FOLLOWLOCATION, 1 );
+  x.follow = 1;
+
+  int  sc  = __aws_perform ( ch, &x );
+  /** \todo check the return code  */
+  if ( sc == 0 ) sc = __xfer_verify ( &x );
+  
+  curl_slist_free_all(slist);
+  __curl_put ( ch );
+
+  return sc;
+
+}
 
-  if (useRrs) {
-    strncpy ( Buf, "x-amz-storage-class: REDUCED_REDUNDANCY", sizeof(Buf) );
-    slist = curl_slist_append(slist, Buf );  }
 
+static int s3_do_get ( IOBuf *b, char * const auth, 
+		       char * const date, char * const resource,
+		       const AmzHeaders * amz, const char * range )
+{
+  char Buf[2048];
+
+  CURL* ch =  __curl_get ( );
+  struct curl_slist *slist=NULL;
+  AwsXfer x;
+
+  __xfer_init ( &x, b, range ? 0 : checksums );
+  x.op     = AWS_OP_S3_GET;
+  x.key    = resource;
+  x.prealloc = 1;
+  x.decode = s3Compress != AWS_COMPRESS_NONE && range == NULL;
+
+  slist = curl_slist_append(slist, "If-Modified-Since: Tue, 26 May 2009 18:58:55 GMT" );
+  slist = curl_slist_append(slist, "ETag: \"6ea58533db38eca2c2cc204b7550aab6\"");
+
+  slist = __s3_auth_headers ( slist, auth, date, amz );
+  if ( range )
+    {
+      snprintf ( Buf, sizeof(Buf), "Range: %s", range );
+      slist = curl_slist_append ( slist, Buf );
+    }
+
+  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host, resource );
+
+  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
+  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
+  curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writefunc );
+  curl_easy_setopt ( ch, CURLOPT_WRITEDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
+  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+
+  int  sc  = __aws_perform ( ch, &x );
+  /** \todo check the return code  */
+  /// A truncated compressed stream is as bad as a corrupt one
+  if ( x.decodeErr || ( sc == 0 && x.dec.method && !x.dec.ended ))
+    sc = AWS_ERR_COMPRESS;
+  if ( sc == 0 ) sc = __xfer_verify ( &x );
+  __codec_end ( &x.dec );
+  
+  curl_slist_free_all(slist);
+  __curl_put ( ch );
+
+  return sc;
+
+}
+
+static int s3_do_delete ( IOBuf *b, char * const auth, 
+		       char * const date, char * const resource,
+		       const AmzHeaders * amz )
+{
+  char Buf[2048];
+
+  CURL* ch =  __curl_get ( );
+  struct curl_slist *slist=NULL;
+  AwsXfer x;
+
+  __xfer_init ( &x, b, 0 );
+  x.op  = AWS_OP_S3_DELETE;
+  x.key = resource;
+
+  slist = __s3_auth_headers ( slist, auth, date, amz );
+
+  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host, resource );
+
+  curl_easy_setopt ( ch, CURLOPT_CUSTOMREQUEST, "DELETE");
+  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
+  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
+  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
+  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+
+  int  sc  = __aws_perform ( ch, &x );
+  /** \todo check the return code  */
+
+  
+  curl_slist_free_all(slist);
+  __curl_put ( ch );
+
+  return sc;
+
+}
+
+static int s3_do_post ( IOBuf *b, char * const auth, 
+			char * const date, char * const resource,
+			const AmzHeaders * amz, const char * body, int len )
+{
+  char Buf[2048];
+
+  CURL* ch =  __curl_get ( );
+  struct curl_slist *slist=NULL;
+  AwsXfer x;
+
+  __xfer_init ( &x, b, 0 );
+  x.op  = AWS_OP_S3_POST;
+  x.key = resource;
+
+  /// No Content-Type, it would have to be signed
+  slist = curl_slist_append ( slist, "Content-Type:" );
+  slist = __s3_auth_headers ( slist, auth, date, amz );
+
+  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host, resource );
+
+  curl_easy_setopt ( ch, CURLOPT_POST, 1L );
+  curl_easy_setopt ( ch, CURLOPT_POSTFIELDS, body ? body : "" );
+  curl_easy_setopt ( ch, CURLOPT_POSTFIELDSIZE, (long) len );
+  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
+  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
+  curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writefunc );
+  curl_easy_setopt ( ch, CURLOPT_WRITEDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
+  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, &x );
+  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+
+  int  sc  = __aws_perform ( ch, &x );
+
+  curl_slist_free_all(slist);
+  __curl_put ( ch );
+
+  return sc;
+}
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup sign Request Signing
+  \{
+*/
+
+/// Keyed HMAC-SHA1 state
+///
+/// Holds the digest contexts after absorbing the inner and outer key
+/// pads.  Signing a string only requires copying them, which is a plain
+/// struct assignment, and hashing the message.
+typedef struct
+{
+  SHA_CTX in;     /// <state after hashing key ^ ipad
+  SHA_CTX out;    /// <state after hashing key ^ opad
+} HmacSha1;
+
+/// Keyed HMAC-SHA256 state. See HmacSha1
+typedef struct
+{
+  SHA256_CTX in;  /// <state after hashing key ^ ipad
+  SHA256_CTX out; /// <state after hashing key ^ opad
+} HmacSha256;
+
+/// Cached Signature Version 4 signing key
+typedef struct
+{
+  unsigned   gen;         /// <credential generation the key belongs to
+  char       date[9];     /// <YYYYMMDD the key was derived for
+  char       region[32];  /// <region of the credential scope
+  char       service[16]; /// <service of the credential scope
+  HmacSha256 key;         /// <keyed state of the derived signing key
+} SigV4Key;
+
+#define SIGV4_CACHE_SIZE 4
+
+static HmacSha1   signKeyV2;       /// <keyed state of awsKey
+static HmacSha256 signKeyV4;       /// <keyed state of "AWS4" + awsKey
+static unsigned   signKeyGen = 0;  /// <bumped each time the key changes
+
+/// Per thread cache of derived SigV4 keys, so that concurrent
+/// signers never need a lock
+static __thread SigV4Key sigV4Cache[SIGV4_CACHE_SIZE];
+static __thread int      sigV4Next = 0;
+
+/// Precompute HMAC-SHA1 state for a key
+/// \param h   state to initialize
+/// \param key key material
+/// \param len length of the key
+static void __hmac_sha1_init ( HmacSha1 * h, const void * key, size_t len )
+{
+  unsigned char k[SHA_CBLOCK];
+  unsigned char pad[SHA_CBLOCK];
+  int i;
+
+  memset ( k, 0, sizeof(k) );
+  if ( len > SHA_CBLOCK )
+    {
+      SHA_CTX c;
+      SHA1_Init ( &c );
+      SHA1_Update ( &c, key, len );
+      SHA1_Final ( k, &c );
+    }
+  else if ( len ) memcpy ( k, key, len );
+
+  for ( i = 0 ; i < SHA_CBLOCK ; i ++ ) pad[i] = k[i] ^ 0x36;
+  SHA1_Init ( &h->in );
+  SHA1_Update ( &h->in, pad, SHA_CBLOCK );
+
+  for ( i = 0 ; i < SHA_CBLOCK ; i ++ ) pad[i] = k[i] ^ 0x5c;
+  SHA1_Init ( &h->out );
+  SHA1_Update ( &h->out, pad, SHA_CBLOCK );
+}
+
+/// Compute HMAC-SHA1 of a message using precomputed key state
+/// \param h   keyed state
+/// \param msg message
+/// \param len length of the message
+/// \param md  output, SHA_DIGEST_LENGTH bytes
+static void __hmac_sha1 ( const HmacSha1 * h, const void * msg, size_t len,
+			  unsigned char * md )
+{
+  SHA_CTX c = h->in;
+  SHA1_Update ( &c, msg, len );
+  SHA1_Final ( md, &c );
+
+  c = h->out;
+  SHA1_Update ( &c, md, SHA_DIGEST_LENGTH );
+  SHA1_Final ( md, &c );
+}
+
+/// Compute SHA256 on a stack context.  The one-shot SHA256() goes 
+/// through EVP in OpenSSL 3, which allocates.
+/// \param d   data
+/// \param len length of the data
+/// \param md  output, SHA256_DIGEST_LENGTH bytes
+static void __sha256 ( const void * d, size_t len, unsigned char * md )
+{
+  SHA256_CTX c;
+  SHA256_Init ( &c );
+  SHA256_Update ( &c, d, len );
+  SHA256_Final ( md, &c );
+}
+
+/// Precompute HMAC-SHA256 state for a key
+/// \param h   state to initialize
+/// \param key key material
+/// \param len length of the key
+static void __hmac_sha256_init ( HmacSha256 * h, const void * key, size_t len )
+{
+  unsigned char k[SHA256_CBLOCK];
+  unsigned char pad[SHA256_CBLOCK];
+  int i;
+
+  memset ( k, 0, sizeof(k) );
+  if ( len > SHA256_CBLOCK ) __sha256 ( key, len, k );
+  else if ( len ) memcpy ( k, key, len );
+
+  for ( i = 0 ; i < SHA256_CBLOCK ; i ++ ) pad[i] = k[i] ^ 0x36;
+  SHA256_Init ( &h->in );
+  SHA256_Update ( &h->in, pad, SHA256_CBLOCK );
+
+  for ( i = 0 ; i < SHA256_CBLOCK ; i ++ ) pad[i] = k[i] ^ 0x5c;
+  SHA256_Init ( &h->out );
+  SHA256_Update ( &h->out, pad, SHA256_CBLOCK );
+}
+
+/// Compute HMAC-SHA256 of a message using precomputed key state
+/// \param h   keyed state
+/// \param msg message
+/// \param len length of the message
+/// \param md  output, SHA256_DIGEST_LENGTH bytes
+static void __hmac_sha256 ( const HmacSha256 * h, const void * msg, size_t len,
+			    unsigned char * md )
+{
+  SHA256_CTX c = h->in;
+  SHA256_Update ( &c, msg, len );
+  SHA256_Final ( md, &c );
+
+  c = h->out;
+  SHA256_Update ( &c, md, SHA256_DIGEST_LENGTH );
+  SHA256_Final ( md, &c );
+}
+
+/// Convert binary into lower case hex
+/// \param d   binary data
+/// \param len length of the data
+/// \param out output buffer, at least 2*len+1 bytes
+static void __hexify ( const unsigned char * d, int len, char * out )
+{
+  const char * hexDigit = "0123456789abcdef";
+  int i;
+  for ( i = 0 ; i < len ; i ++ )
+    {
+      *out++ = hexDigit [ d[i] >> 4 ];
+      *out++ = hexDigit [ d[i] & 0xF ];
+    }
+  *out = 0;
+}
+
+/// Precompute signing state for new key material
+/// \param key AWS secret key or NULL
+///
+/// Called whenever the key changes.  Bumps the key generation so that
+/// cached SigV4 keys derived from the old secret are not used anymore.
+static void __aws_sign_setkey ( char * const key )
+{
+  char v4Key[256];
+  const char * k = key ? key : "";
+
+  __hmac_sha1_init ( &signKeyV2, k, strlen(k) );
+
+  snprintf ( v4Key, sizeof(v4Key), "AWS4%s", k );
+  __hmac_sha256_init ( &signKeyV4, v4Key, strlen(v4Key) );
+  memset ( v4Key, 0, sizeof(v4Key) );
+
+  signKeyGen ++;
+}
+
+/// Find or derive SigV4 signing key for the credential scope
+/// \param date    date in YYYYMMDD format (only 8 chars are used)
+/// \param region  region name
+/// \param service service name
+/// \return keyed HMAC state of the signing key
+///
+/// The key only changes once a day, so it is kept in a small per
+/// thread cache and derived with four HMACs only on a miss.
+static const HmacSha256 * __aws_sigv4_key ( const char * date, 
+					    const char * region,
+					    const char * service )
+{
+  unsigned char k[SHA256_DIGEST_LENGTH];
+  HmacSha256 h;
+  int i;
+
+  for ( i = 0 ; i < SIGV4_CACHE_SIZE ; i ++ )
+    {
+      SigV4Key * e = &sigV4Cache[i];
+      if ( e->gen == signKeyGen && !strncmp ( e->date, date, 8 ) &&
+	   !strcmp ( e->region, region ) && !strcmp ( e->service, service ))
+	return &e->key;
+    }
+
+  __debug ( "Deriving SigV4 key for %.8s/%s/%s", date, region, service );
+  __hmac_sha256 ( &signKeyV4, date, 8, k );
+  __hmac_sha256_init ( &h, k, sizeof(k) );
+  __hmac_sha256 ( &h, region, strlen(region), k );
+  __hmac_sha256_init ( &h, k, sizeof(k) );
+  __hmac_sha256 ( &h, service, strlen(service), k );
+  __hmac_sha256_init ( &h, k, sizeof(k) );
+  __hmac_sha256 ( &h, "aws4_request", 12, k );
+
+  SigV4Key * e = &sigV4Cache[sigV4Next];
+  sigV4Next = ( sigV4Next + 1 ) % SIGV4_CACHE_SIZE;
+  __hmac_sha256_init ( &e->key, k, sizeof(k) );
+  snprintf ( e->date, sizeof(e->date), "%.8s", date );
+  snprintf ( e->region, sizeof(e->region), "%s", region );
+  snprintf ( e->service, sizeof(e->service), "%s", service );
+  e->gen = signKeyGen;
+  memset ( k, 0, sizeof(k) );
+  return &e->key;
+}
+
+/// Sign a string with AWS Signature Version 2 (HMAC-SHA1)
+/// \param str string to sign
+/// \param sig buffer for base64 encoded signature
+/// \param sigSize size of the sig buffer (29 bytes are enough)
+static void __aws_sign ( char * const str, char * sig, int sigSize )
+{
+  unsigned char MD[SHA_DIGEST_LENGTH];
+
+  __debug("StrToSign:%s", str );
+
+  __hmac_sha1 ( &signKeyV2, str, strlen(str), MD );
+
+  if ( aws_b64_encode ( MD, sizeof(MD), sig, sigSize ) < 0 ) sig[0] = 0;
+  __debug("Signature:  %s", sig );
+}
+
+/// Sign a canonical request with AWS Signature Version 4
+/// \param amzDate  request date in ISO8601 basic format
+/// \param region   region of the credential scope
+/// \param service  service of the credential scope
+/// \param canonReq canonical request
+/// \param sigHex   output, 2*SHA256_DIGEST_LENGTH+1 bytes
+static void __aws_sign_v4 ( char * const amzDate, char * const region,
+			    char * const service, char * const canonReq,
+			    char * sigHex )
+{
+  unsigned char MD[SHA256_DIGEST_LENGTH];
+  char  reqHash[2*SHA256_DIGEST_LENGTH+1];
+  char  strToSign[256];
+
+  __debug("CanonicalRequest:%s", canonReq );
+
+  __sha256 ( canonReq, strlen(canonReq), MD );
+  __hexify ( MD, sizeof(MD), reqHash );
+
+  int n = snprintf ( strToSign, sizeof(strToSign), 
+		     "AWS4-HMAC-SHA256\n%s\n%.8s/%s/%s/aws4_request\n%s",
+		     amzDate, amzDate, region, service, reqHash );
+  __debug("StrToSign:%s", strToSign );
+
+  __hmac_sha256 ( __aws_sigv4_key ( amzDate, region, service ), 
+		  strToSign, n, MD );
+  __hexify ( MD, sizeof(MD), sigHex );
+  __debug("Signature:  %s", sigHex );
+}
+/*!
+  \}
+*/
+
+
+
+/*!
+  \defgroup base64 Base64 Functions
+  \{
+*/
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) ) \
+  && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ))
+#define AWS_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+static const char b64Chars[] = 
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/// Reverse lookup table: 0..63 for base64 characters, 
+/// B64_SKIP for white space, B64_BAD for everything else
+#define B64_BAD  0xFF
+#define B64_SKIP 0xFE
+static unsigned char b64Values[256];
+
+/// Fill in the reverse lookup table
+static void __b64_init_values ()
+{
+  int i;
+  memset ( b64Values, B64_BAD, sizeof(b64Values) );
+  for ( i = 0 ; i < 64 ; i ++ ) b64Values[(unsigned char)b64Chars[i]] = i;
+  b64Values['\r'] = b64Values['\n'] = b64Values[' '] = b64Values['\t'] = B64_SKIP;
+}
+
+/// Encode complete 3 byte groups, scalar version
+/// \param src input, n has to be a multiple of 3
+/// \param n   number of input bytes
+/// \param dest output, 4*n/3 bytes
+static void __b64_encode_scalar ( const unsigned char * src, int n, char * dest )
+{
+  const unsigned char * end = src + n;
+  while ( src < end )
+    {
+      unsigned v = ( src[0] << 16 ) | ( src[1] << 8 ) | src[2];
+      dest[0] = b64Chars [ v >> 18 ];
+      dest[1] = b64Chars [ ( v >> 12 ) & 0x3F ];
+      dest[2] = b64Chars [ ( v >> 6 ) & 0x3F ];
+      dest[3] = b64Chars [ v & 0x3F ];
+      src += 3; dest += 4;
+    }
+}
+
+#ifdef AWS_HAVE_X86_SIMD
+/// Encode using SSSE3, 12 input bytes per step
+/// \return number of input bytes consumed (multiple of 3)
+///
+/// This is the algorithm by W. Mula and D. Lemire: the input bytes are
+/// shuffled so that each 32 bit lane holds 3 bytes, the 6 bit fields
+/// are moved into separate bytes with multiplies and mapped to ASCII
+/// by adding a per range offset.
+__attribute__((target("ssse3")))
+static int __b64_encode_ssse3 ( const unsigned char * src, int n, char * dest )
+{
+  const __m128i shuf = _mm_set_epi8 ( 10,11, 9,10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1 );
+  const __m128i shift = _mm_setr_epi8 ( 'a'-26, '0'-52, '0'-52, '0'-52, '0'-52,
+					'0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+					'0'-52, '+'-62, '/'-63, 'A', 0, 0 );
+  int i = 0;
+
+  for ( ; i + 16 <= n ; i += 12, dest += 16 )
+    {
+      __m128i in = _mm_loadu_si128 ( (const __m128i*)( src + i ));
+      in = _mm_shuffle_epi8 ( in, shuf );
+      __m128i t0 = _mm_and_si128 ( in, _mm_set1_epi32 ( 0x0fc0fc00 ));
+      __m128i t1 = _mm_mulhi_epu16 ( t0, _mm_set1_epi32 ( 0x04000040 ));
+      __m128i t2 = _mm_and_si128 ( in, _mm_set1_epi32 ( 0x003f03f0 ));
+      __m128i t3 = _mm_mullo_epi16 ( t2, _mm_set1_epi32 ( 0x01000010 ));
+      __m128i idx = _mm_or_si128 ( t1, t3 );
+
+      __m128i r = _mm_subs_epu8 ( idx, _mm_set1_epi8 ( 51 ));
+      __m128i lt = _mm_cmpgt_epi8 ( _mm_set1_epi8 ( 26 ), idx );
+      r = _mm_or_si128 ( r, _mm_and_si128 ( lt, _mm_set1_epi8 ( 13 )));
+      r = _mm_add_epi8 ( _mm_shuffle_epi8 ( shift, r ), idx );
+      _mm_storeu_si128 ( (__m128i*)dest, r );
+    }
+  return i;
+}
+
+/// Encode using AVX2, 24 input bytes per step. See __b64_encode_ssse3
+/// \return number of input bytes consumed (multiple of 3)
+__attribute__((target("avx2")))
+static int __b64_encode_avx2 ( const unsigned char * src, int n, char * dest )
+{
+  const __m256i shuf = _mm256_set_epi8 ( 10,11, 9,10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+					 10,11, 9,10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1 );
+  const __m256i shift = _mm256_setr_epi8 ( 'a'-26, '0'-52, '0'-52, '0'-52, '0'-52,
+					   '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+					   '0'-52, '+'-62, '/'-63, 'A', 0, 0,
+					   'a'-26, '0'-52, '0'-52, '0'-52, '0'-52,
+					   '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+					   '0'-52, '+'-62, '/'-63, 'A', 0, 0 );
+  int i = 0;
+
+  for ( ; i + 28 <= n ; i += 24, dest += 32 )
+    {
+      __m256i in = _mm256_inserti128_si256 
+	( _mm256_castsi128_si256 ( _mm_loadu_si128 ( (const __m128i*)( src + i ))),
+	  _mm_loadu_si128 ( (const __m128i*)( src + i + 12 )), 1 );
+      in = _mm256_shuffle_epi8 ( in, shuf );
+      __m256i t0 = _mm256_and_si256 ( in, _mm256_set1_epi32 ( 0x0fc0fc00 ));
+      __m256i t1 = _mm256_mulhi_epu16 ( t0, _mm256_set1_epi32 ( 0x04000040 ));
+      __m256i t2 = _mm256_and_si256 ( in, _mm256_set1_epi32 ( 0x003f03f0 ));
+      __m256i t3 = _mm256_mullo_epi16 ( t2, _mm256_set1_epi32 ( 0x01000010 ));
+      __m256i idx = _mm256_or_si256 ( t1, t3 );
+
+      __m256i r = _mm256_subs_epu8 ( idx, _mm256_set1_epi8 ( 51 ));
+      __m256i lt = _mm256_cmpgt_epi8 ( _mm256_set1_epi8 ( 26 ), idx );
+      r = _mm256_or_si256 ( r, _mm256_and_si256 ( lt, _mm256_set1_epi8 ( 13 )));
+      r = _mm256_add_epi8 ( _mm256_shuffle_epi8 ( shift, r ), idx );
+      _mm256_storeu_si256 ( (__m256i*)dest, r );
+    }
+  return i;
+}
+
+/// Decode using SSE4.1, 16 characters per step
+/// \return number of characters consumed (multiple of 4)
+///
+/// Stops at the first block containing anything except the 64 base64
+/// characters (padding, white space or garbage) and leaves it to the
+/// scalar code.  Stores 16 bytes for every 12 decoded ones.
+__attribute__((target("sse4.1")))
+static int __b64_decode_ssse3 ( const char * src, int n, unsigned char * dest )
+{
+  const __m128i lutLo = _mm_setr_epi8 ( 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+					0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A );
+  const __m128i lutHi = _mm_setr_epi8 ( 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+					0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 );
+  const __m128i lutRoll = _mm_setr_epi8 ( 0, 16, 19, 4, -65, -65, -71, -71,
+					  0, 0, 0, 0, 0, 0, 0, 0 );
+  const __m128i mask2F = _mm_set1_epi8 ( 0x2F );
+  const __m128i pack = _mm_setr_epi8 ( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 
+				       -1, -1, -1, -1 );
+  int i = 0;
+
+  for ( ; i + 16 <= n ; i += 16, dest += 12 )
+    {
+      __m128i in = _mm_loadu_si128 ( (const __m128i*)( src + i ));
+      __m128i hiNib = _mm_and_si128 ( _mm_srli_epi32 ( in, 4 ), mask2F );
+      __m128i loNib = _mm_and_si128 ( in, mask2F );
+      __m128i lo = _mm_shuffle_epi8 ( lutLo, loNib );
+      __m128i hi = _mm_shuffle_epi8 ( lutHi, hiNib );
+      if ( !_mm_testz_si128 ( lo, hi )) break;
+
+      __m128i eq2F = _mm_cmpeq_epi8 ( in, mask2F );
+      __m128i roll = _mm_shuffle_epi8 ( lutRoll, _mm_add_epi8 ( eq2F, hiNib ));
+      __m128i v = _mm_add_epi8 ( in, roll );
+
+      v = _mm_maddubs_epi16 ( v, _mm_set1_epi32 ( 0x01400140 ));
+      v = _mm_madd_epi16 ( v, _mm_set1_epi32 ( 0x00011000 ));
+      v = _mm_shuffle_epi8 ( v, pack );
+      _mm_storeu_si128 ( (__m128i*)dest, v );
+    }
+  return i;
+}
+
+/// Decode using AVX2, 32 characters per step. See __b64_decode_ssse3
+/// Stores 32 bytes for every 24 decoded ones.
+/// \return number of characters consumed (multiple of 4)
+__attribute__((target("avx2")))
+static int __b64_decode_avx2 ( const char * src, int n, unsigned char * dest )
+{
+  const __m256i lutLo = _mm256_setr_epi8 ( 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+					   0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+					   0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+					   0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A );
+  const __m256i lutHi = _mm256_setr_epi8 ( 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+					   0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+					   0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+					   0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 );
+  const __m256i lutRoll = _mm256_setr_epi8 ( 0, 16, 19, 4, -65, -65, -71, -71,
+					     0, 0, 0, 0, 0, 0, 0, 0,
+					     0, 16, 19, 4, -65, -65, -71, -71,
+					     0, 0, 0, 0, 0, 0, 0, 0 );
+  const __m256i mask2F = _mm256_set1_epi8 ( 0x2F );
+  const __m256i pack = _mm256_setr_epi8 ( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 
+					  -1, -1, -1, -1,
+					  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 
+					  -1, -1, -1, -1 );
+  const __m256i lanes = _mm256_setr_epi32 ( 0, 1, 2, 4, 5, 6, 3, 7 );
+  int i = 0;
+
+  for ( ; i + 32 <= n ; i += 32, dest += 24 )
+    {
+      __m256i in = _mm256_loadu_si256 ( (const __m256i*)( src + i ));
+      __m256i hiNib = _mm256_and_si256 ( _mm256_srli_epi32 ( in, 4 ), mask2F );
+      __m256i loNib = _mm256_and_si256 ( in, mask2F );
+      __m256i lo = _mm256_shuffle_epi8 ( lutLo, loNib );
+      __m256i hi = _mm256_shuffle_epi8 ( lutHi, hiNib );
+      if ( !_mm256_testz_si256 ( lo, hi )) break;
+
+      __m256i eq2F = _mm256_cmpeq_epi8 ( in, mask2F );
+      __m256i roll = _mm256_shuffle_epi8 ( lutRoll, _mm256_add_epi8 ( eq2F, hiNib ));
+      __m256i v = _mm256_add_epi8 ( in, roll );
+
+      v = _mm256_maddubs_epi16 ( v, _mm256_set1_epi32 ( 0x01400140 ));
+      v = _mm256_madd_epi16 ( v, _mm256_set1_epi32 ( 0x00011000 ));
+      v = _mm256_shuffle_epi8 ( v, pack );
+      v = _mm256_permutevar8x32_epi32 ( v, lanes );
+      _mm256_storeu_si256 ( (__m256i*)dest, v );
+    }
+  return i;
+}
+#endif /* AWS_HAVE_X86_SIMD */
+
+/// Vector kernels selected by __b64_select
+static int (*b64EncodeVec) ( const unsigned char *, int, char * ) = NULL;
+static int (*b64DecodeVec) ( const char *, int, unsigned char * ) = NULL;
+static pthread_once_t b64Once = PTHREAD_ONCE_INIT;
+
+/// Fill in the lookup table and pick the kernels supported by this CPU
+///
+/// Runs once through pthread_once, which also makes the table and the
+/// kernel pointers visible to every thread that gets past it.
+static void __b64_select ()
+{
+  __b64_init_values ();
+#ifdef AWS_HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if ( __builtin_cpu_supports ( "avx2" ))
+    { b64EncodeVec = __b64_encode_avx2;  b64DecodeVec = __b64_decode_avx2; }
+  else if ( __builtin_cpu_supports ( "sse4.1" ))
+    { b64EncodeVec = __b64_encode_ssse3; b64DecodeVec = __b64_decode_ssse3; }
+  else if ( __builtin_cpu_supports ( "ssse3" ))
+    b64EncodeVec = __b64_encode_ssse3;
+#endif
+}
+
+/// Encode binary data into base64
+/// \param src binary data
+/// \param len length of the data
+/// \param dest output buffer
+/// \param nDest size of the output buffer, 
+///              at least AWS_B64_ENCODED_LEN(len) bytes
+/// \return length of the encoded text or -1 if dest is too small
+///
+/// The result is padded with '=' and NUL terminated.
+int aws_b64_encode ( const unsigned char * src, int len, char * dest, int nDest )
+{
+  int out = AWS_B64_ENCODED_LEN ( len );
+  if ( len < 0 || nDest < out ) return -1;
+  pthread_once ( &b64Once, __b64_select );
+
+  int i = b64EncodeVec ? b64EncodeVec ( src, len, dest ) : 0;
+  char * d = dest + i / 3 * 4;
+  int full = ( len - i ) / 3 * 3;
+  __b64_encode_scalar ( src + i, full, d );
+  d += full / 3 * 4; i += full;
+
+  if ( len - i == 1 )
+    {
+      d[0] = b64Chars [ src[i] >> 2 ];
+      d[1] = b64Chars [ ( src[i] & 0x3 ) << 4 ];
+      d[2] = d[3] = '=';
+      d += 4;
+    }
+  else if ( len - i == 2 )
+    {
+      d[0] = b64Chars [ src[i] >> 2 ];
+      d[1] = b64Chars [ (( src[i] & 0x3 ) << 4 ) | ( src[i+1] >> 4 ) ];
+      d[2] = b64Chars [ ( src[i+1] & 0xF ) << 2 ];
+      d[3] = '=';
+      d += 4;
+    }
+  *d = 0;
+  return d - dest;
+}
+
+/// Decode base64 text into binary
+/// \param src base64 text
+/// \param len length of the text
+/// \param dest output buffer
+/// \param nDest size of the output buffer, 
+///              at least AWS_B64_DECODED_LEN(len) bytes
+/// \return number of decoded bytes or -1 on malformed input 
+///         or if dest is too small
+///
+/// White space in the input is skipped, decoding stops at the first '='.
+int aws_b64_decode ( const char * src, int len, unsigned char * dest, int nDest )
+{
+  unsigned char * d = dest;
+  unsigned v = 0;
+  int  bits = 0;
+  int  i = 0;
+
+  if ( len < 0 ) return -1;
+  pthread_once ( &b64Once, __b64_select );
+
+  /// The vector kernels store up to 8 bytes past the decoded data, so
+  /// they are only given as much input as leaves room for that
+  if ( b64DecodeVec && nDest > 8 )
+    {
+      int nVec = ( nDest - 8 ) / 3 * 4;
+      i = b64DecodeVec ( src, nVec < len ? nVec : len, d );
+      d += i / 4 * 3;
+    }
+
+  for ( ; i < len ; i ++ )
+    {
+      unsigned char c = b64Values [ (unsigned char)src[i] ];
+      if ( c == B64_SKIP ) continue;
+      if ( c == B64_BAD ) 
+	{
+	  if ( src[i] == '=' ) break;
+	  return -1;
+	}
+      v = ( v << 6 ) | c;
+      bits += 6;
+      if ( bits >= 8 )
+	{
+	  bits -= 8;
+	  if ( d >= dest + nDest ) return -1;
+	  *d++ = ( v >> bits ) & 0xFF;
+	}
+    }
+  return d - dest;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup checksum Checksum Functions
+  \{
+*/
+
+/// Table for the bytewise CRC32C (Castagnoli, reflected 0x82F63B78)
+static unsigned crc32cTable[256];
+
+/// CRC32C kernel selected by __crc32c_select
+static unsigned (*crc32cFn) ( unsigned, const unsigned char *, int ) = NULL;
+
+/// Bytewise table driven CRC32C
+/// \param crc running checksum (already inverted)
+/// \param p data
+/// \param len length of the data
+/// \return updated checksum (not inverted)
+static unsigned __crc32c_sw ( unsigned crc, const unsigned char * p, int len )
+{
+  while ( len-- > 0 ) crc = crc32cTable [ ( crc ^ *p++ ) & 0xFF ] ^ ( crc >> 8 );
+  return crc;
+}
+
+#if defined(AWS_HAVE_X86_SIMD) && defined(__x86_64__)
+/// CRC32C using the SSE4.2 crc32 instruction, 8 bytes at a time
+/// \see __crc32c_sw
+__attribute__((target("sse4.2")))
+static unsigned __crc32c_hw ( unsigned crc, const unsigned char * p, int len )
+{
+  unsigned long long c = crc;
+  while ( len > 0 && ((unsigned long)p & 7 ))
+    { c = _mm_crc32_u8 ( c, *p++ ); len--; }
+  while ( len >= 8 )
+    {
+      unsigned long long v;
+      memcpy ( &v, p, 8 );
+      c = _mm_crc32_u64 ( c, v );
+      p += 8; len -= 8;
+    }
+  while ( len-- > 0 ) c = _mm_crc32_u8 ( c, *p++ );
+  return c;
+}
+#endif
+
+/// Pick CRC32C kernel supported by this CPU
+static void __crc32c_select ()
+{
+  unsigned i, j;
+  for ( i = 0 ; i < 256 ; i ++ )
+    {
+      unsigned c = i;
+      for ( j = 0 ; j < 8 ; j ++ ) c = c & 1 ? ( c >> 1 ) ^ 0x82F63B78 : c >> 1;
+      crc32cTable[i] = c;
+    }
+#if defined(AWS_HAVE_X86_SIMD) && defined(__x86_64__)
+  __builtin_cpu_init ();
+  if ( __builtin_cpu_supports ( "sse4.2" )) { crc32cFn = __crc32c_hw; return; }
+#endif
+  crc32cFn = __crc32c_sw;
+}
+
+/// Compute CRC32C checksum
+/// \param crc checksum of the preceding data, 0 to start
+/// \param data data
+/// \param len length of the data
+/// \return checksum of the preceding data and this block
+///
+/// Uses the SSE4.2 crc32 instruction when the CPU has it.
+unsigned aws_crc32c ( unsigned crc, const void * data, int len )
+{
+  if ( crc32cFn == NULL ) __crc32c_select ();
+  return ~crc32cFn ( ~crc, data, len );
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup compress Compression Functions
+  \{
+*/
+
+/// Check if a compression method is compiled in
+static int __codec_supported ( int method )
+{
+#ifdef ENABLE_GZIP
+  if ( method == AWS_COMPRESS_GZIP ) return 1;
+#endif
+#ifdef ENABLE_ZSTD
+  if ( method == AWS_COMPRESS_ZSTD ) return 1;
+#endif
+  return method == AWS_COMPRESS_NONE;
+}
+
+/// Content-Encoding name of a compression method
+static const char * __codec_name ( int method )
+{
+  if ( method == AWS_COMPRESS_GZIP ) return "gzip";
+  if ( method == AWS_COMPRESS_ZSTD ) return "zstd";
+  return "identity";
+}
+
+/// Find the compression method named by a Content-Encoding value
+/// \return AWS_COMPRESS_* method, 0 if there is none we can decode
+static int __codec_from_encoding ( const char * value )
+{
+  int m = AWS_COMPRESS_NONE;
+  if ( strstr ( value, "gzip" ))      m = AWS_COMPRESS_GZIP;
+  else if ( strstr ( value, "zstd" )) m = AWS_COMPRESS_ZSTD;
+  return __codec_supported ( m ) ? m : AWS_COMPRESS_NONE;
+}
+
+/// Start a compressor or decompressor
+/// \param c codec state
+/// \param method AWS_COMPRESS_* method
+/// \param level compression level, 0 for the default of the method
+/// \param decompress set to decompress
+/// \return 0 on success or an error code
+static int __codec_init ( AwsCodec * c, int method, int level, int decompress )
+{
+  memset ( c, 0, sizeof(AwsCodec));
+  c->decompress = decompress;
+#ifdef ENABLE_GZIP
+  if ( method == AWS_COMPRESS_GZIP )
+    {
+      /// 16 + MAX_WBITS selects the gzip wrapper instead of zlib's
+      int rc = decompress ? inflateInit2 ( &c->z, 16 + MAX_WBITS ) :
+	deflateInit2 ( &c->z, level ? level : Z_DEFAULT_COMPRESSION,
+		       Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY );
+      if ( rc != Z_OK ) return rc == Z_MEM_ERROR ? AWS_ERR_NOMEM : AWS_ERR_COMPRESS;
+      c->method = method;
+      return 0;
+    }
+#endif
+#ifdef ENABLE_ZSTD
+  if ( method == AWS_COMPRESS_ZSTD )
+    {
+      if ( decompress )
+	{
+	  if (( c->zd = ZSTD_createDStream ()) == NULL ) return AWS_ERR_NOMEM;
+	  /// Refuse frames that would need a window of more than 8MB
+	  ZSTD_DCtx_setParameter ( c->zd, ZSTD_d_windowLogMax, 23 );
+	}
+      else
+	{
+	  /// Levels above 19 use windows the decoder above would refuse
+	  if ( level > 19 ) level = 19;
+	  if (( c->zc = ZSTD_createCStream ()) == NULL ) return AWS_ERR_NOMEM;
+	  ZSTD_CCtx_setParameter ( c->zc, ZSTD_c_compressionLevel, 
+				   level ? level : ZSTD_CLEVEL_DEFAULT );
+	}
+      c->method = method;
+      return 0;
+    }
+#endif
+  return AWS_ERR_UNSUPPORTED;
+}
+
+/// Feed data through a codec
+/// \param c codec state
+/// \param in input data
+/// \param len length of the input
+/// \param finish set with the last piece of input to flush the compressor
+/// \param sink receiver of the output
+/// \param ctx argument of the sink
+/// \return 0 on success or an error code
+///
+/// Output is handed to the sink in pieces of up to CODEC_CHUNK bytes.
+/// Concatenated gzip members and zstd frames are decoded one after
+/// another.
+static int __codec_run ( AwsCodec * c, const char * in, int len, int finish,
+			 CodecSink sink, void * ctx )
+{
+#ifdef ENABLE_GZIP
+  if ( c->method == AWS_COMPRESS_GZIP )
+    {
+      char out[CODEC_CHUNK];
+      c->z.next_in  = (Bytef*) in;
+      c->z.avail_in = len;
+      for (;;)
+	{
+	  if ( c->decompress && c->ended && c->z.avail_in )
+	    { inflateReset ( &c->z ); c->ended = 0; }
+
+	  c->z.next_out  = (Bytef*) out;
+	  c->z.avail_out = sizeof(out);
+	  int rc = c->decompress ? inflate ( &c->z, Z_NO_FLUSH ) : 
+	    deflate ( &c->z, finish ? Z_FINISH : Z_NO_FLUSH );
+	  if ( rc == Z_STREAM_END ) c->ended = 1;
+	  else if ( rc != Z_OK && rc != Z_BUF_ERROR ) return AWS_ERR_COMPRESS;
+
+	  int n = sizeof(out) - c->z.avail_out;
+	  if ( n > 0 && sink ( ctx, out, n )) return AWS_ERR_NOMEM;
+
+	  if ( c->z.avail_out == 0 ) continue;
+	  if ( !c->decompress && finish && !c->ended ) continue;
+	  if ( c->decompress && c->ended && c->z.avail_in ) continue;
+	  return 0;
+	}
+    }
+#endif
+#ifdef ENABLE_ZSTD
+  if ( c->method == AWS_COMPRESS_ZSTD )
+    {
+      char out[CODEC_CHUNK];
+      ZSTD_inBuffer ib = { in, len, 0 };
+      for (;;)
+	{
+	  ZSTD_outBuffer ob = { out, sizeof(out), 0 };
+	  size_t before = ib.pos;
+	  size_t r = c->decompress ? ZSTD_decompressStream ( c->zd, &ob, &ib ) :
+	    ZSTD_compressStream2 ( c->zc, &ob, &ib, finish ? ZSTD_e_end : ZSTD_e_continue );
+	  if ( ZSTD_isError ( r )) return AWS_ERR_COMPRESS;
+	  if ( ob.pos > 0 && sink ( ctx, out, ob.pos )) return AWS_ERR_NOMEM;
+
+	  if ( c->decompress )
+	    {
+	      /// 0 means a frame is complete and fully flushed
+	      if ( ob.pos || ib.pos != before ) c->ended = r == 0;
+	      if ( ib.pos == ib.size && ob.pos < ob.size ) return 0;
+	    }
+	  else if ( finish ? r == 0 : ib.pos == ib.size )
+	    {
+	      c->ended = finish;
+	      return 0;
+	    }
+	}
+    }
+#endif
+  return AWS_ERR_UNSUPPORTED;
+}
+
+/// Release the state of a codec
+static void __codec_end ( AwsCodec * c )
+{
+#ifdef ENABLE_GZIP
+  if ( c->method == AWS_COMPRESS_GZIP )
+    {
+      if ( c->decompress ) inflateEnd ( &c->z ); 
+      else deflateEnd ( &c->z );
+    }
+#endif
+#ifdef ENABLE_ZSTD
+  if ( c->zc ) ZSTD_freeCStream ( c->zc );
+  if ( c->zd ) ZSTD_freeDStream ( c->zd );
+#endif
+  memset ( c, 0, sizeof(AwsCodec));
+}
+
+/// Codec sink appending to an I/O buffer
+static int __sink_iobuf ( void * ctx, const char * d, int len )
+{
+  aws_iobuf_append ( ctx, (char*) d, len );
+  return 0;
+}
+
+/// Codec sink appending to a string buffer
+static int __sink_strbuf ( void * ctx, const char * d, int len )
+{
+  return __strbuf_append ( ctx, d, len );
+}
+
+/// Compress a whole piece of data
+/// \param method AWS_COMPRESS_* method
+/// \param level compression level, 0 for the default
+/// \param in data
+/// \param len length of the data
+/// \param out string buffer the compressed stream is appended to
+/// \return 0 on success or an error code
+static int __codec_compress ( int method, int level, const char * in, int len,
+			      StrBuf * out )
+{
+  AwsCodec c;
+  int rc = __codec_init ( &c, method, level, 0 );
+  if ( rc == 0 ) rc = __codec_run ( &c, in, len, 1, __sink_strbuf, out );
+  __codec_end ( &c );
+  return rc;
+}
+
+/// Compress the unread contents of an I/O buffer
+/// \param b I/O buffer, its contents are consumed
+/// \param out string buffer the compressed stream is appended to
+/// \param method AWS_COMPRESS_* method
+/// \param level compression level, 0 for the default
+/// \return 0 on success or an error code
+///
+/// The I/O buffer is read CODEC_CHUNK bytes at a time, so only the
+/// compressed copy of the body is held besides the buffer itself.
+static int __codec_compress_iobuf ( IOBuf * b, StrBuf * out, 
+				    int method, int level )
+{
+  AwsCodec c;
+  char in[CODEC_CHUNK];
+
+  int rc = __codec_init ( &c, method, level, 0 );
+  while ( rc == 0 )
+    {
+      int n = __aws_iobuf_read ( b, in, sizeof(in) );
+      rc = __codec_run ( &c, in, n, n == 0, __sink_strbuf, out );
+      if ( n == 0 ) break;
+    }
+  __codec_end ( &c );
+  return rc;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup metrics Metrics Functions
+  \{
+*/
+
+/// Counters of one thread.  Only the owning thread writes them, so
+/// updates are plain relaxed stores and readers never block it.
+/// Blocks are linked into metricsList on first use and never freed,
+/// which keeps the counts of threads that have exited.
+typedef struct _MetricsBlock
+{
+  struct _MetricsBlock * next;
+  long inflight;
+  AwsOpMetrics op[AWS_OP_COUNT];
+} MetricsBlock;
+
+static MetricsBlock * metricsList = NULL;
+static __thread MetricsBlock * metricsMine = NULL;
+
+/// HTTP status codes with a slot of their own, 
+/// others go to the 2xx..5xx slots that follow
+static const int metricsCodes[] =
+  { 0, 200, 204, 206, 301, 304, 307, 400, 403, 404, 409, 412, 416, 429, 500, 503 };
+
+#define METRICS_CODES  ( sizeof(metricsCodes) / sizeof(metricsCodes[0]) )
+
+static const char * metricsStatus[AWS_METRICS_STATUS] =
+  { "none", "200", "204", "206", "301", "304", "307", "400", "403", "404",
+    "409", "412", "416", "429", "500", "503", "2xx", "3xx", "4xx", "5xx" };
+
+static const char * metricsOps[AWS_OP_COUNT] =
+  { "s3_get", "s3_put", "s3_delete", "s3_post", "sqs_create_queue", "sqs_list_queues",
+    "sqs_get_queueattributes", "sqs_set_queuevisibilitytimeout",
+    "sqs_send_message", "sqs_get_message", "sqs_delete_message" };
+
+/// Add to a counter of the calling thread
+#define METRIC_ADD(f,v)  __atomic_store_n ( &(f), (f) + (v), __ATOMIC_RELAXED )
+
+/// Counters of the calling thread, registered on first use
+/// \return NULL if out of memory
+static MetricsBlock * __metrics_block ()
+{
+  if ( metricsMine ) return metricsMine;
+  MetricsBlock * m = awsMalloc ( sizeof(MetricsBlock));
+  if ( m == NULL ) return NULL;
+  memset ( m, 0, sizeof(MetricsBlock));
+  m->next = __atomic_load_n ( &metricsList, __ATOMIC_RELAXED );
+  while ( !__atomic_compare_exchange_n ( &metricsList, &m->next, m, 1,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED ));
+  return metricsMine = m;
+}
+
+/// Status slot of an HTTP response code, 0 if there was no response
+static int __metrics_status_slot ( int code )
+{
+  unsigned i;
+  for ( i = 0 ; i < METRICS_CODES ; i ++ )
+    if ( metricsCodes[i] == code ) return i;
+  if ( code < 200 || code >= 600 ) return 0;
+  return METRICS_CODES + code / 100 - 2;
+}
+
+/// Latency bucket of a duration.  Values below 8 get a bucket each,
+/// every power of two above is split into 8 linear sub-buckets, so a
+/// bucket is never wider than 1/8 of its lower bound.
+static int __metrics_bucket ( unsigned long us )
+{
+  if ( us < 8 ) return us;
+  int e = 63 - __builtin_clzl ( us );
+  int b = ( e - 2 ) * 8 + (( us >> ( e - 3 )) & 7 );
+  return b < AWS_METRICS_BUCKETS ? b : AWS_METRICS_BUCKETS - 1;
+}
+
+/// Count the start of a request
+static void __metrics_begin ( AwsXfer * x )
+{
+  MetricsBlock * m = __metrics_block ();
+  if ( m == NULL ) return;
+  METRIC_ADD ( m->inflight, 1 );
+  x->metered = 1;
+  x->start   = __aws_now_us ();
+}
+
+/// Count the end of a request
+/// \param sc result of curl_easy_perform
+static void __metrics_end ( AwsXfer * x, int sc )
+{
+  unsigned long us = __aws_now_us () - x->start;
+  MetricsBlock * m = metricsMine;
+  AwsOpMetrics * o = &m->op[x->op];
+
+  METRIC_ADD ( o->requests, 1 );
+  if ( sc || x->b->code / 100 != 2 ) METRIC_ADD ( o->errors, 1 );
+  METRIC_ADD ( o->bytesUp, x->up );
+  METRIC_ADD ( o->bytesDown, x->down );
+  METRIC_ADD ( o->status[__metrics_status_slot ( sc ? 0 : x->b->code )], 1 );
+  METRIC_ADD ( o->latency[__metrics_bucket ( us )], 1 );
+  METRIC_ADD ( o->latencySum, us );
+  METRIC_ADD ( m->inflight, -1 );
+  x->metered = 0;
+}
+
+/// Sum the counters of all threads.  Counts are read without 
+/// stopping the threads, so a snapshot taken while requests run may
+/// have a request in requests but not yet in latency.
+/// \param m filled with the totals
+void aws_metrics_snapshot ( AwsMetrics * m )
+{
+  MetricsBlock * t;
+  int i, j;
+
+  memset ( m, 0, sizeof(AwsMetrics));
+  for ( t = __atomic_load_n ( &metricsList, __ATOMIC_ACQUIRE ) ; t ; t = t->next )
+    {
+      m->inflight += __atomic_load_n ( &t->inflight, __ATOMIC_RELAXED );
+      for ( i = 0 ; i < AWS_OP_COUNT ; i ++ )
+	{
+	  const unsigned long * src = (const unsigned long *) &t->op[i];
+	  unsigned long * dst = (unsigned long *) &m->op[i];
+	  for ( j = 0 ; j < sizeof(AwsOpMetrics) / sizeof(unsigned long) ; j ++ )
+	    dst[j] += __atomic_load_n ( &src[j], __ATOMIC_RELAXED );
+	}
+    }
+}
+
+/// Name of an operation as used in the Prometheus labels
+/// \param op AWS_OP_*
+const char * aws_metrics_op_name ( int op )
+{ return op >= 0 && op < AWS_OP_COUNT ? metricsOps[op] : "unknown"; }
+
+/// HTTP status of a status slot.  "none" counts requests that got no
+/// response, e.g. connection failures.
+const char * aws_metrics_status ( int slot )
+{ return slot >= 0 && slot < AWS_METRICS_STATUS ? metricsStatus[slot] : "unknown"; }
+
+/// Upper bound of a latency bucket
+/// \return first duration in microseconds past the bucket
+unsigned long aws_metrics_bucket_limit ( int bucket )
+{
+  if ( bucket < 8 ) return bucket + 1;
+  return ( 9UL + bucket % 8 ) << ( bucket / 8 - 1 );
+}
+
+/// Latency percentile of an operation
+/// \param p fraction of the requests, e.g. 0.99
+/// \return upper bound of the bucket in microseconds, 0 if there were no requests
+unsigned long aws_metrics_percentile ( const AwsOpMetrics * m, double p )
+{
+  unsigned long n = 0, total = 0;
+  int i;
+
+  for ( i = 0 ; i < AWS_METRICS_BUCKETS ; i ++ ) total += m->latency[i];
+  if ( total == 0 ) return 0;
+  unsigned long rank = p * total + 0.999999;
+  if ( rank < 1 ) rank = 1;
+  for ( i = 0 ; i < AWS_METRICS_BUCKETS - 1 ; i ++ )
+    if (( n += m->latency[i] ) >= rank ) break;
+  return aws_metrics_bucket_limit ( i );
+}
+
+/// Print the metrics in Prometheus text format.  Operations
+/// without requests are left out.  Latency is exported as
+/// aws4c_request_duration_seconds with power of two buckets from
+/// 64us to 64s.
+/// \param buf output buffer
+/// \param size size of buf
+/// \return length of the output, AWS_ERR_SPACE if buf is too small
+int aws_metrics_prometheus ( char * buf, int size )
+{
+  static const struct { const char * name, * type, * help; } fam[] =
+    {
+      { "aws4c_requests_total", "counter", "Requests by operation and HTTP status." },
+      { "aws4c_errors_total", "counter", "Requests that failed." },
+      { "aws4c_bytes_sent_total", "counter", "Body bytes sent." },
+      { "aws4c_bytes_received_total", "counter", "Body bytes received." },
+      { "aws4c_request_duration_seconds", "histogram", "Request latency." },
+    };
+  AwsMetrics * m = awsMalloc ( sizeof(AwsMetrics));
+  StrBuf out = { NULL, 0, 0 };
+  int f, i, j, rc = 0;
+
+  if ( m == NULL ) return AWS_ERR_NOMEM;
+  aws_metrics_snapshot ( m );
+
+  for ( f = 0 ; f < sizeof(fam) / sizeof(fam[0]) && rc == 0 ; f ++ )
+    {
+      rc = __strbuf_printf ( &out, "# HELP %s %s\n# TYPE %s %s\n",
+			     fam[f].name, fam[f].help, fam[f].name, fam[f].type );
+      for ( i = 0 ; i < AWS_OP_COUNT && rc == 0 ; i ++ )
+	{
+	  const AwsOpMetrics * o = &m->op[i];
+	  const char * op = metricsOps[i];
+	  if ( o->requests == 0 ) continue;
+	  switch ( f )
+	    {
+	    case 0:
+	      for ( j = 0 ; j < AWS_METRICS_STATUS && rc == 0 ; j ++ )
+		if ( o->status[j] )
+		  rc = __strbuf_printf ( &out, "%s{op=\"%s\",code=\"%s\"} %lu\n",
+					 fam[f].name, op, metricsStatus[j], o->status[j] );
+	      break;
+	    case 1:
+	    case 2:
+	    case 3:
+	      rc = __strbuf_printf ( &out, "%s{op=\"%s\"} %lu\n", fam[f].name, op,
+				     f == 1 ? o->errors : f == 2 ? o->bytesUp : o->bytesDown );
+	      break;
+	    case 4:
+	      {
+		unsigned long n = 0, total = 0;
+		int b = 0, e;
+		for ( j = 0 ; j < AWS_METRICS_BUCKETS ; j ++ ) total += o->latency[j];
+		for ( e = 6 ; e <= 26 && rc == 0 ; e ++ )
+		  {
+		    for ( ; b < AWS_METRICS_BUCKETS
+			    && aws_metrics_bucket_limit ( b ) <= 1UL << e ; b ++ )
+		      n += o->latency[b];
+		    rc = __strbuf_printf ( &out, "%s_bucket{op=\"%s\",le=\"%.6f\"} %lu\n",
+					   fam[f].name, op, ( 1UL << e ) / 1e6, n );
+		  }
+		if ( rc == 0 )
+		  rc = __strbuf_printf ( &out, "%s_bucket{op=\"%s\",le=\"+Inf\"} %lu\n"
+					 "%s_sum{op=\"%s\"} %.6f\n%s_count{op=\"%s\"} %lu\n",
+					 fam[f].name, op, total, fam[f].name, op,
+					 o->latencySum / 1e6, fam[f].name, op, total );
+	      }
+	      break;
+	    }
+	}
+    }
+  if ( rc == 0 )
+    rc = __strbuf_printf ( &out, "# HELP aws4c_inflight_requests Requests in progress.\n"
+			   "# TYPE aws4c_inflight_requests gauge\n"
+			   "aws4c_inflight_requests %ld\n", m->inflight );
+  awsFree ( m );
+
+  if ( rc == 0 && out.len >= size ) rc = AWS_ERR_SPACE;
+  if ( rc == 0 )
+    {
+      memcpy ( buf, out.buf, out.len + 1 );
+      rc = out.len;
+    }
+  __strbuf_free ( &out );
+  return rc;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup trace Trace Functions
+  \{
+*/
+
+/// Trace records of one thread.  Only the owning thread writes the 
+/// ring; pos is published after each record so a dump sees whole 
+/// records, except for the oldest one when the writer is lapping it.
+typedef struct _TraceRing
+{
+  struct _TraceRing * next;
+  unsigned long pos;                     /// <number of records written
+  unsigned      thread;                  /// <number of the thread
+  AwsTraceRec   rec[AWS_TRACE_RECORDS];
+} TraceRing;
+
+static TraceRing * traceList = NULL;
+static __thread TraceRing * traceMine = NULL;
+static unsigned traceThreads = 0;        /// <threads that have traced
+static int traceFd = -1;                 /// <file aws_trace_signal dumps to
+
+static const char * traceNames[AWS_TRACE_COUNT] =
+  { "start", "status", "send", "recv", "retry", "end" };
+
+/// Ring of the calling thread, registered on first use
+/// \return NULL if out of memory
+static TraceRing * __trace_ring ()
+{
+  TraceRing * r = awsMalloc ( sizeof(TraceRing));
+  if ( r == NULL ) return NULL;
+  memset ( r, 0, sizeof(TraceRing));
+  r->thread = __atomic_fetch_add ( &traceThreads, 1, __ATOMIC_RELAXED );
+  r->next = __atomic_load_n ( &traceList, __ATOMIC_RELAXED );
+  while ( !__atomic_compare_exchange_n ( &traceList, &r->next, r, 1,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED ));
+  return traceMine = r;
+}
+
+/// Append a record to the ring of the calling thread
+static void __trace ( int ev, int op, long long a0, long long a1 )
+{
+  TraceRing * r = traceMine ? traceMine : __trace_ring ();
+  struct timespec ts;
+
+  if ( r == NULL ) return;
+  AwsTraceRec * t = &r->rec[r->pos & ( AWS_TRACE_RECORDS - 1 )];
+  clock_gettime ( CLOCK_MONOTONIC, &ts );
+  t->ts     = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  t->thread = r->thread;
+  t->ev     = ev;
+  t->op     = op;
+  t->a0     = a0;
+  t->a1     = a1;
+  __atomic_store_n ( &r->pos, r->pos + 1, __ATOMIC_RELEASE );
+}
+
+/// Write all of a buffer
+/// \return 0 on success, -1 on error
+static int __write_all ( int fd, const void * d, size_t len )
+{
+  while ( len )
+    {
+      ssize_t n = write ( fd, d, len );
+      if ( n < 0 ) return -1;
+      d = (const char*) d + n;
+      len -= n;
+    }
+  return 0;
+}
+
+/// Write the trace records of all threads to a file.  Each thread
+/// contributes up to its last AWS_TRACE_RECORDS records, oldest first.
+/// Only calls write(), so it can be used from a signal handler.
+/// Decode the output with trace_decode.
+/// \param fd file descriptor to write to
+/// \return 0 on success, -1 if writing failed
+int aws_trace_dump ( int fd )
+{
+  AwsTraceHeader h = { AWS_TRACE_MAGIC, sizeof(AwsTraceRec), 0 };
+  TraceRing * r;
+
+  if ( __write_all ( fd, &h, sizeof(h))) return -1;
+  for ( r = __atomic_load_n ( &traceList, __ATOMIC_ACQUIRE ) ; r ; r = r->next )
+    {
+      unsigned long pos = __atomic_load_n ( &r->pos, __ATOMIC_ACQUIRE );
+      unsigned long n   = pos < AWS_TRACE_RECORDS ? pos : AWS_TRACE_RECORDS;
+      unsigned long at  = ( pos - n ) & ( AWS_TRACE_RECORDS - 1 );
+      unsigned long run = AWS_TRACE_RECORDS - at < n ? AWS_TRACE_RECORDS - at : n;
+
+      if ( __write_all ( fd, &r->rec[at], run * sizeof(AwsTraceRec))) return -1;
+      if ( __write_all ( fd, &r->rec[0], ( n - run ) * sizeof(AwsTraceRec))) return -1;
+    }
+  return 0;
+}
+
+static void __trace_handler ( int sig )
+{ aws_trace_dump ( traceFd ); }
+
+/// Dump the trace whenever a signal arrives, e.g. SIGUSR1
+/// \param sig signal number
+/// \param fd file descriptor to write to, kept open by the caller
+/// \return 0 on success, -1 if the handler could not be installed
+int aws_trace_signal ( int sig, int fd )
+{
+  struct sigaction sa;
+
+  memset ( &sa, 0, sizeof(sa));
+  sa.sa_handler = __trace_handler;
+  sa.sa_flags   = SA_RESTART;
+  sigemptyset ( &sa.sa_mask );
+  traceFd = fd;
+  return sigaction ( sig, &sa, NULL );
+}
+
+/// Name of a trace event
+/// \param ev AWS_TRACE_*
+const char * aws_trace_event_name ( int ev )
+{ return ev >= 0 && ev < AWS_TRACE_COUNT ? traceNames[ev] : "unknown"; }
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup rate Rate Control Functions
+  \{
+*/
+
+/// Number of endpoints and prefixes tracked, a power of two.  When
+/// the table is full new names share the slot their hash points to.
+#define RATE_SLOTS     1024
+/// Share the limits keep when the server throttles
+#define RATE_CUT       0.7
+/// Seconds the rate takes to climb back to where it was cut.  Before
+/// the first throttled response the rate doubles every second instead.
+#define RATE_RECOVER   4.0
+/// Latency over this many times the fastest seen stops the growth
+#define RATE_LATENCY   4.0
+/// Shortest time between two cuts, in microseconds, so a burst of
+/// throttled responses to requests already in flight cuts only once
+#define RATE_COOLDOWN  100000
+/// Backoff before the first retry in microseconds, doubled each time
+#define RATE_BACKOFF   50000
+/// Seconds of tokens a bucket may save up
+#define RATE_BURST     0.1
+
+/// State of one endpoint or prefix
+typedef struct
+{
+  int    lock;
+  int    used;             /// <slot has been taken
+  char   name[128];
+  const AwsLimit * limit;  /// <ceilings from rateConf
+  double rate;             /// <requests per second allowed now
+  double tokens;           /// <requests that may start now
+  double window;           /// <requests allowed in flight now
+  int    inflight;         /// <requests in flight
+  unsigned long refill;    /// <last time tokens were added
+  unsigned long grown;     /// <last time rate was increased
+  unsigned long cut;       /// <last time limits were cut
+  unsigned long fastest;   /// <lowest latency seen, slowly forgotten
+  int    slowStart;        /// <no throttled response seen yet
+  double step;             /// <rate added per second after a cut
+} Limiter;
+
+static Limiter rateTable[RATE_SLOTS];
+static int     rateTableLock = 0;
+
+static void __spin_lock ( int * l )
+{
+  while ( __atomic_exchange_n ( l, 1, __ATOMIC_ACQUIRE ))
+    while ( __atomic_load_n ( l, __ATOMIC_RELAXED ));
+}
+
+static void __spin_unlock ( int * l )
+{ __atomic_store_n ( l, 0, __ATOMIC_RELEASE ); }
+
+static void __sleep_us ( unsigned long us )
+{
+  struct timespec ts = { us / 1000000, ( us % 1000000 ) * 1000 };
+  nanosleep ( &ts, NULL );
+}
+
+/// Find or add the limiter of an endpoint or prefix
+/// \param name endpoint or prefix, truncated to 127 characters
+/// \param len length of name
+/// \param limit limits of a new limiter
+static Limiter * __rate_find ( const char * name, int len, const AwsLimit * limit )
+{
+  unsigned h = 2166136261u;
+  int i;
+
+  if ( len > 127 ) len = 127;
+  for ( i = 0 ; i < len ; i ++ ) h = ( h ^ (unsigned char) name[i] ) * 16777619u;
+
+  for ( i = 0 ; i < RATE_SLOTS ; i ++ )
+    {
+      Limiter * l = &rateTable[( h + i ) & ( RATE_SLOTS - 1 )];
+      if ( !__atomic_load_n ( &l->used, __ATOMIC_ACQUIRE ))
+	{
+	  __spin_lock ( &rateTableLock );
+	  if ( !l->used )
+	    {
+	      memcpy ( l->name, name, len );
+	      l->name[len] = 0;
+	      l->limit     = limit;
+	      l->rate      = limit->rate > 0 ? limit->rate : 1;
+	      l->window    = limit->inflight > 0 ? limit->inflight : 1;
+	      l->tokens    = 1;
+	      l->slowStart = 1;
+	      l->refill    = l->grown = __aws_now_us ();
+	      __atomic_store_n ( &l->used, 1, __ATOMIC_RELEASE );
+	    }
+	  __spin_unlock ( &rateTableLock );
+	}
+      if ( !strncmp ( l->name, name, len ) && l->name[len] == 0 ) return l;
+    }
+  return &rateTable[h & ( RATE_SLOTS - 1 )];
+}
+
+/// Wait until a request may start
+static void __rate_acquire ( Limiter * l )
+{
+  for ( ;; )
+    {
+      unsigned long now = __aws_now_us ();
+      unsigned long wait = 1000;
+
+      __spin_lock ( &l->lock );
+      double burst = l->rate * RATE_BURST > 1 ? l->rate * RATE_BURST : 1;
+      l->tokens += ( now - l->refill ) / 1e6 * l->rate;
+      if ( l->tokens > burst ) l->tokens = burst;
+      l->refill = now;
+      if ( l->tokens >= 1 && l->inflight < (int) l->window )
+	{
+	  l->tokens -= 1;
+	  l->inflight ++;
+	  __spin_unlock ( &l->lock );
+	  return;
+	}
+      if ( l->tokens < 1 ) wait = ( 1 - l->tokens ) / l->rate * 1e6 + 1;
+      __spin_unlock ( &l->lock );
+      __sleep_us ( wait < 50000 ? wait : 50000 );
+    }
+}
+
+/// Account for a finished attempt and adjust the limits
+/// \param throttled the server asked to slow down
+/// \param us time the server took to answer, see __rate_perform
+static void __rate_done ( Limiter * l, int throttled, unsigned long us )
+{
+  unsigned long now = __aws_now_us ();
+  const AwsLimit * lim = l->limit;
+
+  __spin_lock ( &l->lock );
+  l->inflight --;
+  if ( throttled )
+    {
+      /// Multiplicative decrease
+      if ( now - l->cut > RATE_COOLDOWN )
+	{
+	  l->step   = l->rate * ( 1 - RATE_CUT ) / RATE_RECOVER;
+	  l->window = l->window * RATE_CUT > 1 ? l->window * RATE_CUT : 1;
+	  l->rate   = l->rate * RATE_CUT > 1 ? l->rate * RATE_CUT : 1;
+	  l->cut    = now;
+	}
+      l->slowStart = 0;
+      l->grown = now;
+    }
+  else
+    {
+      /// The fastest latency creeps up so an old minimum does not
+      /// hold back growth for ever
+      if ( l->fastest == 0 || us < l->fastest ) l->fastest = us;
+      else l->fastest += l->fastest / 1024 + 1;
+
+      /// Additive increase, unless latency shows the server queueing
+      if ( us <= RATE_LATENCY * l->fastest )
+	{
+	  double dt = ( now - l->grown ) / 1e6;
+	  if ( dt > 1 ) dt = 1;
+	  if ( l->slowStart )
+	    {
+	      l->rate   += l->rate * dt;
+	      l->window += 1;
+	    }
+	  else
+	    {
+	      l->rate   += l->step * dt;
+	      l->window += 1 / l->window;
+	    }
+	  if ( lim->maxRate > 0 && l->rate > lim->maxRate ) l->rate = lim->maxRate;
+	  if ( lim->maxInflight > 0 && l->window > lim->maxInflight ) 
+	    l->window = lim->maxInflight;
+	}
+      l->grown = now;
+    }
+  __spin_unlock ( &l->lock );
+}
+
+/// Put the request back to where it was before the first attempt
+static void __xfer_rewind ( AwsXfer * x )
+{
+  x->b->current = x->startNode;
+  x->b->pos     = x->startPos;
+  x->b->len     = x->startLen;
+  x->left       = x->startLeft;
+  x->packedPos  = 0;
+  x->chunkLeft  = x->framePos = x->frameLen = x->done = 0;
+  x->discard    = 0;
+  x->crc        = 0;
+  if ( x->sums & AWS_CHECKSUM_MD5 ) MD5_Init ( &x->md5 );
+}
+
+/// Send a request under rate control, resending it while it is 
+/// throttled and retries are left
+/// \return curl result code of the last attempt
+static int __rate_perform ( CURL * ch, AwsXfer * x )
+{
+  const char * key = x->key ? x->key : "";
+  const char * host = S3Host;
+  int hostLen = strlen ( S3Host ), sc;
+
+  /// SQS keys are queue URLs, whose host is the endpoint
+  const char * p = strstr ( key, "://" );
+  if ( p )
+    {
+      host    = p + 3;
+      hostLen = strcspn ( host, "/" );
+    }
+  /// With several endpoints each one has its own limits
+  else if ( __lb_host ( x ))
+    {
+      host    = __lb_host ( x );
+      hostLen = strlen ( host );
+    }
+  const char * slash = strrchr ( key, '/' );
+  int prefixLen = p || slash == NULL ? strlen ( key ) : slash - key;
+
+  Limiter * lh = __rate_find ( host, hostLen, &rateConf.host );
+  Limiter * lp = __rate_find ( key, prefixLen, &rateConf.prefix );
+
+  x->startNode = x->b->current;
+  x->startPos  = x->b->pos;
+  x->startLen  = x->b->len;
+  x->startLeft = x->left;
+
+  for ( ;; )
+    {
+      /// The prefix comes first, so requests waiting on a throttled
+      /// prefix do not hold endpoint slots other prefixes could use
+      __rate_acquire ( lp );
+      __rate_acquire ( lh );
+      unsigned long t0 = __aws_now_us ();
+      x->sentAt = x->replyAt = 0;
+      sc = __aws_attempt ( ch, x );
+
+      /// Latency is from the end of the request body to the status
+      /// line of the response, so the time large bodies take to go
+      /// out or come in does not look like queueing.  A response 
+      /// that came before the body was sent counts from the start.
+      unsigned long from = x->sentAt > t0 ? x->sentAt : t0;
+      unsigned long us = x->replyAt == 0 ? __aws_now_us () - t0 :
+	x->replyAt >= from ? x->replyAt - from : x->replyAt - t0;
+
+      int throttled = sc == 0 && ( x->b->code == 503 || x->b->code == 429 );
+      __rate_done ( lp, throttled, us );
+      __rate_done ( lh, throttled, us );
+      if ( !throttled || x->retries >= rateConf.retries ) break;
+
+      /// Exponential backoff with jitter
+      x->retries ++;
+      TRACE ( AWS_TRACE_RETRY, x->op, x->retries, x->b->code );
+      if ( x->hooked ) __hook_fire ( x, hooks.retry, 0 );
+      unsigned long backoff = (unsigned long) RATE_BACKOFF << ( x->retries < 8 ? x->retries - 1 : 7 );
+      __sleep_us ( backoff / 2 + ( t0 ^ ( t0 >> 7 )) % ( backoff / 2 + 1 ));
+      __xfer_rewind ( x );
+    }
+  return sc;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup endpoint Endpoint Functions
+  \{
+*/
+
+/// Most endpoints s3_set_endpoints accepts
+#define LB_MAX          64
+/// Consecutive failures that take an endpoint out of use
+#define LB_EJECT_FAILS  3
+/// Time an endpoint is out of use, in microseconds, doubled for 
+/// each ejection in a row up to 32 times
+#define LB_EJECT_TIME   10000000UL
+/// Time a returning endpoint takes to get its full share
+#define LB_SLOW_START   10000000UL
+
+/// One endpoint of the cluster
+typedef struct _Endpoint
+{
+  char   host[128];
+  unsigned long long hash;     /// <hash of host, for AWS_LB_HASH
+  struct curl_slist * connectTo; /// <CURLOPT_CONNECT_TO sending requests here
+  int    inflight;             /// <requests in flight
+  int    fails;                /// <failures in a row
+  int    ejections;            /// <ejections in a row
+  unsigned long ejectedUntil;  /// <out of use until then
+  unsigned long admitted;      /// <back in use since then, 0 from the start
+} Endpoint;
+
+static Endpoint lbNodes[LB_MAX];
+static __thread unsigned lbNext = 0;   /// <where the scan starts, spreads ties
+
+static unsigned long long __mix64 ( unsigned long long h )
+{
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ ( h >> 33 );
+}
+
+static unsigned long long __hash64 ( const char * s )
+{
+  unsigned long long h = 14695981039346656037ULL;
+  while ( *s ) h = ( h ^ (unsigned char) *s++ ) * 1099511628211ULL;
+  return h;
+}
+
+/// Share of the traffic an endpoint gets, 0 while it is ejected
+static double __lb_weight ( Endpoint * e, unsigned long now )
+{
+  unsigned long until = __atomic_load_n ( &e->ejectedUntil, __ATOMIC_RELAXED );
+  if ( until > now ) return 0;
+  unsigned long since = __atomic_load_n ( &e->admitted, __ATOMIC_RELAXED );
+  if ( since == 0 || now - since >= LB_SLOW_START ) return 1;
+  return 0.1 + 0.9 * ( now - since ) / LB_SLOW_START;
+}
+
+/// Pick an endpoint and point the request at it.  The URL, the Host
+/// header and the signature keep the S3 host, curl just connects 
+/// to the endpoint instead.
+static void __lb_begin ( CURL * ch, AwsXfer * x )
+{
+  unsigned long now = __aws_now_us ();
+  unsigned long long kh = __hash64 ( x->key ? x->key : "" );
+  Endpoint * best = NULL;
+  double bestScore = 0;
+  int i, live = 0;
+
+  for ( i = 0 ; i < lbCount ; i ++ )
+    {
+      Endpoint * e = &lbNodes[( lbNext + i ) % lbCount];
+      double w = __lb_weight ( e, now ), score;
+      if ( w == 0 ) continue;
+      live ++;
+      if ( lbPolicy == AWS_LB_HASH )
+	/// Rendezvous hashing: every key ranks the endpoints the same 
+	/// way, so losing one only moves the keys it had
+	score = w * ( __mix64 ( kh ^ e->hash ) >> 11 );
+      else
+	score = w / ( __atomic_load_n ( &e->inflight, __ATOMIC_RELAXED ) + 1 );
+      if ( best == NULL || score > bestScore ) { best = e; bestScore = score; }
+    }
+  /// With every endpoint ejected use the one coming back first
+  if ( live == 0 )
+    for ( i = 0 ; i < lbCount ; i ++ )
+      if ( best == NULL || lbNodes[i].ejectedUntil < best->ejectedUntil ) 
+	best = &lbNodes[i];
+  lbNext ++;
+  if ( best == NULL ) return;
+
+  __atomic_add_fetch ( &best->inflight, 1, __ATOMIC_RELAXED );
+  x->node = best;
+  curl_easy_setopt ( ch, CURLOPT_CONNECT_TO, best->connectTo );
+  curl_easy_setopt ( ch, CURLOPT_MAXCONNECTS, (long) lbCount );
+}
+
+/// \return host of the endpoint a request was sent to, NULL if 
+///         requests are not spread over endpoints
+static const char * __lb_host ( const AwsXfer * x )
+{ return x->node ? x->node->host : NULL; }
+
+/// Passive health check of the endpoint a request went to.  
+/// Connection failures and 5xx responses other than 503 SlowDown
+/// count as failures.
+static void __lb_end ( AwsXfer * x, int sc )
+{
+  Endpoint * e = x->node;
+  int code = x->b->code;
+
+  __atomic_sub_fetch ( &e->inflight, 1, __ATOMIC_RELAXED );
+  if ( sc == 0 && ( code < 500 || code == 503 ))
+    {
+      if ( e->fails ) __atomic_store_n ( &e->fails, 0, __ATOMIC_RELAXED );
+      if ( e->ejections ) __atomic_store_n ( &e->ejections, 0, __ATOMIC_RELAXED );
+      return;
+    }
+  if ( __atomic_add_fetch ( &e->fails, 1, __ATOMIC_RELAXED ) == LB_EJECT_FAILS )
+    {
+      unsigned long now = __aws_now_us ();
+      int n = __atomic_fetch_add ( &e->ejections, 1, __ATOMIC_RELAXED );
+      unsigned long until = now + ( LB_EJECT_TIME << ( n < 5 ? n : 5 ));
+      __atomic_store_n ( &e->ejectedUntil, until, __ATOMIC_RELAXED );
+      __atomic_store_n ( &e->admitted, until, __ATOMIC_RELAXED );
+      __atomic_store_n ( &e->fails, 0, __ATOMIC_RELAXED );
+    }
+}
+
+/// Spread S3 requests over several endpoints of one S3 compatible
+/// cluster.  Requests still name the host set by s3_set_host, in the
+/// URL and in the signature, but connect to one of the endpoints.
+/// An endpoint that fails 3 times in a row is left out for 10 
+/// seconds, longer if it keeps failing, and then gets a growing 
+/// share of the traffic over 10 seconds.  Set it before requests
+/// start.
+/// \param hosts endpoints as "host" or "host:port"
+/// \param n number of endpoints, 0 to go back to the S3 host
+/// \param policy AWS_LB_LEAST_OUTSTANDING or AWS_LB_HASH
+/// \return 0 on success, AWS_ERR_SPACE for more than 64 endpoints
+///         or a host of more than 127 characters, AWS_ERR_NOMEM if
+///         memory can't be allocated
+int s3_set_endpoints ( char * const * hosts, int n, int policy )
+{
+  char buf[160];
+  int i;
+
+  if ( n > LB_MAX ) return AWS_ERR_SPACE;
+  lbCount = 0;
+  for ( i = 0 ; i < LB_MAX ; i ++ )
+    {
+      curl_slist_free_all ( lbNodes[i].connectTo );
+      memset ( &lbNodes[i], 0, sizeof(Endpoint));
+    }
+  for ( i = 0 ; i < n ; i ++ )
+    {
+      Endpoint * e = &lbNodes[i];
+      /// A cut host would connect somewhere else than it is known as
+      if ( snprintf ( e->host, sizeof(e->host), "%s", hosts[i] ) >= (int) sizeof(e->host))
+	return AWS_ERR_SPACE;
+      e->hash = __mix64 ( __hash64 ( e->host ));
+      /// Any host and port of the URL goes to this endpoint, 
+      /// keeping the port of the URL if the endpoint has none
+      if ( snprintf ( buf, sizeof(buf), "::%s%s", hosts[i], 
+		      strchr ( hosts[i], ':' ) ? "" : ":" ) >= (int) sizeof(buf))
+	return AWS_ERR_SPACE;
+      e->connectTo = curl_slist_append ( NULL, buf );
+      if ( e->connectTo == NULL ) return AWS_ERR_NOMEM;
+    }
+  lbPolicy = policy;
+  lbCount  = n;
+  return 0;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup coalesce Request Coalescing
+  \{
+*/
+
+/// Number of hash chains of the requests in flight
+#define FLIGHT_SLOTS  64
+
+/// One download shared by all the s3_get calls that asked for the
+/// object while it was in flight.  Buffers given the body hold a 
+/// reference and see the data of b without a copy.
+struct _AwsShared
+{
+  struct _AwsShared * next;   /// <next flight of the hash chain
+  int    refs;                /// <callers waiting plus buffers sharing the body
+  int    done;                /// <download finished
+  int    sc;                  /// <result of the download
+  IOBuf * b;                  /// <response, the body in one node
+  char * data;                /// <body
+  int    len;                 /// <length of the body
+  pthread_cond_t cond;        /// <signalled when done
+  char   key[];               /// <host/bucket/object
+};
+
+static AwsShared *     flights[FLIGHT_SLOTS];
+static pthread_mutex_t flightLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Drop a reference to a shared download, the last one frees it
+static void __shared_put ( AwsShared * f )
+{
+  if ( __atomic_sub_fetch ( &f->refs, 1, __ATOMIC_ACQ_REL )) return;
+  aws_iobuf_free ( f->b );
+  pthread_cond_destroy ( &f->cond );
+  awsFree ( f );
+}
+
+/// Give a caller the response of a shared download.  An empty buffer
+/// gets a node pointing at the shared body and keeps the reference,
+/// one that already holds data gets a copy.
+static void __shared_give ( IOBuf * b, AwsShared * f )
+{
+  IOBufNode * N = NULL;
+
+  if ( f->len && b->first == NULL && b->shared == NULL &&
+       ( N = __iobuf_alloc ( b, sizeof(IOBufNode))))
+    {
+      /// The node has no room left, not even for the NUL after the
+      /// data, so appending to b, even nothing, never writes to the body
+      N->buf  = f->data;
+      N->len  = f->len;
+      N->size = f->len;
+      N->next = NULL;
+      b->first = b->current = b->last = N;
+      b->pos    = N->buf;
+      b->len   += f->len;
+      b->shared = f;
+    }
+  else if ( f->len )
+    aws_iobuf_append ( b, f->data, f->len );
+
+  b->code       = f->b->code;
+  b->contentLen = f->b->contentLen;
+  b->totalLen   = f->b->totalLen;
+  b->timing     = f->b->timing;
+  __iobuf_set ( b, &b->result,  f->b->result );
+  __iobuf_set ( b, &b->eTag,    f->b->eTag );
+  __iobuf_set ( b, &b->lastMod, f->b->lastMod );
+  if ( N == NULL ) __shared_put ( f );
+}
+
+/// Take the node of a shared body off the front of a node list and
+/// drop the reference of the buffer
+/// \param first first node of B, the shared one
+/// \return the nodes after it
+static IOBufNode * __iobuf_unshare ( IOBuf * B, IOBufNode * first )
+{
+  IOBufNode * N = first->next;
+  if ( B->arena == NULL ) awsFree ( first );
+  __shared_put ( B->shared );
+  B->shared = NULL;
+  return N;
+}
+
+/// s3_get that joins a download of the same object already in 
+/// flight, or starts one others may join
+static int __coalesce_get ( IOBuf * b, char * const file )
+{
+  char key[1024];
+  AwsShared * f;
+  int n = snprintf ( key, sizeof(key), "%s/%s/%s", S3Host, Bucket ? Bucket : "", file );
+
+  if ( n >= (int) sizeof(key)) return __s3_get ( b, file, NULL );
+  unsigned slot = __hash64 ( key ) % FLIGHT_SLOTS;
+
+  pthread_mutex_lock ( &flightLock );
+  for ( f = flights[slot] ; f && strcmp ( f->key, key ) ; f = f->next );
+  if ( f )
+    {
+      f->refs ++;
+      while ( !f->done ) pthread_cond_wait ( &f->cond, &flightLock );
+      pthread_mutex_unlock ( &flightLock );
+      int sc = f->sc;
+      __shared_give ( b, f );
+      return sc;
+    }
+
+  if (( f = awsMalloc ( sizeof(AwsShared) + n + 1 )) == NULL ||
+      ( f->b = aws_iobuf_new ()) == NULL )
+    {
+      pthread_mutex_unlock ( &flightLock );
+      if ( f ) awsFree ( f );
+      return AWS_ERR_NOMEM;
+    }
+  memcpy ( f->key, key, n + 1 );
+  f->refs = 1;
+  f->done = 0;
+  pthread_cond_init ( &f->cond, NULL );
+  f->next = flights[slot];
+  flights[slot] = f;
+  pthread_mutex_unlock ( &flightLock );
+
+  int sc = __s3_get ( f->b, file, NULL );
+  if (( f->data = aws_iobuf_data ( f->b, &f->len )) == NULL )
+    {
+      f->len = 0;
+      if ( sc == 0 ) sc = AWS_ERR_NOMEM;
+    }
+
+  /// Later calls start a new download, they may follow a change
+  pthread_mutex_lock ( &flightLock );
+  AwsShared ** p = &flights[slot];
+  while ( *p != f ) p = &(*p)->next;
+  *p = f->next;
+  f->sc   = sc;
+  f->done = 1;
+  pthread_cond_broadcast ( &f->cond );
+  pthread_mutex_unlock ( &flightLock );
+
+  __shared_give ( b, f );
+  return sc;
+}
+
+/// Let concurrent s3_get calls for the same object share one 
+/// request.  A call made while another thread downloads the object
+/// waits for that download and gets its response, error or not.
+/// The body is not copied: the buffers point at one reference 
+/// counted copy, freed with the last of them, and a buffer that
+/// already held data gets a copy instead.  Set it before requests
+/// start.
+/// \param on 1 to turn on, 0 to turn off
+void s3_set_coalesce ( int on )
+{ coalesceOn = on; }
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup negcache Negative Cache
+  \{
+*/
+
+/// Slots searched for a key, starting at the one its hash points to
+#define NEG_PROBE    8
+/// Upload counters a download compares before it is remembered
+#define NEG_STRIPES  256
+
+/// A missing object, by the 64 bit hash of host/bucket/object
+typedef struct
+{
+  unsigned long long fp;       /// <hash, 0 for a free slot
+  unsigned long      expires;  /// <forgotten after this time
+} NegEntry;
+
+static NegEntry * negTable = NULL;
+static unsigned   negMask  = 0;        /// <slots - 1
+static unsigned long negTtl = 0;       /// <time to remember, microseconds
+static int        negLock  = 0;
+static unsigned   negPuts[NEG_STRIPES]; /// <uploads by stripe of the hash
+
+/// Hash of an object of the current host and bucket, never 0
+static unsigned long long __neg_key ( const char * file )
+{
+  unsigned long long h = 14695981039346656037ULL;
+  const char * parts[3] = { S3Host, Bucket ? Bucket : "", file };
+  int i;
+
+  for ( i = 0 ; i < 3 ; i ++ )
+    {
+      const char * p = parts[i];
+      while ( *p ) h = ( h ^ (unsigned char) *p++ ) * 1099511628211ULL;
+      h = ( h ^ '/' ) * 1099511628211ULL;
+    }
+  h = __mix64 ( h );
+  return h ? h : 1;
+}
+
+/// \return 1 if the object is remembered as missing
+static int __neg_lookup ( unsigned long long fp )
+{
+  unsigned long now = __aws_now_us ();
+  int i, hit = 0;
+
+  __spin_lock ( &negLock );
+  for ( i = 0 ; i < NEG_PROBE && !hit ; i ++ )
+    {
+      NegEntry * e = &negTable[( fp + i ) & negMask];
+      hit = e->fp == fp && e->expires > now;
+    }
+  __spin_unlock ( &negLock );
+  return hit;
+}
+
+/// Upload count of the stripe of an object, taken before a download
+/// so a 404 that raced an upload is not remembered
+static unsigned __neg_epoch ( unsigned long long fp )
+{ return __atomic_load_n ( &negPuts[fp % NEG_STRIPES], __ATOMIC_ACQUIRE ); }
+
+/// Remember a missing object.  A full window of slots loses the one
+/// that expires first.
+static void __neg_insert ( unsigned long long fp, unsigned epoch )
+{
+  unsigned long now = __aws_now_us ();
+  NegEntry * slot = NULL;
+  int i;
+
+  __spin_lock ( &negLock );
+  if ( negPuts[fp % NEG_STRIPES] == epoch )
+    {
+      for ( i = 0 ; i < NEG_PROBE ; i ++ )
+	{
+	  NegEntry * e = &negTable[( fp + i ) & negMask];
+	  if ( e->fp == fp ) { slot = e; break; }
+	  if ( slot == NULL || e->expires < slot->expires ) slot = e;
+	}
+      slot->fp      = fp;
+      slot->expires = now + negTtl;
+    }
+  __spin_unlock ( &negLock );
+}
+
+/// Forget an object that is being uploaded
+static void __neg_forget ( unsigned long long fp )
+{
+  int i;
+
+  __spin_lock ( &negLock );
+  negPuts[fp % NEG_STRIPES] ++;
+  for ( i = 0 ; i < NEG_PROBE ; i ++ )
+    {
+      NegEntry * e = &negTable[( fp + i ) & negMask];
+      if ( e->fp == fp ) e->fp = 0;
+    }
+  __spin_unlock ( &negLock );
+}
+
+/// Remember objects s3_get did not find, and answer later s3_get 
+/// calls for them with 404 without a request until the time runs
+/// out.  s3_put of an object forgets it.  Objects are kept by a 64
+/// bit hash, taking 32 bytes of table each, so two objects are mixed
+/// up with a chance of about one in 10^19 per pair.  When the table is full
+/// the entry closest to expiring is dropped.  Set it before 
+/// requests start.  Uploads by other clients are only seen once 
+/// the time runs out.
+/// \param ttl seconds to remember a missing object, 0 to turn it off
+/// \param keys number of objects to keep
+/// \return 0 on success, AWS_ERR_NOMEM if memory can't be allocated
+int s3_set_negative_cache ( int ttl, int keys )
+{
+  unsigned slots = NEG_PROBE;
+
+  negOn = 0;
+  awsFree ( negTable );
+  negTable = NULL;
+  if ( ttl <= 0 || keys <= 0 ) return 0;
+
+  /// At most half full, so a window rarely overflows
+  while ( slots / 2 < (unsigned) keys && slots < ( 1u << 30 )) slots <<= 1;
+  if (( negTable = awsMalloc ( slots * sizeof(NegEntry))) == NULL ) 
+    return AWS_ERR_NOMEM;
+  memset ( negTable, 0, slots * sizeof(NegEntry));
+  negMask = slots - 1;
+  negTtl  = ttl * 1000000UL;
+  negOn   = 1;
+  return 0;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup pack Object Packing
+  \{
+*/
+
+/// Blob size of s3_pack_open when none is given
+#define PACK_BLOB       ( 8 << 20 )
+/// Gap between two objects of a blob that s3_pack_get_many still
+/// reads with one request, as a request costs more than the bytes
+#define PACK_GAP        65536
+/// Longest range s3_pack_get_many reads with one request
+#define PACK_RANGE_MAX  ( 8 << 20 )
+/// First line of an index file, followed by ' ' and the blob prefix
+#define PACK_MAGIC      "aws4c-pack 1"
+
+/// Object stored in a blob
+typedef struct
+{
+  char * key;
+  int    blob;      /// <number of the blob
+  int    len;       /// <length of the object
+  long   offset;    /// <start of the object in the blob
+  int    seq;       /// <order of s3_pack_add calls, the last of a key wins
+} PackEntry;
+
+/// Writer of packed objects
+struct _AwsPacker
+{
+  char *  prefix;     /// <blob names are the prefix and a number
+  char *  index;      /// <index file
+  int     blobSize;   /// <blob is uploaded once it gets this big
+  int     blob;       /// <number of the blob being filled
+  IOBuf * b;          /// <blob being filled
+  PackEntry * e;      /// <objects added
+  int     n;          /// <objects added
+  int     size;       /// <room in e
+  int     done;       /// <objects of uploaded blobs
+  AwsArena * keys;    /// <memory of the keys
+};
+
+/// Index of packed objects, sorted by key
+struct _AwsPackIndex
+{
+  char *  prefix;
+  char *  data;       /// <index file, the keys point into it
+  PackEntry * e;
+  int     n;
+};
+
+/// Name of a blob
+static void __pack_blob_name ( const char * prefix, int blob, char * name, int size )
+{ snprintf ( name, size, "%s%08d", prefix, blob ); }
+
+static int __pack_cmp_key ( const void * a, const void * b )
+{
+  const PackEntry * x = a, * y = b;
+  int c = strcmp ( x->key, y->key );
+  return c ? c : x->seq - y->seq;
+}
+
+/// Object asked for by s3_pack_get_many
+typedef struct
+{
+  PackEntry * e;
+  int         k;    /// <slot in keys and bufs
+} PackWant;
+
+static int __pack_cmp_pos ( const void * a, const void * b )
+{
+  const PackEntry * x = ((const PackWant *) a)->e;
+  const PackEntry * y = ((const PackWant *) b)->e;
+  if ( x->blob != y->blob ) return x->blob - y->blob;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/// Start packing small objects into large blobs.  Each blob is
+/// uploaded with one PUT as prefix followed by an 8 digit number,
+/// so every packer needs a prefix of its own.  s3_pack_close writes
+/// the index that s3_pack_index_load reads back.  A packer must be
+/// used by one thread at a time.
+/// \param prefix start of the blob names, e.g. "events/2024-01-01/"
+/// \param index local file for the index
+/// \param blobSize upload a blob once it reaches this many bytes,
+///        0 for 8MB
+/// \return packer or NULL if out of memory
+AwsPacker * s3_pack_open ( char * const prefix, char * const index, int blobSize )
+{
+  AwsPacker * p = awsMalloc ( sizeof(AwsPacker));
+  if ( p == NULL ) return NULL;
+  memset ( p, 0, sizeof(AwsPacker));
+  p->prefix   = __aws_strdup ( prefix );
+  p->index    = __aws_strdup ( index );
+  p->blobSize = blobSize > 0 ? blobSize : PACK_BLOB;
+  p->b        = aws_iobuf_new ();
+  if ( p->prefix == NULL || p->index == NULL || p->b == NULL )
+    {
+      awsFree ( p->prefix );
+      awsFree ( p->index );
+      if ( p->b ) aws_iobuf_free ( p->b );
+      awsFree ( p );
+      return NULL;
+    }
+  return p;
+}
+
+/// Upload the blob being filled, if it holds anything.  The objects
+/// are kept for another try if it fails.
+/// \param p packer
+/// \return 0 on success, a curl error code, or AWS_ERR_STATUS if
+///         the server refused the blob
+int s3_pack_flush ( AwsPacker * p )
+{
+  char name[1024];
+  IOBuf * b = p->b;
+
+  if ( p->done == p->n ) return 0;
+  __pack_blob_name ( p->prefix, p->blob, name, sizeof(name));
+
+  /// Blobs are never compressed, the offsets point into the raw data
+  IOBufNode * cur = b->current;
+  char * pos = b->pos;
+  int len = b->len;
+  int sc = __s3_put ( b, name, AWS_COMPRESS_NONE, 1 );
+  if ( sc == 0 && b->code / 100 != 2 ) sc = AWS_ERR_STATUS;
+  if ( sc )
+    {
+      b->current = cur;
+      b->pos     = pos;
+      b->len     = len;
+      return sc;
+    }
+
+  aws_iobuf_reset ( b );
+  p->done = p->n;
+  p->blob ++;
+  return 0;
+}
+
+/// Add an object to the blob being filled, uploading the blob first
+/// if the object would take it past its size.  An object larger 
+/// than a blob gets a blob of its own.
+/// \param p packer
+/// \param key name of the object, without tabs or newlines
+/// \param data object
+/// \param len length of the object
+/// \return 0 on success, an error of s3_pack_flush, AWS_ERR_ENCODE 
+///         for a bad key or AWS_ERR_NOMEM if out of memory
+int s3_pack_add ( AwsPacker * p, char * const key, const char * data, int len )
+{
+  int n = strlen ( key ) + 1;
+
+  if ( strpbrk ( key, "\t\n" )) return AWS_ERR_ENCODE;
+  if ( p->b->len && p->b->len + len > p->blobSize )
+    {
+      int sc = s3_pack_flush ( p );
+      if ( sc ) return sc;
+    }
+  if ( p->n == p->size )
+    {
+      int size = p->size ? p->size * 2 : 1024;
+      PackEntry * e = awsRealloc ( p->e, size * sizeof(PackEntry));
+      if ( e == NULL ) return AWS_ERR_NOMEM;
+      p->e = e;
+      p->size = size;
+    }
+
+  PackEntry * e = &p->e[p->n];
+  if (( e->key = __arena_alloc ( &p->keys, n )) == NULL ) return AWS_ERR_NOMEM;
+  memcpy ( e->key, key, n );
+  e->blob   = p->blob;
+  e->offset = p->b->len;
+  e->len    = len;
+  e->seq    = p->n;
+
+  aws_iobuf_append ( p->b, (char*) data, len );
+  if ( p->b->len != e->offset + len ) return AWS_ERR_NOMEM;
+  p->n ++;
+  return 0;
+}
+
+/// Upload the last blob, write the index and free the packer.  The
+/// index is a text file of one line per object, sorted by key:
+///
+///    key TAB blob number TAB offset TAB length
+///
+/// Objects of a blob that could not be uploaded are left out of it.
+/// \param p packer
+/// \return 0 on success, an error of s3_pack_flush, or
+///         AWS_ERR_SPACE if the index could not be written
+int s3_pack_close ( AwsPacker * p )
+{
+  int sc = s3_pack_flush ( p );
+  FILE * f = fopen ( p->index, "w" );
+  int i;
+
+  qsort ( p->e, p->done, sizeof(PackEntry), __pack_cmp_key );
+  if ( f )
+    {
+      fprintf ( f, "%s %s\n", PACK_MAGIC, p->prefix );
+      for ( i = 0 ; i < p->done ; i ++ )
+	{
+	  PackEntry * e = &p->e[i];
+	  if ( i + 1 < p->done && !strcmp ( e->key, e[1].key )) continue;
+	  fprintf ( f, "%s\t%d\t%ld\t%d\n", e->key, e->blob, e->offset, e->len );
+	}
+      if ( fclose ( f )) f = NULL;
+    }
+  if ( f == NULL && sc == 0 ) sc = AWS_ERR_SPACE;
+
+  aws_iobuf_free ( p->b );
+  __arena_rewind ( &p->keys, NULL );
+  awsFree ( p->e );
+  awsFree ( p->prefix );
+  awsFree ( p->index );
+  awsFree ( p );
+  return sc;
+}
+
+/// Load an index written by s3_pack_close
+/// \param index index file
+/// \return index or NULL if the file can't be read or is no index
+AwsPackIndex * s3_pack_index_load ( char * const index )
+{
+  FILE * f = fopen ( index, "rb" );
+  AwsPackIndex * x = NULL;
+  long size;
+  int i, lines = 0;
+
+  if ( f == NULL ) return NULL;
+  if ( fseek ( f, 0, SEEK_END ) || ( size = ftell ( f )) < 0 ||
+       fseek ( f, 0, SEEK_SET )) goto fail;
+  if (( x = awsMalloc ( sizeof(AwsPackIndex))) == NULL ) goto fail;
+  memset ( x, 0, sizeof(AwsPackIndex));
+  if (( x->data = awsMalloc ( size + 1 )) == NULL ||
+      fread ( x->data, 1, size, f ) != (size_t) size ) goto fail;
+  x->data[size] = 0;
+
+  int m = strlen ( PACK_MAGIC );
+  char * p = x->data, * nl;
+  if ( strncmp ( p, PACK_MAGIC " ", m + 1 ) || ( nl = strchr ( p, '\n' )) == NULL ) 
+    goto fail;
+  *nl = 0;
+  x->prefix = p + m + 1;
+  for ( p = nl + 1 ; *p ; p ++ ) lines += *p == '\n';
+  if (( x->e = awsMalloc (( lines + 1 ) * sizeof(PackEntry))) == NULL ) goto fail;
+
+  for ( p = nl + 1, i = 0 ; i < lines ; i ++, p = nl + 1 )
+    {
+      PackEntry * e = &x->e[x->n];
+      char * tab = strchr ( p, '\t' );
+      nl = strchr ( p, '\n' );
+      if ( tab == NULL || tab > nl ) goto fail;
+      *tab = 0;
+      e->key = p;
+      if ( sscanf ( tab + 1, "%d\t%ld\t%d", &e->blob, &e->offset, &e->len ) != 3 ) 
+	goto fail;
+      x->n ++;
+    }
+  fclose ( f );
+  return x;
+
+ fail:
+  fclose ( f );
+  if ( x ) s3_pack_index_free ( x );
+  return NULL;
+}
+
+/// Free an index
+void s3_pack_index_free ( AwsPackIndex * x )
+{
+  awsFree ( x->e );
+  awsFree ( x->data );
+  awsFree ( x );
+}
+
+/// Find an object of an index
+/// \return entry or NULL if the key is not in the index
+static PackEntry * __pack_find ( AwsPackIndex * x, const char * key )
+{
+  int lo = 0, hi = x->n - 1;
+  while ( lo <= hi )
+    {
+      int mid = ( lo + hi ) / 2;
+      int c = strcmp ( x->e[mid].key, key );
+      if ( c == 0 ) return &x->e[mid];
+      if ( c < 0 ) lo = mid + 1; else hi = mid - 1;
+    }
+  return NULL;
+}
+
+/// Download a packed object with a ranged GET of its blob.
+/// \param x index
+/// \param b I/O buffer, gets code 206 and the object, or 404 if the 
+///        key is not in the index
+/// \param key name of the object
+/// \return curl result code
+int s3_pack_get ( AwsPackIndex * x, IOBuf * b, char * const key )
+{
+  char name[1024];
+  PackEntry * e = __pack_find ( x, key );
+
+  if ( e == NULL )
+    {
+      b->code = 404;
+      __iobuf_set ( b, &b->result, "404 Not Found" );
+      return 0;
+    }
+  /// A range can't be empty, so an empty object takes no request
+  if ( e->len == 0 ) 
+    {
+      b->code = 206;
+      __iobuf_set ( b, &b->result, "206 Partial Content" );
+      return 0;
+    }
+  __pack_blob_name ( x->prefix, e->blob, name, sizeof(name));
+  return s3_get_range ( b, name, e->offset, e->len );
+}
+
+/// Download several packed objects.  Objects close to each other
+/// in a blob are read with one ranged GET, so objects packed 
+/// together are best fetched together.
+/// \param x index
+/// \param keys names of the objects
+/// \param n number of objects
+/// \param bufs I/O buffer for each object, they get what s3_pack_get
+///        would give them
+/// \return 0, the first failed curl result code, AWS_ERR_NOMEM or 
+///         AWS_ERR_STATUS if a range was refused
+int s3_pack_get_many ( AwsPackIndex * x, char * const * keys, int n, IOBuf ** bufs )
+{
+  char name[1024];
+  PackWant * w = awsMalloc ( n * sizeof(PackWant) + 1 );
+  int i, j, k, found = 0, sc = 0;
+
+  if ( w == NULL ) return AWS_ERR_NOMEM;
+  for ( k = 0 ; k < n ; k ++ )
+    {
+      PackEntry * e = __pack_find ( x, keys[k] );
+      if ( e && e->len ) { w[found].e = e; w[found++].k = k; continue; }
+      bufs[k]->code = e ? 206 : 404;
+      __iobuf_set ( bufs[k], &bufs[k]->result, e ? "206 Partial Content" : "404 Not Found" );
+    }
+  qsort ( w, found, sizeof(PackWant), __pack_cmp_pos );
+
+  for ( i = 0 ; i < found ; i = j )
+    {
+      long start = w[i].e->offset, end = start + w[i].e->len;
+      for ( j = i + 1 ; j < found && w[j].e->blob == w[i].e->blob &&
+	      w[j].e->offset <= end + PACK_GAP &&
+	      w[j].e->offset + w[j].e->len - start <= PACK_RANGE_MAX ; j ++ )
+	if ( w[j].e->offset + w[j].e->len > end ) 
+	  end = w[j].e->offset + w[j].e->len;
+
+      IOBuf * r = aws_iobuf_acquire ();
+      int len;
+      __pack_blob_name ( x->prefix, w[i].e->blob, name, sizeof(name));
+      int rc = s3_get_range ( r, name, start, end - start );
+      char * d = rc ? NULL : aws_iobuf_data ( r, &len );
+      if ( rc == 0 && d == NULL ) rc = AWS_ERR_NOMEM;
+      if ( rc == 0 && ( r->code != 206 || len != end - start )) rc = AWS_ERR_STATUS;
+
+      for ( k = i ; k < j ; k ++ )
+	{
+	  IOBuf * b = bufs[w[k].k];
+	  b->code = r->code;
+	  __iobuf_set ( b, &b->result, r->result );
+	  if ( rc == 0 ) aws_iobuf_append ( b, d + w[k].e->offset - start, w[k].e->len );
+	}
+      if ( rc && sc == 0 ) sc = rc;
+      aws_iobuf_release ( r );
+    }
+  awsFree ( w );
+  return sc;
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup file Random Access Files
+  \{
+*/
+
+/// Block size and number of blocks of s3_file_open when none are given
+#define FILE_BLOCK    ( 1 << 20 )
+#define FILE_BLOCKS   64
+/// Most blocks read with one request
+#define FILE_RUN_MAX  64
+
+/// States of a cached block
+enum { BLOCK_FREE, BLOCK_LOADING, BLOCK_READY };
+
+/// Block of the cache of a file
+typedef struct
+{
+  long   index;          /// <block number in the object
+  int    state;          /// <BLOCK_*
+  int    len;            /// <bytes of data, fewer in the last block
+  unsigned long used;    /// <clock of the last read, 0 for never
+  char * data;
+} FileBlock;
+
+/// Object opened by s3_file_open
+struct _AwsFile
+{
+  char *  name;
+  char *  eTag;           /// <ETag at the open, NULL if the server sent none
+  long    size;           /// <size of the object
+  int     blockSize;
+  int     nBlocks;
+  FileBlock * blocks;
+  unsigned long clock;    /// <ticks with every read
+  long    seqEnd;         /// <end of the last read
+  int     ahead;          /// <blocks to read ahead, 0 for random reads
+  long    raFirst;        /// <readahead waiting for the worker
+  int     raCount;
+  int     stop;           /// <worker should exit
+  int     worker;         /// <worker thread was started
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  ready;  /// <a block finished loading
+  pthread_cond_t  work;   /// <readahead queued or stop set
+};
+
+/// Cached block of an object, loaded or loading
+static FileBlock * __file_find ( AwsFile * f, long index )
+{
+  int i;
+  for ( i = 0 ; i < f->nBlocks ; i ++ )
+    if ( f->blocks[i].index == index && f->blocks[i].state != BLOCK_FREE )
+      return &f->blocks[i];
+  return NULL;
+}
+
+/// Load blocks that are not cached with one ranged GET, taking the
+/// least recently read cache blocks for them.  The run stops at the
+/// first block already cached.  Called with the lock held, which is
+/// let go during the request.
+/// \param wait wait for a block to finish loading if all are loading
+/// \return 0 or AWS_ERR_STATUS if the request failed
+static int __file_fetch ( AwsFile * f, long first, int count, int wait )
+{
+  FileBlock * slot[FILE_RUN_MAX];
+  int i, j, n = 0, bs = f->blockSize;
+
+  if ( count > FILE_RUN_MAX ) count = FILE_RUN_MAX;
+  if ( count > f->nBlocks / 2 ) count = f->nBlocks / 2;
+  for ( i = 0 ; i < count && !__file_find ( f, first + i ) ; i ++ )
+    {
+      FileBlock * best = NULL;
+      for ( j = 0 ; j < f->nBlocks ; j ++ )
+	{
+	  FileBlock * b = &f->blocks[j];
+	  if ( b->state == BLOCK_LOADING ) continue;
+	  if ( best == NULL || b->state == BLOCK_FREE || 
+	       ( best->state != BLOCK_FREE && b->used < best->used )) best = b;
+	  if ( best->state == BLOCK_FREE ) break;
+	}
+      if ( best == NULL ) break;
+      best->state = BLOCK_LOADING;
+      best->index = first + i;
+      slot[n++] = best;
+    }
+  if ( n == 0 )
+    {
+      if ( wait ) pthread_cond_wait ( &f->ready, &f->lock );
+      return 0;
+    }
+
+  long off = first * bs;
+  long len = (long) n * bs < f->size - off ? (long) n * bs : f->size - off;
+  pthread_mutex_unlock ( &f->lock );
+
+  IOBuf * r = aws_iobuf_new ();
+  int got = 0, sc = s3_get_range ( r, f->name, off, len );
+  char * d = sc ? NULL : aws_iobuf_data ( r, &got );
+  if ( sc || d == NULL || r->code != 206 || got != len ) sc = AWS_ERR_STATUS;
+  /// Blocks of an object overwritten since the open would mix versions
+  if ( sc == 0 && f->eTag && ( r->eTag == NULL || strcmp ( r->eTag, f->eTag ))) 
+    sc = AWS_ERR_STATUS;
+
+  pthread_mutex_lock ( &f->lock );
+  for ( i = 0 ; i < n ; i ++ )
+    {
+      if ( sc ) { slot[i]->state = BLOCK_FREE; slot[i]->used = 0; continue; }
+      slot[i]->len = len - (long) i * bs < bs ? len - (long) i * bs : bs;
+      memcpy ( slot[i]->data, d + (long) i * bs, slot[i]->len );
+      slot[i]->used  = f->clock;
+      slot[i]->state = BLOCK_READY;
+    }
+  pthread_cond_broadcast ( &f->ready );
+  aws_iobuf_free ( r );
+  return sc;
+}
+
+/// Readahead thread of a file
+static void * __file_worker ( void * arg )
+{
+  AwsFile * f = arg;
+
+  pthread_mutex_lock ( &f->lock );
+  while ( !f->stop )
+    {
+      if ( f->raCount == 0 ) { pthread_cond_wait ( &f->work, &f->lock ); continue; }
+      long first = f->raFirst;
+      int count = f->raCount;
+      f->raCount = 0;
+      __file_fetch ( f, first, count, 0 );
+    }
+  pthread_mutex_unlock ( &f->lock );
+  __curl_release ();
+  return NULL;
+}
+
+/// Queue the blocks after a sequential read for the worker.  The
+/// window doubles with every sequential read, up to half the cache.
+/// Called with the lock held.
+/// \param next first block after the read
+static void __file_readahead ( AwsFile * f, long next )
+{
+  long last = ( f->size - 1 ) / f->blockSize;
+  int max = f->nBlocks / 2 < FILE_RUN_MAX ? f->nBlocks / 2 : FILE_RUN_MAX;
+
+  f->ahead = f->ahead ? f->ahead * 2 : 2;
+  if ( f->ahead > max ) f->ahead = max;
+
+  long end = next + f->ahead;
+  if ( end > last + 1 ) end = last + 1;
+  while ( next < end && __file_find ( f, next )) next ++;
+  if ( next == end ) return;
+
+  f->raFirst = next;
+  f->raCount = end - next;
+  if ( !f->worker )
+    f->worker = pthread_create ( &f->thread, NULL, __file_worker, f ) == 0;
+  pthread_cond_signal ( &f->work );
+}
+
+/// Open an object for reads at any offset, e.g. to read the footer
+/// and then a few column chunks of a large file.  Reads go through
+/// a cache of fixed size blocks, least recently read ones are 
+/// dropped first.  A read that needs several missing blocks gets 
+/// them with one ranged GET, and small reads close together share
+/// the block they fall in.  Sequential reads start a thread that
+/// fetches the next blocks ahead of them.  The first block is read
+/// by the open, which also learns the size and ETag of the object.
+/// Reads fail once the object is overwritten, rather than mix
+/// blocks of two versions.
+/// \param b I/O buffer, gets the response of the first request
+/// \param file filename
+/// \param blockSize bytes per block, 0 for 1MB
+/// \param blocks blocks in the cache, 0 for 64
+/// \return file handle, NULL on failure with the reason in b
+AwsFile * s3_file_open ( IOBuf * b, char * const file, int blockSize, int blocks )
+{
+  int i, len;
+
+  if ( blockSize <= 0 ) blockSize = FILE_BLOCK;
+  if ( blocks <= 0 ) blocks = FILE_BLOCKS;
+  if ( blocks < 2 ) blocks = 2;
+  if ( s3_get_range ( b, file, 0, blockSize )) return NULL;
+
+  /// An empty object can't satisfy any range
+  long size = b->code == 206 ? b->totalLen : b->code == 416 ? 0 : 
+    b->code == 200 ? b->len : -1;
+  char * d = aws_iobuf_data ( b, &len );
+  if ( size < 0 || d == NULL ) return NULL;
+
+  AwsFile * f = awsMalloc ( sizeof(AwsFile));
+  if ( f == NULL ) return NULL;
+  memset ( f, 0, sizeof(AwsFile));
+  f->name      = __aws_strdup ( file );
+  f->eTag      = b->eTag ? __aws_strdup ( b->eTag ) : NULL;
+  f->blocks    = awsMalloc ( blocks * sizeof(FileBlock));
+  char * data  = awsMalloc ( (long) blocks * blockSize );
+  if ( f->name == NULL || f->blocks == NULL || data == NULL || 
+       ( b->eTag && f->eTag == NULL ))
+    {
+      awsFree ( f->eTag );
+      awsFree ( f->name );
+      awsFree ( f->blocks );
+      awsFree ( data );
+      awsFree ( f );
+      return NULL;
+    }
+  f->size      = size;
+  f->blockSize = blockSize;
+  f->nBlocks   = blocks;
+  f->seqEnd    = -1;
+  for ( i = 0 ; i < blocks ; i ++ )
+    {
+      f->blocks[i].index = -1;
+      f->blocks[i].state = BLOCK_FREE;
+      f->blocks[i].used  = 0;
+      f->blocks[i].data  = data + (long) i * blockSize;
+    }
+  if ( size > 0 )
+    {
+      f->blocks[0].index = 0;
+      f->blocks[0].len   = len < blockSize ? len : blockSize;
+      f->blocks[0].state = BLOCK_READY;
+      memcpy ( f->blocks[0].data, d, f->blocks[0].len );
+    }
+  pthread_mutex_init ( &f->lock, NULL );
+  pthread_cond_init ( &f->ready, NULL );
+  pthread_cond_init ( &f->work, NULL );
+  return f;
+}
+
+/// \return size of the object of a file handle
+long s3_file_size ( AwsFile * f )
+{ return f->size; }
+
+/// Read from a file like pread(2).  Several threads may read the
+/// same file at once.
+/// \param f file handle
+/// \param buf destination
+/// \param len number of bytes to read
+/// \param offset position in the object
+/// \return number of bytes read, 0 at or past the end of the object,
+///         or AWS_ERR_STATUS if a request failed or found the object
+///         changed since the open
+long s3_file_pread ( AwsFile * f, void * buf, long len, long offset )
+{
+  long done = 0, bs = f->blockSize;
+  int sc = 0;
+
+  if ( offset < 0 || offset >= f->size || len <= 0 ) return 0;
+  if ( len > f->size - offset ) len = f->size - offset;
+
+  pthread_mutex_lock ( &f->lock );
+  f->clock ++;
+  int sequential = offset == f->seqEnd;
+  if ( !sequential ) f->ahead = 0;
+  f->seqEnd = offset + len;
+
+  while ( done < len )
+    {
+      long pos = offset + done, index = pos / bs;
+      FileBlock * b = __file_find ( f, index );
+      if ( b == NULL )
+	{
+	  if (( sc = __file_fetch ( f, index, ( offset + len - 1 ) / bs - index + 1, 1 ))) 
+	    break;
+	  continue;
+	}
+      if ( b->state == BLOCK_LOADING )
+	{
+	  pthread_cond_wait ( &f->ready, &f->lock );
+	  continue;
+	}
+      long k = b->len - ( pos - index * bs );
+      if ( k > len - done ) k = len - done;
+      memcpy ( (char*) buf + done, b->data + pos - index * bs, k );
+      b->used = f->clock;
+      done += k;
+    }
+  if ( sc == 0 && sequential ) __file_readahead ( f, ( offset + len - 1 ) / bs + 1 );
+  pthread_mutex_unlock ( &f->lock );
+  return sc ? sc : done;
+}
+
+/// Close a file handle, waiting for its readahead to finish
+void s3_file_close ( AwsFile * f )
+{
+  pthread_mutex_lock ( &f->lock );
+  f->stop = 1;
+  pthread_cond_signal ( &f->work );
+  pthread_mutex_unlock ( &f->lock );
+  if ( f->worker ) pthread_join ( f->thread, NULL );
+
+  pthread_cond_destroy ( &f->work );
+  pthread_cond_destroy ( &f->ready );
+  pthread_mutex_destroy ( &f->lock );
+  awsFree ( f->blocks[0].data );
+  awsFree ( f->blocks );
+  awsFree ( f->eTag );
+  awsFree ( f->name );
+  awsFree ( f );
+}
+
+/*!
+  \}
+*/
+
+
+/*!
+  \defgroup upload Streaming Uploads
+  \{
+*/
+
+/// Part size and number of part buffers of s3_upload_open when
+/// none are given
+#define UPLOAD_PART       ( 8 << 20 )
+#define UPLOAD_BUFFERS    4
+/// Smallest part S3 takes, but for the last one
+#define UPLOAD_MIN_PART   ( 5 << 20 )
+/// Most parts of a multipart upload
+#define UPLOAD_MAX_PARTS  10000
+
+/// Upload of data of unknown length
+struct _AwsUpload
+{
+  char *  name;
+  int     partSize;
+  int     nBufs;
+  IOBuf ** bufs;         /// <part k is written to bufs[k % nBufs]
+  int     parts;         /// <parts handed to the worker
+  int     queued;        /// <parts handed over and not uploaded yet
+  int     sent;          /// <parts uploaded
+  int     sc;            /// <first error of the worker
+  char *  uploadId;      /// <multipart upload, NULL until the first part
+  char ** eTags;         /// <ETag of each part uploaded
+  int     eTagRoom;
+  AwsArena * strings;    /// <memory of uploadId and the ETags
+  int     stop;          /// <worker should exit
+  int     worker;        /// <worker thread was started
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  space; /// <a buffer was uploaded
+  pthread_cond_t  work;  /// <a part was handed over or stop set
+};
+
+/// Keep a string of a response in the upload
+static char * __upload_keep ( AwsUpload * u, const char * s, int len )
+{
+  char * d = __arena_alloc ( &u->strings, len + 1 );
+  if ( d ) { memcpy ( d, s, len ); d[len] = 0; }
+  return d;
+}
+
+/// Forget the object in the negative cache.  As with s3_put this is
+/// done when the upload starts and again once it is complete.
+static void __upload_forget ( AwsUpload * u )
+{
+  if ( negOn ) __neg_forget ( __neg_key ( u->name ));
+}
+
+/// Start the multipart upload
+/// \return 0 or an error code
+static int __upload_start ( AwsUpload * u )
+{
+  char file[1024];
+  int len, sc;
+  IOBuf * b = aws_iobuf_new ();
+
+  __upload_forget ( u );
+  snprintf ( file, sizeof(file), "%s?uploads", u->name );
+  sc = __s3_post ( b, file, NULL, 0 );
+  char * d = sc ? NULL : aws_iobuf_data ( b, &len );
+  char * id = d ? strstr ( d, "<UploadId>" ) : NULL;
+  char * end = id ? strstr ( id, "</UploadId>" ) : NULL;
+  if ( sc == 0 && ( b->code != 200 || end == NULL )) sc = AWS_ERR_STATUS;
+  if ( sc == 0 && ( u->uploadId = __upload_keep ( u, id + 10, end - id - 10 )) == NULL )
+    sc = AWS_ERR_NOMEM;
+  aws_iobuf_free ( b );
+  return sc;
+}
+
+/// Keep the ETag of a part
+/// \param num part number, from 1
+/// \return 0 or AWS_ERR_NOMEM
+static int __upload_etag ( AwsUpload * u, int num, const char * eTag )
+{
+  if ( num > u->eTagRoom )
+    {
+      int room = u->eTagRoom ? u->eTagRoom * 2 : 64;
+      while ( room < num ) room *= 2;
+      char ** e = awsRealloc ( u->eTags, room * sizeof(char*));
+      if ( e == NULL ) return AWS_ERR_NOMEM;
+      u->eTags = e;
+      u->eTagRoom = room;
+    }
+  u->eTags[num-1] = __upload_keep ( u, eTag, strlen ( eTag ));
+  return u->eTags[num-1] ? 0 : AWS_ERR_NOMEM;
+}
+
+/// Upload one part
+/// \param b part, gets the response
+/// \param num part number, from 1
+/// \return 0 or an error code
+static int __upload_part ( AwsUpload * u, IOBuf * b, int num )
+{
+  char file[1024];
+
+  snprintf ( file, sizeof(file), "%s?partNumber=%d&uploadId=%s", 
+	     u->name, num, u->uploadId );
+  int sc = __s3_put ( b, file, AWS_COMPRESS_NONE, 0 );
+  if ( sc == 0 && ( b->code != 200 || b->eTag == NULL )) sc = AWS_ERR_STATUS;
+  if ( sc == 0 ) sc = __upload_etag ( u, num, b->eTag );
+  return sc;
+}
+
+/// Upload thread, sends the parts in order as they are handed over
+static void * __upload_worker ( void * arg )
+{
+  AwsUpload * u = arg;
+
+  pthread_mutex_lock ( &u->lock );
+  while ( !u->stop || u->queued )
+    {
+      if ( u->queued == 0 ) { pthread_cond_wait ( &u->work, &u->lock ); continue; }
+      int num = u->sent + 1, sc = u->sc;
+      pthread_mutex_unlock ( &u->lock );
+
+      /// After a failure the parts are dropped, the upload is aborted
+      IOBuf * b = u->bufs[( num - 1 ) % u->nBufs];
+      if ( sc == 0 && u->uploadId == NULL ) sc = __upload_start ( u );
+      if ( sc == 0 ) sc = __upload_part ( u, b, num );
+      aws_iobuf_reset ( b );
+
+      pthread_mutex_lock ( &u->lock );
+      if ( u->sc == 0 ) u->sc = sc;
+      u->sent ++;
+      u->queued --;
+      pthread_cond_broadcast ( &u->space );
+    }
+  pthread_mutex_unlock ( &u->lock );
+  __curl_release ();
+  return NULL;
+}
+
+/// Hand the buffer being written to the worker, waiting for a free
+/// one if they are all in use
+/// \return 0 or the first error of the worker
+static int __upload_hand_over ( AwsUpload * u )
+{
+  int sc;
+
+  pthread_mutex_lock ( &u->lock );
+  if (( sc = u->sc ) == 0 && u->parts == UPLOAD_MAX_PARTS ) sc = AWS_ERR_SPACE;
+  if ( sc == 0 && !u->worker &&
+       ( u->worker = pthread_create ( &u->thread, NULL, __upload_worker, u ) == 0 ) == 0 )
+    sc = AWS_ERR_NOMEM;
+  if ( sc == 0 )
+    {
+      u->parts ++;
+      u->queued ++;
+      pthread_cond_signal ( &u->work );
+      while ( u->queued == u->nBufs && u->sc == 0 ) 
+	pthread_cond_wait ( &u->space, &u->lock );
+      sc = u->sc;
+    }
+  pthread_mutex_unlock ( &u->lock );
+  return sc;
+}
+
+/// Stop the worker once it has sent what it was handed
+static void __upload_join ( AwsUpload * u )
+{
+  pthread_mutex_lock ( &u->lock );
+  u->stop = 1;
+  pthread_cond_signal ( &u->work );
+  pthread_mutex_unlock ( &u->lock );
+  if ( u->worker ) pthread_join ( u->thread, NULL );
+  u->worker = 0;
+}
+
+static void __upload_free ( AwsUpload * u )
+{
+  int i;
+  for ( i = 0 ; i < u->nBufs ; i ++ ) if ( u->bufs[i] ) aws_iobuf_free ( u->bufs[i] );
+  pthread_cond_destroy ( &u->work );
+  pthread_cond_destroy ( &u->space );
+  pthread_mutex_destroy ( &u->lock );
+  __arena_rewind ( &u->strings, NULL );
+  awsFree ( u->eTags );
+  awsFree ( u->bufs );
+  awsFree ( u->name );
+  awsFree ( u );
+}
+
+/// Abort the multipart upload, if one was started
+static void __upload_abort ( AwsUpload * u )
+{
+  char file[1024];
+  if ( u->uploadId == NULL ) return;
+  snprintf ( file, sizeof(file), "%s?uploadId=%s", u->name, u->uploadId );
+  IOBuf * b = aws_iobuf_new ();
+  s3_delete ( b, file );
+  aws_iobuf_free ( b );
+}
+
+/// Start an upload of data whose length is not known up front, 
+/// e.g. a dump piped from another program.  s3_upload_write 
+/// copies the data into a ring of part buffers that a thread 
+/// uploads in the background, and waits while they are all full.
+/// Data that fits in one part goes up with one PUT at 
+/// s3_upload_close, more becomes a multipart upload, one part per
+/// buffer.  Memory stays at the buffers whatever the size of the 
+/// object, which is stored as written, without compression.
+/// \param file filename
+/// \param partSize bytes per part, at least 5MB, 0 for 8MB
+/// \param buffers number of part buffers, 0 for 4
+/// \return upload or NULL if out of memory
+AwsUpload * s3_upload_open ( char * const file, int partSize, int buffers )
+{
+  int i;
+
+  if ( partSize <= 0 ) partSize = UPLOAD_PART;
+  if ( partSize < UPLOAD_MIN_PART ) partSize = UPLOAD_MIN_PART;
+  if ( buffers <= 0 ) buffers = UPLOAD_BUFFERS;
+  if ( buffers < 2 ) buffers = 2;
+
+  AwsUpload * u = awsMalloc ( sizeof(AwsUpload));
+  if ( u == NULL ) return NULL;
+  memset ( u, 0, sizeof(AwsUpload));
+  pthread_mutex_init ( &u->lock, NULL );
+  pthread_cond_init ( &u->space, NULL );
+  pthread_cond_init ( &u->work, NULL );
+  u->partSize = partSize;
+  u->nBufs    = buffers;
+  u->name     = __aws_strdup ( file );
+  if (( u->bufs = awsMalloc ( buffers * sizeof(IOBuf*))) != NULL )
+    for ( i = 0 ; i < buffers ; i ++ ) u->bufs[i] = aws_iobuf_new ();
+  if ( u->name == NULL || u->bufs == NULL ) 
+    {
+      if ( u->bufs == NULL ) u->nBufs = 0;
+      __upload_free ( u );
+      return NULL;
+    }
+  return u;
+}
+
+/// Add data to an upload
+/// \param u upload
+/// \param data data to add
+/// \param len length of the data
+/// \return 0, the error of a part that failed, AWS_ERR_SPACE past 
+///         10000 parts, or AWS_ERR_NOMEM if out of memory
+int s3_upload_write ( AwsUpload * u, const void * data, int len )
+{
+  const char * d = data;
 
+  while ( len > 0 )
+    {
+      IOBuf * b = u->bufs[u->parts % u->nBufs];
+      int k = u->partSize - b->len < len ? u->partSize - b->len : len;
+      int had = b->len;
+
+      aws_iobuf_append ( b, (char*) d, k );
+      if ( b->len != had + k ) return AWS_ERR_NOMEM;
+      d += k;
+      len -= k;
+      if ( b->len == u->partSize )
+	{
+	  int sc = __upload_hand_over ( u );
+	  if ( sc ) return sc;
+	}
+    }
+  return 0;
+}
 
-  snprintf ( Buf, sizeof(Buf), "Date: %s", date );
-  slist = curl_slist_append(slist, Buf );
-  snprintf ( Buf, sizeof(Buf), "Authorization: AWS %s:%s", awsKeyID, signature );
-  slist = curl_slist_append(slist, Buf );
+/// Complete a multipart upload of parts 1 to u->sent
+/// \return 0 or an error code
+static int __upload_complete ( AwsUpload * u, IOBuf * b )
+{
+  StrBuf xml = { NULL, 0, 0 };
+  char file[1024];
+  int sc, i;
+
+  __strbuf_printf ( &xml, "<CompleteMultipartUpload>" );
+  for ( i = 0 ; i < u->sent ; i ++ )
+    __strbuf_printf ( &xml, "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+		      i + 1, u->eTags[i] );
+  if ( __strbuf_printf ( &xml, "</CompleteMultipartUpload>" ) < 0 ) sc = AWS_ERR_NOMEM;
+  else
+    {
+      snprintf ( file, sizeof(file), "%s?uploadId=%s", u->name, u->uploadId );
+      sc = __s3_post ( b, file, xml.buf, xml.len );
+      /// Completion can fail after a 200, with an error in the body
+      int len;
+      char * d = sc ? NULL : aws_iobuf_data ( b, &len );
+      if ( sc == 0 && ( b->code != 200 || d == NULL || strstr ( d, "<Error>" ))) 
+	sc = AWS_ERR_STATUS;
+    }
+  __strbuf_free ( &xml );
+  if ( sc == 0 ) __upload_forget ( u );
+  return sc;
+}
 
-  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host , resource );
+/// Finish an upload and free it.  A multipart upload is completed,
+/// or aborted if a part failed.
+/// \param u upload
+/// \param b I/O buffer, gets the response of the last request
+/// \return 0 or an error code, AWS_ERR_STATUS if the server refused
+///         a part or the completion
+int s3_upload_close ( AwsUpload * u, IOBuf * b )
+{
+  IOBuf * last = u->bufs[u->parts % u->nBufs];
+  int sc = 0;
 
-  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
-  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
-  curl_easy_setopt ( ch, CURLOPT_READDATA, b );
-  if (!debug)
-    curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writedummyfunc );
-  curl_easy_setopt ( ch, CURLOPT_READFUNCTION, readfunc );
-  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
-  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, b );
-  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
-  curl_easy_setopt ( ch, CURLOPT_UPLOAD, 1 );
-  curl_easy_setopt ( ch, CURLOPT_INFILESIZE, b->len );
-  curl_easy_setopt ( ch, CURLOPT_FOLLOWLOCATION, 1 );
+  if ( u->parts == 0 )
+    {
+      /// All of it fits in one part
+      sc = __s3_put ( last, u->name, AWS_COMPRESS_NONE, 1 );
+      b->code = last->code;
+      __iobuf_set ( b, &b->result, last->result );
+      __iobuf_set ( b, &b->eTag, last->eTag );
+      if ( sc == 0 && b->code / 100 != 2 ) sc = AWS_ERR_STATUS;
+      __upload_free ( u );
+      return sc;
+    }
 
-  int  sc  = curl_easy_perform(ch);
-  /** \todo check the return code  */
-  __debug ( "Return Code: %d ", sc );
-  
-  curl_slist_free_all(slist);
-  curl_easy_cleanup(ch);
+  if ( last->len ) sc = __upload_hand_over ( u );
+  __upload_join ( u );
+  if ( sc == 0 ) sc = u->sc;
+  if ( sc )
+    {
+      __upload_abort ( u );
+      __upload_free ( u );
+      return sc;
+    }
 
+  sc = __upload_complete ( u, b );
+  if ( sc ) __upload_abort ( u );
+  __upload_free ( u );
   return sc;
-
 }
 
-
-static int s3_do_get ( IOBuf *b, char * const signature, 
-		       char * const date, char * const resource )
+/// Give up an upload and free it, aborting the multipart upload if
+/// one was started
+void s3_upload_abort ( AwsUpload * u )
 {
-  char Buf[1024];
+  __upload_join ( u );
+  __upload_abort ( u );
+  __upload_free ( u );
+}
 
-  CURL* ch =  curl_easy_init( );
-  struct curl_slist *slist=NULL;
+/*!
+  \}
+*/
 
-  slist = curl_slist_append(slist, "If-Modified-Since: Tue, 26 May 2009 18:58:55 GMT" );
-  slist = curl_slist_append(slist, "ETag: \"6ea58533db38eca2c2cc204b7550aab6\"");
 
-  snprintf ( Buf, sizeof(Buf), "Date: %s", date );
-  slist = curl_slist_append(slist, Buf );
-  snprintf ( Buf, sizeof(Buf), "Authorization: AWS %s:%s", awsKeyID, signature );
-  slist = curl_slist_append(slist, Buf );
+/*!
+  \defgroup resume Resumable Transfers
+  \{
+*/
 
-  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host, resource );
+/// First line of a checkpoint
+#define RESUME_MAGIC  "aws4c-resume 1"
+/// Block size of s3_get_file_resumable when none is given
+#define RESUME_BLOCK  ( 8 << 20 )
 
-  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
-  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
-  curl_easy_setopt ( ch, CURLOPT_WRITEFUNCTION, writefunc );
-  curl_easy_setopt ( ch, CURLOPT_WRITEDATA, b );
-  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
-  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, b );
-  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+/// Progress of a resumable transfer, kept in a checkpoint file:
+///
+///    aws4c-resume 1
+///    source line, saying what is transferred
+///    piece number TAB ETag, for each piece done
+///
+/// The file is synced after each piece, so a crash loses at most the
+/// pieces in flight.
+typedef struct
+{
+  const char * path;  /// <checkpoint file
+  FILE *  f;          /// <checkpoint open for writing
+  char *  data;       /// <checkpoint as read at start
+  long    keep;       /// <length of data up to the last complete line
+  char *  rest;       /// <source line past the prefix, NULL if starting over
+  int     n;          /// <number of pieces
+  char ** done;       /// <ETag of each piece done, "" for downloads
+} Resume;
+
+/// Read a checkpoint
+/// \param r checkpoint, rest is left NULL if the file is missing
+///          or its source line does not start with prefix
+/// \param path checkpoint file
+/// \param prefix part of the source line that must match
+static void __resume_load ( Resume * r, const char * path, const char * prefix )
+{
+  FILE * f = fopen ( path, "rb" );
+  int m = strlen ( RESUME_MAGIC ), p = strlen ( prefix );
+  long size;
+  char * nl;
+
+  memset ( r, 0, sizeof(Resume));
+  r->path = path;
+  if ( f == NULL ) return;
+  if ( fseek ( f, 0, SEEK_END ) == 0 && ( size = ftell ( f )) >= 0 &&
+       fseek ( f, 0, SEEK_SET ) == 0 && ( r->data = awsMalloc ( size + 1 )) &&
+       fread ( r->data, 1, size, f ) == (size_t) size )
+    {
+      r->data[size] = 0;
+      for ( r->keep = size ; r->keep && r->data[r->keep-1] != '\n' ; r->keep -- );
+      if ( !strncmp ( r->data, RESUME_MAGIC "\n", m + 1 ) && 
+	   !strncmp ( r->data + m + 1, prefix, p ) &&
+	   ( nl = strchr ( r->data + m + 1, '\n' )))
+	{
+	  *nl = 0;
+	  r->rest = r->data + m + 1 + p;
+	}
+    }
+  fclose ( f );
+}
 
-  int  sc  = curl_easy_perform(ch);
-  /** \todo check the return code  */
-  __debug ( "Return Code: %d ", sc );
-  
-  curl_slist_free_all(slist);
-  curl_easy_cleanup(ch);
+/// Set the number of pieces and mark those the checkpoint lists
+/// \return 0 or AWS_ERR_NOMEM
+static int __resume_pieces ( Resume * r, int n )
+{
+  char * p, * nl, * tab;
+  int k;
 
-  return sc;
+  awsFree ( r->done );
+  if (( r->done = awsMalloc (( n + 1 ) * sizeof(char*))) == NULL ) return AWS_ERR_NOMEM;
+  memset ( r->done, 0, ( n + 1 ) * sizeof(char*));
+  r->n = n;
+  if ( r->rest == NULL ) return 0;
 
+  /// A line cut short by a crash has no newline and is left out
+  for ( p = r->rest + strlen ( r->rest ) + 1 ; ( nl = strchr ( p, '\n' )) ; p = nl + 1 )
+    {
+      *nl = 0;
+      if (( tab = strchr ( p, '\t' )) && ( k = atoi ( p )) >= 1 && k <= n )
+	r->done[k-1] = tab + 1;
+    }
+  return 0;
 }
 
-static int s3_do_delete ( IOBuf *b, char * const signature, 
-		       char * const date, char * const resource )
+static int __resume_sync ( Resume * r )
 {
-  char Buf[1024];
+  return fflush ( r->f ) || fsync ( fileno ( r->f )) ? AWS_ERR_IO : 0;
+}
 
-  CURL* ch =  curl_easy_init( );
-  struct curl_slist *slist=NULL;
+/// Start the checkpoint over, forgetting the pieces done
+/// \param source source line
+/// \return 0 or AWS_ERR_IO
+static int __resume_start ( Resume * r, const char * source )
+{
+  if ( r->f ) fclose ( r->f );
+  if ( r->done ) memset ( r->done, 0, r->n * sizeof(char*));
+  r->rest = NULL;
+  if (( r->f = fopen ( r->path, "w" )) == NULL ) return AWS_ERR_IO;
+  fprintf ( r->f, "%s\n%s\n", RESUME_MAGIC, source );
+  return __resume_sync ( r );
+}
 
+/// Go on with the checkpoint read by __resume_load, dropping a line
+/// cut short by a crash
+/// \return 0 or AWS_ERR_IO
+static int __resume_continue ( Resume * r )
+{
+  if ( truncate ( r->path, r->keep ) || ( r->f = fopen ( r->path, "a" )) == NULL )
+    return AWS_ERR_IO;
+  return 0;
+}
 
-  snprintf ( Buf, sizeof(Buf), "Date: %s", date );
-  slist = curl_slist_append(slist, Buf );
-  snprintf ( Buf, sizeof(Buf), "Authorization: AWS %s:%s", awsKeyID, signature );
-  slist = curl_slist_append(slist, Buf );
+/// Record a piece as done
+/// \param k piece number, from 1
+/// \return 0 or AWS_ERR_IO
+static int __resume_mark ( Resume * r, int k, const char * eTag )
+{
+  fprintf ( r->f, "%d\t%s\n", k, eTag );
+  return __resume_sync ( r );
+}
 
-  snprintf ( Buf, sizeof(Buf), "http://%s/%s", S3Host, resource );
+/// Free the checkpoint
+/// \param finished remove the file, the transfer is done
+static void __resume_close ( Resume * r, int finished )
+{
+  if ( r->f ) fclose ( r->f );
+  if ( finished ) unlink ( r->path );
+  awsFree ( r->done );
+  awsFree ( r->data );
+}
 
-  curl_easy_setopt ( ch, CURLOPT_CUSTOMREQUEST, "DELETE");
-  curl_easy_setopt ( ch, CURLOPT_HTTPHEADER, slist);
-  curl_easy_setopt ( ch, CURLOPT_URL, Buf );
-  curl_easy_setopt ( ch, CURLOPT_HEADERFUNCTION, header );
-  curl_easy_setopt ( ch, CURLOPT_HEADERDATA, b );
-  curl_easy_setopt ( ch, CURLOPT_VERBOSE, debug );
+/// Upload a local file so that a crash or a failed part does not 
+/// lose what was sent.  The file goes up as a multipart upload whose
+/// ID and part ETags are kept in a checkpoint file.  Calling again 
+/// with the same arguments uploads only the missing parts, if the 
+/// file still has the size and modification time it had, and starts
+/// over otherwise.  The checkpoint is removed once the object is 
+/// complete.  A file of one part or less goes up with one PUT.
+/// \param b I/O buffer, gets the response of the last request
+/// \param file filename
+/// \param path local file to upload
+/// \param checkpoint file to keep the progress in
+/// \param partSize bytes per part, at least 5MB, 0 for 8MB
+/// \return 0, AWS_ERR_IO if the file or the checkpoint could not be
+///         read or written, AWS_ERR_SPACE if the file needs more than
+///         10000 parts, or the error of the request that failed
+int s3_put_file_resumable ( IOBuf * b, char * const file, const char * path,
+			    const char * checkpoint, int partSize )
+{
+  FILE * f = fopen ( path, "rb" );
+  AwsUpload * u = NULL;
+  struct stat st;
+  char source[1200];
+  char * chunk = NULL;
+  Resume r;
+  int sc = 0, k, m, nParts;
+
+  if ( f == NULL || fstat ( fileno ( f ), &st )) 
+    { if ( f ) fclose ( f ); return AWS_ERR_IO; }
+  if (( u = s3_upload_open ( file, partSize, 2 )) == NULL ||
+      ( chunk = awsMalloc ( u->partSize )) == NULL )
+    {
+      fclose ( f );
+      if ( u ) __upload_free ( u );
+      return AWS_ERR_NOMEM;
+    }
+  IOBuf * pb = u->bufs[0];
+  nParts = ( st.st_size + u->partSize - 1 ) / u->partSize;
+  if ( nParts <= 1 )
+    {
+      k = fread ( chunk, 1, st.st_size, f );
+      aws_iobuf_append ( pb, chunk, k );
+      fclose ( f );
+      awsFree ( chunk );
+      if ( k != st.st_size ) { __upload_free ( u ); return AWS_ERR_IO; }
+      return s3_upload_close ( u, b );
+    }
 
-  int  sc  = curl_easy_perform(ch);
-  /** \todo check the return code  */
-  __debug ( "Return Code: %d ", sc );
+  m = snprintf ( source, sizeof(source), "put\t%s\t%ld\t%ld\t%d\t", file, 
+		 (long) st.st_size, (long) st.st_mtime, u->partSize );
+  __resume_load ( &r, checkpoint, source );
+  int resumed = r.rest && *r.rest;
+  if ( nParts > UPLOAD_MAX_PARTS ) sc = AWS_ERR_SPACE;
+  if ( sc == 0 ) sc = __resume_pieces ( &r, nParts );
+  if ( sc == 0 && resumed )
+    {
+      /// __upload_start is skipped, the object is forgotten here
+      __upload_forget ( u );
+      if (( u->uploadId = __upload_keep ( u, r.rest, strlen ( r.rest ))) == NULL )
+	sc = AWS_ERR_NOMEM;
+      else sc = __resume_continue ( &r );
+    }
+  else if ( sc == 0 && ( sc = __upload_start ( u )) == 0 )
+    {
+      snprintf ( source + m, sizeof(source) - m, "%s", u->uploadId );
+      sc = __resume_start ( &r, source );
+    }
 
-  
-  curl_slist_free_all(slist);
-  curl_easy_cleanup(ch);
+  for ( k = 1 ; sc == 0 && k <= nParts ; k ++ )
+    {
+      if ( r.done[k-1] ) { sc = __upload_etag ( u, k, r.done[k-1] ); continue; }
+      int len = k < nParts ? u->partSize : st.st_size - (long)( k - 1 ) * u->partSize;
+      if ( fseek ( f, (long)( k - 1 ) * u->partSize, SEEK_SET ) ||
+	   fread ( chunk, 1, len, f ) != (size_t) len ) { sc = AWS_ERR_IO; break; }
+      aws_iobuf_append ( pb, chunk, len );
+      sc = __upload_part ( u, pb, k );
+      if ( sc == AWS_ERR_STATUS && pb->code == 404 && resumed )
+	{
+	  /// The upload expired or was aborted, start it over
+	  resumed = 0;
+	  if (( sc = __upload_start ( u )) == 0 )
+	    {
+	      snprintf ( source + m, sizeof(source) - m, "%s", u->uploadId );
+	      sc = __resume_start ( &r, source );
+	    }
+	  k = 0;
+	}
+      else if ( sc == 0 ) sc = __resume_mark ( &r, k, u->eTags[k-1] );
+      aws_iobuf_reset ( pb );
+    }
+  fclose ( f );
+  awsFree ( chunk );
 
+  if ( sc == 0 )
+    {
+      u->sent = nParts;
+      sc = __upload_complete ( u, b );
+    }
+  /// Nothing to resume if the server no longer knows the upload
+  __resume_close ( &r, sc == 0 || ( sc == AWS_ERR_STATUS && b->code == 404 ));
+  __upload_free ( u );
   return sc;
-
 }
 
-
-
-
-static char* __aws_sign ( char * const str )
+/// Download an object into a local file so that a crash or a failed
+/// request does not lose what was received.  The object comes in 
+/// blocks with ranged GETs, and the blocks written are kept in a
+/// checkpoint file.  Calling again with the same arguments gets only
+/// the missing blocks, if the object still has the ETag and size it
+/// had, and starts over otherwise.  The checkpoint is removed once 
+/// the file is complete.  The data is written as stored, without 
+/// checksum verification or decompression.
+/// \param b I/O buffer, gets the code, result and ETag of the object, 
+///          or the response that failed
+/// \param file filename
+/// \param path local file to write
+/// \param checkpoint file to keep the progress in
+/// \param blockSize bytes per request, 0 for 8MB
+/// \return 0, AWS_ERR_IO if the file or the checkpoint could not be
+///         read or written, or the error of the request that failed
+int s3_get_file_resumable ( IOBuf * b, char * const file, const char * path,
+			    const char * checkpoint, int blockSize )
 {
-  HMAC_CTX ctx;
-  unsigned char MD[256];
-  unsigned len;
+  char source[1200], eTag[256] = "";
+  long size = 0, off = 0;
+  int sc = 0, k, m, n = 0, len, checked = 0, again = 0;
+  Resume r;
+
+  if ( blockSize <= 0 ) blockSize = RESUME_BLOCK;
+  m = snprintf ( source, sizeof(source), "get\t%s\t%d\t", file, blockSize );
+  __resume_load ( &r, checkpoint, source );
+
+  /// The file is kept only when there is something to resume
+  FILE * f = r.rest ? fopen ( path, "r+b" ) : NULL;
+  if ( f == NULL ) { f = fopen ( path, "w+b" ); r.rest = NULL; }
+  if ( f == NULL ) { __resume_close ( &r, 0 ); return AWS_ERR_IO; }
+  if ( r.rest && sscanf ( r.rest, "%ld\t%255[^\n]", &size, eTag ) >= 1 && size > 0 )
+    n = ( size + blockSize - 1 ) / blockSize;
+  else r.rest = NULL;
+  IOBuf * rb = aws_iobuf_new ();
+  if (( sc = __resume_pieces ( &r, n )) == 0 && rb == NULL ) sc = AWS_ERR_NOMEM;
+
+  for ( k = 0 ; sc == 0 ; k ++ )
+    {
+      while ( k < n && r.done[k] ) k ++;
+      /// Even with every block done one request checks the object
+      if ( k == n && checked ) break;
+      off = k < n ? (long) k * blockSize : 0;
+      aws_iobuf_reset ( rb );
+      sc = s3_get_range ( rb, file, off, blockSize );
+      if ( sc == 0 && rb->code == 416 )
+	{
+	  /// Empty objects have no range
+	  aws_iobuf_reset ( rb );
+	  sc = __s3_get ( rb, file, NULL );
+	}
+      if ( sc ) break;
 
-  __debug("StrToSign:%s", str );
+      char * d = aws_iobuf_data ( rb, &len );
+      if ( rb->code == 200 )
+	{
+	  /// The whole object came back
+	  size = len;
+	  if (( d == NULL && len ) || fseek ( f, 0, SEEK_SET ) || 
+	      fwrite ( d, 1, len, f ) != (size_t) len ) sc = AWS_ERR_IO;
+	  break;
+	}
+      if ( rb->code != 206 || ( d == NULL && len )) { sc = AWS_ERR_STATUS; break; }
 
-  HMAC_CTX_init(&ctx);
-  HMAC_Init(&ctx, awsKey, strlen(awsKey), EVP_sha1());
-  HMAC_Update(&ctx,(unsigned char*)str, strlen(str));
-  HMAC_Final(&ctx,(unsigned char*)MD,&len);
-  HMAC_CTX_cleanup(&ctx);
+      const char * tag = rb->eTag ? rb->eTag : "";
+      if ( !checked || rb->totalLen != size || strcmp ( tag, eTag ))
+	{
+	  if ( !checked && r.rest && rb->totalLen == size && !strcmp ( tag, eTag ))
+	    sc = __resume_continue ( &r );
+	  else
+	    {
+	      /// New download, or the object changed
+	      size = rb->totalLen;
+	      snprintf ( eTag, sizeof(eTag), "%s", tag );
+	      snprintf ( source + m, sizeof(source) - m, "%ld\t%s", size, eTag );
+	      n = ( size + blockSize - 1 ) / blockSize;
+	      if (( sc = __resume_start ( &r, source )) == 0 ) sc = __resume_pieces ( &r, n );
+	      k = off / blockSize;
+	      again = 1;
+	    }
+	  checked = 1;
+	  if ( sc ) break;
+	}
+      if ( k == n ) break;
+
+      if ( len != ( size - off < blockSize ? size - off : blockSize )) 
+	{ sc = AWS_ERR_STATUS; break; }
+      /// The data must be on disk before the checkpoint says so
+      if ( fseek ( f, off, SEEK_SET ) || fwrite ( d, 1, len, f ) != (size_t) len ||
+	   fflush ( f ) || fsync ( fileno ( f ))) { sc = AWS_ERR_IO; break; }
+      if (( sc = __resume_mark ( &r, k + 1, "" ))) break;
+      r.done[k] = "";
+      /// After starting over the blocks before this one are missing
+      if ( again ) { again = 0; k = -1; }
+    }
 
-  char * b64 = __b64_encode (MD,len);
-  __debug("Signature:  %s", b64 );
+  if ( sc == 0 && ( fflush ( f ) || ftruncate ( fileno ( f ), size ) || 
+		    fsync ( fileno ( f )))) sc = AWS_ERR_IO;
+  if ( fclose ( f ) && sc == 0 ) sc = AWS_ERR_IO;
+  __resume_close ( &r, sc == 0 );
 
-  return b64;
+  if ( rb )
+    {
+      b->code = rb->code;
+      __iobuf_set ( b, &b->result, rb->result );
+      __iobuf_set ( b, &b->eTag, rb->eTag );
+      if ( sc == 0 && rb->code == 206 )
+	{
+	  b->code = 200;
+	  __iobuf_set ( b, &b->result, "200 OK" );
+	}
+      b->totalLen = size;
+      aws_iobuf_free ( rb );
+    }
+  return sc;
 }
+
 /*!
   \}
 */
 
 
-
 #define SQS_REQ_TAIL   "&Signature=%s" "&SignatureVersion=1" "&Timestamp=%s" "&Version=2009-02-01"
+
+/// Prefix of message bodies packed by sqs_set_compression, 
+/// followed by the Content-Encoding name of the method and ':'
+#define SQS_PACK_MARK  "aws4c-"
+#define SQS_PACK_LEN   11
+
+/// Compress and base64 encode a message body
+/// \param msg message body
+/// \param out string buffer receiving the packed body
+/// \return 0 on success or an error code
+static int __sqs_pack ( const char * msg, StrBuf * out )
+{
+  StrBuf z = { NULL, 0, 0 };
+  int rc = __codec_compress ( sqsCompress, sqsLevel, msg, strlen(msg), &z );
+  if ( !rc ) rc = __strbuf_printf ( out, SQS_PACK_MARK "%s:", __codec_name ( sqsCompress ));
+  if ( !rc ) rc = __strbuf_reserve ( out, AWS_B64_ENCODED_LEN ( z.len ));
+  if ( !rc ) out->len += aws_b64_encode ( (unsigned char*) z.buf, z.len, 
+					  out->buf + out->len, out->size - out->len );
+  __strbuf_free ( &z );
+  return rc;
+}
+
+/// Append a received message body to the I/O buffer, unpacking it
+/// if it was packed by __sqs_pack
+/// \param b I/O buffer
+/// \param body message body
+/// \param len length of the body
+/// \return 0 on success or an error code
+static int __sqs_unpack ( IOBuf * b, const char * body, int len )
+{
+  int m = AWS_COMPRESS_NONE;
+  if ( len > SQS_PACK_LEN && !strncmp ( body, SQS_PACK_MARK, 6 ))
+    {
+      if ( !strncmp ( body + 6, "gzip:", 5 )) m = AWS_COMPRESS_GZIP;
+      if ( !strncmp ( body + 6, "zstd:", 5 )) m = AWS_COMPRESS_ZSTD;
+    }
+  if ( m == AWS_COMPRESS_NONE || !__codec_supported ( m ))
+    { 
+      if ( len > 0 ) aws_iobuf_append ( b, (char*) body, len ); 
+      return 0;
+    }
+
+  int n = AWS_B64_DECODED_LEN ( len - SQS_PACK_LEN );
+  char * raw = awsMalloc ( n );
+  if ( raw == NULL ) return AWS_ERR_NOMEM;
+
+  AwsCodec c;
+  int rc = aws_b64_decode ( body + SQS_PACK_LEN, len - SQS_PACK_LEN, 
+			    (unsigned char*) raw, n );
+  if ( rc < 0 ) { awsFree ( raw ); return AWS_ERR_COMPRESS; }
+  n  = rc;
+  rc = __codec_init ( &c, m, 0, 1 );
+  if ( !rc ) rc = __codec_run ( &c, raw, n, 1, __sink_iobuf, b );
+  if ( !rc && !c.ended ) rc = AWS_ERR_COMPRESS;
+  __codec_end ( &c );
+  awsFree ( raw );
+  return rc;
+}
+
 /*!
   \defgroup sqs SQS Interface Functions
   \{
 */
 
 
+/// Compress message bodies sent to SQS
+/// \param method AWS_COMPRESS_* method, AWS_COMPRESS_NONE to turn it off
+/// \param level compression level of the method, 0 for its default
+/// \return 0 or AWS_ERR_UNSUPPORTED if the method is not compiled in
+///
+/// Compressed bodies are base64 encoded behind an "aws4c-gzip:" or 
+/// "aws4c-zstd:" prefix.  sqs_get_message unpacks them whether or not
+/// compression is turned on.
+int sqs_set_compression ( int method, int level )
+{
+  if ( !__codec_supported ( method )) return AWS_ERR_UNSUPPORTED;
+  sqsCompress = method;
+  sqsLevel    = level;
+  return 0;
+}
+
 /// Create SQS queue
 /// \param b I/O buffer
 /// \param name queue name
@@ -799,7 +5695,7 @@ int sqs_create_queue ( IOBuf *b, char * const name )
   char  resource [1024];
   char  customSign [1024];
   char * date = NULL;
-  char * signature = NULL;
+  char   signature [128];
   
   char * Req = 
     "http://%s/"
@@ -816,12 +5712,11 @@ int sqs_create_queue ( IOBuf *b, char * const name )
 
   date = __aws_get_iso_date  ();
   snprintf ( customSign, sizeof(customSign), Sign, awsKeyID, name, date );
-  signature =  SQSSign ( customSign );
+  SQSSign ( customSign, signature, sizeof(signature) );
 
   snprintf ( resource, sizeof(resource), SQSHost, Req , name, awsKeyID, signature, date );
 
-  int sc = SQSRequest( b, "POST", resource ); 
-  free ( signature );
+  int sc = SQSRequest( b, "POST", resource, AWS_OP_SQS_CREATE_QUEUE, name ); 
   return sc;
 
 }
@@ -839,7 +5734,7 @@ int sqs_list_queues ( IOBuf *b, char * const prefix )
   char  resource [1024];
   char  customSign [1024];
   char * date = NULL;
-  char * signature = NULL;
+  char   signature [128];
   
   char * Req = 
     "http://%s/"
@@ -856,18 +5751,17 @@ int sqs_list_queues ( IOBuf *b, char * const prefix )
 
   date = __aws_get_iso_date  ();
   snprintf ( customSign, sizeof(customSign), Sign, awsKeyID, prefix, date );
-  signature =  SQSSign ( customSign );
+  SQSSign ( customSign, signature, sizeof(signature) );
 
   snprintf ( resource, sizeof(resource), Req , SQSHost , prefix, awsKeyID,
 	     signature, date );
 
-  IOBuf *nb = aws_iobuf_new();
-  int sc = SQSRequest( nb, "POST", resource ); 
-  free ( signature );
+  IOBuf *nb = aws_iobuf_acquire ();
+  int sc = SQSRequest( nb, "POST", resource, AWS_OP_SQS_LIST_QUEUES, prefix ); 
 
-  if ( nb->result != NULL )
-    b-> result = strdup(nb->result);
+  __iobuf_set ( b, &b->result, nb->result );
   b-> code   = nb->code;
+  b-> timing = nb->timing;
 
   /// \todo This only retrieves just one line in the string..
   ///       make that all URLs are returned
@@ -895,7 +5789,7 @@ int sqs_list_queues ( IOBuf *b, char * const prefix )
 	    }
 	}      
     }
-  aws_iobuf_free ( nb );
+  aws_iobuf_release ( nb );
 
   return sc;
 }
@@ -914,7 +5808,7 @@ int sqs_get_queueattributes ( IOBuf *b, char * url, int *timeOut, int *nMesg )
   char  resource [1024];
   char  customSign [1024];
   char * date = NULL;
-  char * signature = NULL;
+  char   signature [128];
 
   char * Req = 
     "%s/"
@@ -935,7 +5829,7 @@ int sqs_get_queueattributes ( IOBuf *b, char * url, int *timeOut, int *nMesg )
 
   date = __aws_get_iso_date  ();
   snprintf ( customSign, sizeof(customSign), Sign, awsKeyID, date );
-  signature =  SQSSign ( customSign );
+  SQSSign ( customSign, signature, sizeof(signature) );
 
   snprintf ( resource, sizeof(resource), Req , url, awsKeyID, signature, date );
 
@@ -943,7 +5837,7 @@ int sqs_get_queueattributes ( IOBuf *b, char * url, int *timeOut, int *nMesg )
   const char *pfxQLen  = "<Name>ApproximateNumberOfMessages</Name><Value>";
 
 
-  int sc = SQSRequest( b, "POST", resource ); 
+  int sc = SQSRequest( b, "POST", resource, AWS_OP_SQS_GET_ATTRIBUTES, url ); 
   while(-1) 
     {
       char Ln[1024];
@@ -957,7 +5851,6 @@ int sqs_get_queueattributes ( IOBuf *b, char * url, int *timeOut, int *nMesg )
       if ( q != 0 ) { *nMesg = atoi(q+strlen(pfxQLen));  }
     }
 
-  free ( signature );
   return sc;
 }
 
@@ -973,7 +5866,7 @@ int sqs_set_queuevisibilitytimeout ( IOBuf *b, char * url, int sec )
   char  resource [1024];
   char  customSign [1024];
   char * date = NULL;
-  char * signature = NULL;
+  char   signature [128];
 
   char * Req = 
     "%s/"
@@ -994,13 +5887,12 @@ int sqs_set_queuevisibilitytimeout ( IOBuf *b, char * url, int sec )
 
   date = __aws_get_iso_date  ();
   snprintf ( customSign, sizeof(customSign), Sign, sec, awsKeyID, date );
-  signature =  SQSSign ( customSign );
+  SQSSign ( customSign, signature, sizeof(signature) );
 
   snprintf ( resource, sizeof(resource), Req , 
 	     url, sec, awsKeyID, signature, date );
 
-  int sc = SQSRequest( b, "POST", resource ); 
-  free ( signature );
+  int sc = SQSRequest( b, "POST", resource, AWS_OP_SQS_SET_ATTRIBUTES, url ); 
   return sc;
 }
 
@@ -1014,21 +5906,20 @@ int sqs_send_message ( IOBuf *b, char * const url, char * const msg )
   __debug ( "Sending Message to the queue %s\n[%s]",
 	  url, msg );
 
-  char  resource [10900];
-  char  customSign [10900];
+  StrBuf * resource   = __strbuf_scratch ( 0 );
+  StrBuf * customSign = __strbuf_scratch ( 1 );
+  StrBuf packed     = { NULL, 0, 0 };
   char * date = NULL;
-  char * signature = NULL;
-  char  encodedMsg[8192];
-
-  __aws_urlencode ( msg, encodedMsg, sizeof(encodedMsg));
-  __debug ( "Encoded MSG %s", encodedMsg );
+  char   signature [128];
+  int    sc;
+  char * body = msg;
 
-  char * Req = 
-    "%s/"
-    "?Action=SendMessage"
-    "&MessageBody=%s"
-    "&AWSAccessKeyId=%s"
-    SQS_REQ_TAIL ;
+  if ( sqsCompress )
+    {
+      sc = __sqs_pack ( msg, &packed );
+      if ( sc ) goto done;
+      body = packed.buf;
+    }
 
   char * Sign = 
     "ActionSendMessage"
@@ -1039,14 +5930,26 @@ int sqs_send_message ( IOBuf *b, char * const url, char * const msg )
     "Version2009-02-01";
 
   date = __aws_get_iso_date  ();
-  snprintf ( customSign, sizeof(customSign), Sign, awsKeyID, msg, date );
-  signature =  SQSSign ( customSign );
-
-  snprintf ( resource, sizeof(resource), Req , 
-	     url, encodedMsg, awsKeyID, signature, date );
-
-  int sc = SQSRequest( b, "POST", resource ); 
-  free ( signature );
+  sc = __strbuf_printf ( customSign, Sign, awsKeyID, body, date );
+  if ( sc ) goto done;
+  SQSSign ( customSign->buf, signature, sizeof(signature) );
+
+  /// The message body is encoded in place right after its parameter name
+  sc = __strbuf_printf ( resource, "%s/?Action=SendMessage&MessageBody=", url );
+  int start = resource->len;
+  if ( !sc ) sc = __strbuf_append ( resource, body, strlen(body) );
+  if ( !sc ) sc = __aws_urlencode_inplace ( resource, start );
+  if ( !sc ) sc = __strbuf_printf ( resource, "&AWSAccessKeyId=%s" SQS_REQ_TAIL,
+				    awsKeyID, signature, date );
+  if ( sc ) goto done;
+  __debug ( "Encoded MSG %s", resource->buf + start );
+
+  sc = SQSRequest( b, "POST", resource->buf, AWS_OP_SQS_SEND, url ); 
+
+ done:
+  __strbuf_scratch_done ( resource );
+  __strbuf_scratch_done ( customSign );
+  __strbuf_free ( &packed );
   return sc;
 }
 
@@ -1066,7 +5969,7 @@ int sqs_get_message ( IOBuf * b, char * const url, char * id  )
   char  resource [10900];
   char  customSign [10900];
   char * date = NULL;
-  char * signature = NULL;
+  char   signature [128];
 
   char * Req = 
     "%s/"
@@ -1083,19 +5986,22 @@ int sqs_get_message ( IOBuf * b, char * const url, char * id  )
 
   date = __aws_get_iso_date  ();
   snprintf ( customSign, sizeof(customSign), Sign, awsKeyID, date );
-  signature =  SQSSign ( customSign );
+  SQSSign ( customSign, signature, sizeof(signature) );
 
   snprintf ( resource, sizeof(resource), Req , 
 	     url, awsKeyID, signature, date );
-  free ( signature );
 
-  IOBuf * bf = aws_iobuf_new();
-  int sc = SQSRequest( bf, "POST", resource ); 
+  IOBuf * bf = aws_iobuf_acquire ();
+  int sc = SQSRequest( bf, "POST", resource, AWS_OP_SQS_RECEIVE, url ); 
 
   b->code = bf->code;
-  b->result = strdup(bf->result);
+  b->timing = bf->timing;
+  __iobuf_set ( b, &b->result, bf->result );
   
-  if ( bf->code != 200 ) { aws_iobuf_free(bf);  return sc; }
+  if ( bf->code != 200 ) { aws_iobuf_release ( bf );  return sc; }
+
+      /// The body is collected first, it may have to be unpacked
+      StrBuf * body = __strbuf_scratch ( 0 );
 
       /// \todo This is really bad. Must get a real message parser
       int inBody = 0;
@@ -1115,7 +6021,7 @@ int sqs_get_message ( IOBuf * b, char * const url, char * id  )
 	    {
 	      e = strstr ( Ln, "</Body>" );
 	      if ( e ) { *e = 0; inBody = 0; }
-	      aws_iobuf_append (b,Ln,strlen(Ln));
+	      if ( __strbuf_append ( body, Ln, strlen(Ln))) break;
 	      if ( ! inBody ) break;
 	      continue;     
 	    }
@@ -1134,11 +6040,14 @@ int sqs_get_message ( IOBuf * b, char * const url, char * id  )
 		  q += 6;
 		  e = strstr ( q, "</Body>" );
 		  if ( e ) *e = 0; else inBody = 1;
-		  aws_iobuf_append (b,q,strlen(q));
+		  if ( __strbuf_append ( body, q, strlen(q))) break;
 		}
 	    }
 	}
-     
+
+  sc = __sqs_unpack ( b, body->buf, body->len );
+  __strbuf_scratch_done ( body );
+  aws_iobuf_release ( bf );
 
   return sc;
 }
@@ -1154,7 +6063,7 @@ int sqs_delete_message ( IOBuf * bf, char * const url, char * receipt )
   char  resource [10900];
   char  customSign [10900];
   char * date = NULL;
-  char * signature = NULL;
+  char   signature [128];
 
   char * Req = 
     "%s/"
@@ -1173,15 +6082,15 @@ int sqs_delete_message ( IOBuf * bf, char * const url, char * receipt )
 
   date = __aws_get_iso_date  ();
   snprintf ( customSign, sizeof(customSign), Sign, awsKeyID, receipt, date );
-  signature =  SQSSign ( customSign );
+  SQSSign ( customSign, signature, sizeof(signature) );
 
-  char encReceipt[1024];
-  __aws_urlencode ( receipt, encReceipt, sizeof(encReceipt));
+  char encReceipt[4096];
+  if ( __aws_urlencode ( receipt, encReceipt, sizeof(encReceipt)) < 0 )
+    return AWS_ERR_ENCODE;
 
   snprintf ( resource, sizeof(resource), Req , url, encReceipt, awsKeyID, signature, date );
-  free ( signature );
 
-  int sc = SQSRequest( bf, "POST", resource ); 
+  int sc = SQSRequest( bf, "POST", resource, AWS_OP_SQS_DELETE, url ); 
   return sc;
 }
 
@@ -1198,17 +6107,151 @@ int sqs_delete_message ( IOBuf * bf, char * const url, char * receipt )
 
 /// \todo Place sentinels at the begining of the buffer
 
+/// Block of an arena, memory is handed out from data front to back
+struct _AwsArena
+{
+  struct _AwsArena * next;   /// <block filled before this one
+  int  used;                 /// <bytes of data handed out
+  int  size;                 /// <size of data
+  char data[];
+};
+
+/// Smallest and largest size of a new arena block
+#define ARENA_MIN  256
+#define ARENA_MAX  (1 << 20)
+
+/// Smallest and largest room of a new I/O buffer node
+#define IOBUF_NODE_MIN  1024
+#define IOBUF_NODE_MAX  (1 << 20)
+
+/// I/O buffers kept per thread by aws_iobuf_release, and the node
+/// memory each of them may keep
+#define IOBUF_POOL       8
+#define IOBUF_POOL_KEEP  (1 << 20)
+
+static __thread IOBuf * ioPool[IOBUF_POOL];
+static __thread int     ioPoolN = 0;
+
+/// Allocate from an arena, adding a block when the current one is full
+/// \param a arena, updated when a block is added
+/// \param n number of bytes
+/// \return memory aligned for any type, NULL if out of memory
+static void * __arena_alloc ( AwsArena ** a, int n )
+{
+  n = ( n + 15 ) & ~15;
+  if ( *a == NULL || (*a)->used + n > (*a)->size )
+    {
+      int size = *a ? (*a)->size * 2 : ARENA_MIN;
+      if ( size > ARENA_MAX ) size = ARENA_MAX;
+      if ( size < n ) size = n;
+      AwsArena * b = awsMalloc ( sizeof(AwsArena) + size );
+      if ( b == NULL ) return NULL;
+      b->next = *a;
+      b->used = 0;
+      b->size = size;
+      *a = b;
+    }
+  void * p = (*a)->data + (*a)->used;
+  (*a)->used += n;
+  return p;
+}
+
+/// Allocate memory that lives as long as the I/O buffer
+static void * __iobuf_alloc ( IOBuf * B, int n )
+{ return B->arena ? __arena_alloc ( &B->arena, n ) : awsMalloc ( n ); }
+
+/// Release all blocks of an arena but one
+/// \param a arena
+/// \param keep block to keep, emptied
+static void __arena_rewind ( AwsArena ** a, AwsArena * keep )
+{
+  AwsArena * b = *a;
+  while ( b )
+    {
+      AwsArena * next = b->next;
+      if ( b != keep ) awsFree ( b );
+      b = next;
+    }
+  if (( *a = keep )) { keep->next = NULL; keep->used = 0; }
+}
+
+/// Set one of the string fields of the I/O buffer.  Strings come
+/// from the arena and are only reclaimed by aws_iobuf_reset, so a 
+/// replaced value stays allocated until then.
+/// \param field result, eTag or lastMod of b
+/// \param s new value, may be NULL
+static void __iobuf_set ( IOBuf * b, char ** field, const char * s )
+{
+  *field = NULL;
+  if ( s == NULL ) return;
+  int n = strlen ( s ) + 1;
+  if (( *field = __arena_alloc ( b->arena ? &b->arena : &b->strings, n )))
+    memcpy ( *field, s, n );
+}
+
+/// Get an empty node with room for at least len bytes, a spare one
+/// if it is big enough, and link it at the end of the buffer
+static IOBufNode * __iobuf_node ( IOBuf * B, int len )
+{
+  IOBufNode * N = B->spare;
+  if ( N && N->size > len )
+    B->spare = N->next;
+  else
+    {
+      /// Nodes grow with the buffer so large bodies take few of them
+      int size = B->last ? B->last->size * 2 : IOBUF_NODE_MIN;
+      if ( size > IOBUF_NODE_MAX ) size = IOBUF_NODE_MAX;
+      if ( size < len + 1 ) size = len + 1;
+      N = __iobuf_alloc ( B, sizeof(IOBufNode) + size );
+      if ( N == NULL ) return NULL;
+      N->buf  = (char*)( N + 1 );
+      N->size = size;
+    }
+  N->next   = NULL;
+  N->len    = 0;
+  N->buf[0] = 0;
+
+  if ( B->first == NULL )
+    {
+      B->first   = N;
+      B->current = N;
+      B->pos     = N->buf;
+    }
+  else
+    B->last->next = N;
+  B->last = N;
+  return N;
+}
+
 /// Create a new I/O buffer
 /// \return a newly allocated I/O buffer
 IOBuf * aws_iobuf_new ()
 {
-  IOBuf * bf = malloc(sizeof(IOBuf));
+  IOBuf * bf = awsMalloc(sizeof(IOBuf));
 
   memset(bf, 0, sizeof(IOBuf));
 
   return bf;
 }
 
+/// Create a new I/O buffer that takes all its memory, including the
+/// data and the response headers, from an arena.  aws_iobuf_free 
+/// releases it in one go.
+/// \param size expected amount of data, the arena grows past it as needed
+/// \return a newly allocated I/O buffer or NULL if out of memory
+IOBuf * aws_iobuf_new_arena ( int size )
+{
+  AwsArena * a = NULL;
+  IOBuf * bf = __arena_alloc ( &a, sizeof(IOBuf) + ( size > 0 ? size : 0 ) + 
+			       2 * sizeof(IOBufNode) );
+  if ( bf == NULL ) return NULL;
+  a->used = ( sizeof(IOBuf) + 15 ) & ~15;
+
+  memset(bf, 0, sizeof(IOBuf));
+  bf->arena = a;
+  return bf;
+}
+
 
 /// Append data to I/O buffer
 /// \param B  I/O buffer
@@ -1216,27 +6259,96 @@ IOBuf * aws_iobuf_new ()
 /// \param len length of the data to be appended
 void   aws_iobuf_append ( IOBuf *B, char * d, int len )
 {
-
-  IOBufNode * N = malloc(sizeof(IOBufNode));
-  N->next = NULL;
-  N->buf  = malloc(len+1);
-  memcpy(N->buf,d,len);
-  N->buf[len] = 0;
+  /// Data goes to the end of the last node while it has room
+  IOBufNode * N = B->last;
+  if ( N == NULL || N->size - N->len <= len )
+    if (( N = __iobuf_node ( B, len )) == NULL ) return;
+  memcpy(N->buf + N->len,d,len);
+  N->len += len;
+  N->buf[N->len] = 0;
   B->len += len;
+}
 
-  if ( B->first == NULL )
+/// Make sure the next n bytes appended go into one node
+/// \return 0 on success, AWS_ERR_NOMEM if memory can't be allocated
+static int __iobuf_reserve ( IOBuf * B, int n )
+{
+  if ( B->last && B->last->size - B->last->len > n ) return 0;
+  return __iobuf_node ( B, n ) ? 0 : AWS_ERR_NOMEM;
+}
+
+/// Empty the I/O buffer for another request, keeping its memory.
+/// The nodes stay allocated for the data to come.
+/// \param B I/O buffer
+void aws_iobuf_reset ( IOBuf * B )
+{
+  if ( B->shared && ( B->first = __iobuf_unshare ( B, B->first )) == NULL )
+    B->last = NULL;
+  if ( B->arena )
     {
-      B->first   = N;
-      B->current = N;
-      B->pos     = N->buf;
+      /// The buffer itself lives in the oldest block
+      AwsArena * a = B->arena;
+      while ( a->next ) a = a->next;
+      __arena_rewind ( &B->arena, a );
+      a->used = ( sizeof(IOBuf) + 15 ) & ~15;
     }
   else
     {
-      // Find the last block
-      IOBufNode * D = B->first;
-      while(D->next != NULL ) D = D->next;
-      D->next = N;
+      if ( B->last ) { B->last->next = B->spare; B->spare = B->first; }
+      __arena_rewind ( &B->strings, B->strings );
+    }
+  B->first = B->current = B->last = NULL;
+  B->pos = NULL;
+  B->result = B->lastMod = B->eTag = NULL;
+  B->contentLen = B->len = B->code = 0;
+  B->totalLen = 0;
+  memset ( &B->timing, 0, sizeof(AwsTiming));
+}
+
+/// Get an empty I/O buffer from the pool of the calling thread, or
+/// a new one if the pool is empty.  Give it back with 
+/// aws_iobuf_release, a loop doing so allocates no buffer memory
+/// once the pool is warm.
+/// \return I/O buffer
+IOBuf * aws_iobuf_acquire ()
+{ return ioPoolN ? ioPool[--ioPoolN] : aws_iobuf_new (); }
+
+/// Return an I/O buffer to the pool of the calling thread.  The
+/// buffer is reset and keeps up to 1MB of its nodes; it is freed
+/// when the pool is full.  Pooled buffers of a thread that exits 
+/// are not freed.
+/// \param B I/O buffer
+void aws_iobuf_release ( IOBuf * B )
+{
+  if ( B->arena || ioPoolN == IOBUF_POOL ) { aws_iobuf_free ( B ); return; }
+  aws_iobuf_reset ( B );
+
+  IOBufNode ** N = &B->spare;
+  int kept = 0;
+  while ( *N && kept + (*N)->size <= IOBUF_POOL_KEEP )
+    { kept += (*N)->size; N = &(*N)->next; }
+  while ( *N )
+    {
+      IOBufNode * NN = (*N)->next;
+      awsFree ( *N );
+      *N = NN;
+    }
+  ioPool[ioPoolN++] = B;
+}
+
+/// Move the read position to the next node once the current one
+/// is used up.  The last node is kept so data appended to it later
+/// can still be read.
+/// \return 1 if there is data at the read position
+static int __iobuf_advance ( IOBuf * B )
+{
+  while ( B->current != NULL && B->pos == B->current->buf + B->current->len )
+    {
+      if ( B->current->next == NULL ) return 0;
+      B->current = B->current->next;
+      B->pos     = B->current->buf;
     }
+  return B->current != NULL;
 }
 
 /// Read the next line from the buffer
@@ -1247,51 +6359,144 @@ void   aws_iobuf_append ( IOBuf *B, char * d, int len )
 int    aws_iobuf_getline   ( IOBuf * B, char * Line, int size )
 {
   int ln = 0;
-  memset ( Line, 0, size );
+  if ( size <= 0 ) return 0;
 
-  if ( B->current == NULL ) return 0;
-
-  while ( size - ln > 1 )
+  while ( size - ln > 1 && __iobuf_advance ( B ))
     {
-      if ( *B->pos == '\n' ) { B->pos++; Line[ln] = '\n'; ln++; break; }
-      if ( *B->pos == 0 ) 
-      {
-	B->current = B->current->next;
-	if ( B->current == NULL ) break;
-	B->pos = B->current->buf;
-	continue;
-      }
-      Line[ln] = * B->pos;
-      ln++;
-      
-      B->pos++;
-      // At the end of the block switch again
+      int n = B->current->buf + B->current->len - B->pos;
+      if ( n > size - ln - 1 ) n = size - ln - 1;
+      char * nl = memchr ( B->pos, '\n', n );
+      if ( nl ) n = nl - B->pos + 1;
+      memcpy ( Line + ln, B->pos, n );
+      ln += n;
+      B->pos += n;
+      if ( nl ) break;
     }
+  Line[ln] = 0;
   B->len -= ln;
   return ln;
 }
 
+/// Get the next line without copying it.  The line is left in the
+/// buffer unless it spans two nodes, in which case it is copied into
+/// Line like aws_iobuf_getline does.  The line is not NUL terminated
+/// and stays valid until the buffer is changed.
+///  \param B I/O buffer
+///  \param line set to the start of the line
+///  \param Line  character array for lines that span nodes
+///  \param size  size of the character array Line
+///  \return  length of the line including '\n' or 0 at the end
+int    aws_iobuf_next_line ( IOBuf * B, char ** line, char * Line, int size )
+{
+  *line = Line;
+  if ( !__iobuf_advance ( B )) { if ( size > 0 ) Line[0] = 0; return 0; }
+
+  int n = B->current->buf + B->current->len - B->pos;
+  char * nl = memchr ( B->pos, '\n', n );
+  if ( nl == NULL && B->current->next ) return aws_iobuf_getline ( B, Line, size );
+
+  if ( nl ) n = nl - B->pos + 1;
+  *line = B->pos;
+  B->pos += n;
+  B->len -= n;
+  return n;
+}
+
+/// Read a block of data from the buffer
+/// \internal
+/// \param B I/O buffer
+/// \param d destination
+/// \param size maximum number of bytes to read
+/// \return number of bytes read, 0 at the end of the buffer
+static int __aws_iobuf_read ( IOBuf * B, char * d, int size )
+{
+  int n = 0;
+  while ( n < size && __iobuf_advance ( B ))
+    {
+      int k = B->current->buf + B->current->len - B->pos;
+      if ( k > size - n ) k = size - n;
+      memcpy ( d + n, B->pos, k );
+      n += k; B->pos += k;
+    }
+  B->len -= n;
+  return n;
+}
+
+/// Get the unread data of the buffer in one piece.  Downloads of a
+/// known size already are in one piece, otherwise the data is copied
+/// into a single node first.  The data stays valid until the buffer
+/// is changed and is NUL terminated.
+/// \param B I/O buffer
+/// \param len set to the length of the data
+/// \return pointer to the data, NULL if out of memory
+char * aws_iobuf_data ( IOBuf * B, int * len )
+{
+  static char empty[1];
+  IOBufNode * N;
+
+  *len = 0;
+  if ( !__iobuf_advance ( B )) return empty;
+  for ( N = B->current->next ; N && N->len == 0 ; N = N->next );
+  if ( N == NULL )
+    {
+      *len = B->current->buf + B->current->len - B->pos;
+      return B->pos;
+    }
+
+  /// Gather into a new node, the old ones become spares
+  IOBufNode * cur = B->current, * first = B->first, * last = B->last;
+  char * pos = B->pos;
+  B->first = B->last = NULL;
+  if (( N = __iobuf_node ( B, B->len )) == NULL )
+    {
+      B->first = first; B->last = last; B->current = cur; B->pos = pos;
+      return NULL;
+    }
+  while ( cur )
+    {
+      int k = cur->buf + cur->len - pos;
+      memcpy ( N->buf + N->len, pos, k );
+      N->len += k;
+      if (( cur = cur->next )) pos = cur->buf;
+    }
+  N->buf[N->len] = 0;
+  if ( B->shared ) first = __iobuf_unshare ( B, first );
+  if ( B->arena == NULL && first ) { last->next = B->spare; B->spare = first; }
+  *len = N->len;
+  return N->buf;
+}
+
 /// Release IO Buffer
 /// \param  bf I/O buffer to be deleted
 void   aws_iobuf_free ( IOBuf * bf )
 { 
-  /// Release Things
-  IOBufNode * N = bf->first;
-  if ( bf->result  != NULL ) free ( bf->result  );
-  if ( bf->lastMod != NULL ) free ( bf->lastMod );
-  if ( bf->eTag    != NULL ) free ( bf->eTag    );
-  free (bf);
+  if ( bf->shared ) __shared_put ( bf->shared );
+  if ( bf->arena )
+    {
+      /// The buffer itself lives in the oldest block
+      AwsArena * a = bf->arena;
+      while ( a )
+	{
+	  AwsArena * next = a->next;
+	  awsFree ( a );
+	  a = next;
+	}
+      return;
+    }
 
-  if ( N == NULL ) return;
+  /// Release Things
+  if ( bf->last ) bf->last->next = bf->spare;
+  IOBufNode * N = bf->first ? bf->first : bf->spare;
+  __arena_rewind ( &bf->strings, NULL );
+  awsFree (bf);
 
   /// Walk down the list and release blocks
-  while ( N->next != NULL )
+  while ( N != NULL )
     {
       IOBufNode * NN = N->next;
-      free(N);
+      awsFree(N);
       N = NN;
     }
-  if ( N != NULL ) free ( N );
 }
 
 /*!
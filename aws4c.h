@@ -14,28 +14,81 @@
  * KIND, either express or implied.
  */
 
+#include <stddef.h>
+
+/// Error codes returned by the library.  Request functions otherwise
+/// return CURLcode values, which are never negative
+#define AWS_ERR_NOMEM   -2  /// <memory allocation failed
+#define AWS_ERR_ENCODE  -3  /// <request parameter could not be encoded
+#define AWS_ERR_SPACE   -4  /// <caller supplied buffer is too small
+#define AWS_ERR_CHECKSUM -5 /// <transferred data failed checksum verification
+#define AWS_ERR_COMPRESS -6 /// <body could not be compressed or decompressed
+#define AWS_ERR_UNSUPPORTED -7 /// <feature not compiled into the library
+#define AWS_ERR_STATUS  -8  /// <server answered a request made inside a call with an error
+#define AWS_ERR_IO      -9  /// <local file or checkpoint could not be read or written
+
+/// Checksums for aws_set_checksum
+#define AWS_CHECKSUM_MD5     1  /// <send Content-MD5, verify downloads against the ETag
+#define AWS_CHECKSUM_CRC32C  2  /// <send and verify x-amz-checksum-crc32c
+
+/// Compression methods for s3_set_compression and sqs_set_compression
+#define AWS_COMPRESS_NONE  0
+#define AWS_COMPRESS_GZIP  1  /// <needs ENABLE_GZIP and zlib
+#define AWS_COMPRESS_ZSTD  2  /// <needs ENABLE_ZSTD and libzstd
 
 /// IOBuf Node
 typedef struct _IOBufNode
 {
   char * buf;
   struct _IOBufNode * next;
+  int len;              /// <bytes of data in buf
+  int size;             /// <room in buf, including the terminating NUL
 } IOBufNode;
 
+/// Bump allocator block of an arena I/O buffer
+typedef struct _AwsArena AwsArena;
+
+/// Response shared by coalesced downloads, see s3_set_coalesce
+typedef struct _AwsShared AwsShared;
+
+/// Timing of the last request made with an I/O buffer.
+/// Only filled in after aws_set_timing(1).  Times are in seconds
+/// from the start of the request.
+typedef struct
+{
+  double nameLookup;     /// <host name resolved
+  double connect;        /// <TCP connection established
+  double appConnect;     /// <TLS handshake done, 0 without TLS
+  double preTransfer;    /// <about to send the request
+  double startTransfer;  /// <first byte of the response received
+  double total;          /// <request finished
+  long   bytesUp;        /// <body bytes sent
+  long   bytesDown;      /// <body bytes received
+  int    retries;        /// <number of times the request was resent
+} AwsTiming;
+
 /// IOBuf structure
 typedef struct IOBuf 
 {
   IOBufNode * first;
   IOBufNode * current;
+  IOBufNode * last;
+  IOBufNode * spare;    /// <nodes kept by aws_iobuf_reset for reuse
   char   * pos;
+  AwsArena * arena;     /// <memory of an arena buffer, NULL for the heap
+  AwsArena * strings;   /// <memory of result, lastMod and eTag
+  AwsShared * shared;   /// <owner of the first node when its data is shared
 
   char * result;
   char * lastMod;
   char * eTag;
   int contentLen;
+  long totalLen;        /// <size of the whole object, from a ranged download
   int len;
   int code;
 
+  AwsTiming timing;
+
 } IOBuf;
 
 
@@ -47,15 +100,71 @@ void aws_set_keyid ( char * const str );
 int aws_read_config ( char * const ID );
 void aws_set_debug (int d);
 void aws_set_rrs(int r);
+void aws_set_sigv4 ( int v );
+void aws_set_region ( char * const str );
+void aws_set_checksum ( int flags );
+void aws_set_timing ( int t );
+void aws_set_allocator ( void * (*alloc) ( size_t ), 
+			 void * (*resize) ( void *, size_t ),
+			 void (*release) ( void * ));
 
 
 void s3_set_bucket ( char * const str );
 int s3_get ( IOBuf * b, char * const file );
 int s3_put ( IOBuf * b, char * const file );
 int s3_delete ( IOBuf * b, char * const file );
+int s3_get_range ( IOBuf * b, char * const file, long offset, long len );
 void s3_set_host ( char * const str );
 void s3_set_mime ( char * const str );
 void s3_set_acl ( char * const str );
+int s3_set_compression ( int method, int level );
+
+/// Endpoint selection of s3_set_endpoints
+#define AWS_LB_LEAST_OUTSTANDING  0  /// <endpoint with the fewest requests in flight
+#define AWS_LB_HASH               1  /// <same endpoint for the same key
+
+int s3_set_endpoints ( char * const * hosts, int n, int policy );
+void s3_set_coalesce ( int on );
+int s3_set_negative_cache ( int ttl, int keys );
+
+/// Writer packing small objects into large blobs, see s3_pack_open
+typedef struct _AwsPacker AwsPacker;
+/// Index of packed objects, see s3_pack_index_load
+typedef struct _AwsPackIndex AwsPackIndex;
+
+AwsPacker * s3_pack_open ( char * const prefix, char * const index, int blobSize );
+int s3_pack_add ( AwsPacker * p, char * const key, const char * data, int len );
+int s3_pack_flush ( AwsPacker * p );
+int s3_pack_close ( AwsPacker * p );
+AwsPackIndex * s3_pack_index_load ( char * const index );
+int s3_pack_get ( AwsPackIndex * x, IOBuf * b, char * const key );
+int s3_pack_get_many ( AwsPackIndex * x, char * const * keys, int n, IOBuf ** bufs );
+void s3_pack_index_free ( AwsPackIndex * x );
+
+/// Object opened for random access reads, see s3_file_open
+typedef struct _AwsFile AwsFile;
+
+AwsFile * s3_file_open ( IOBuf * b, char * const file, int blockSize, int blocks );
+long s3_file_size ( AwsFile * f );
+long s3_file_pread ( AwsFile * f, void * buf, long len, long offset );
+void s3_file_close ( AwsFile * f );
+
+/// Upload of data of unknown length, see s3_upload_open
+typedef struct _AwsUpload AwsUpload;
+
+AwsUpload * s3_upload_open ( char * const file, int partSize, int buffers );
+int s3_upload_write ( AwsUpload * u, const void * data, int len );
+int s3_upload_close ( AwsUpload * u, IOBuf * b );
+void s3_upload_abort ( AwsUpload * u );
+
+int s3_put_file_resumable ( IOBuf * b, char * const file, const char * path,
+			    const char * checkpoint, int partSize );
+int s3_get_file_resumable ( IOBuf * b, char * const file, const char * path,
+			    const char * checkpoint, int blockSize );
+
+int s3_presign_url ( char * const file, int expires, char * url, int size );
+int s3_presign_urls ( char * const * files, int n, int expires,
+		      char * buf, int size, char ** urls );
 
 
 int sqs_create_queue ( IOBuf *b, char * const name );
@@ -65,9 +174,164 @@ int sqs_set_queuevisibilitytimeout ( IOBuf *b, char * url, int sec );
 int sqs_get_message ( IOBuf * b, char * const url, char * id  );
 int sqs_send_message ( IOBuf *b, char * const url, char * const msg );
 int sqs_delete_message ( IOBuf * bf, char * const url, char * receipt );
+int sqs_set_compression ( int method, int level );
+
+/// Size of the buffer needed to base64 encode n bytes (with NUL)
+#define AWS_B64_ENCODED_LEN(n)  ( ((n) + 2) / 3 * 4 + 1 )
+/// Size of the buffer needed to decode n base64 characters
+#define AWS_B64_DECODED_LEN(n)  ( ((n) + 3) / 4 * 3 )
+
+int aws_b64_encode ( const unsigned char * src, int len, char * dest, int nDest );
+int aws_b64_decode ( const char * src, int len, unsigned char * dest, int nDest );
+unsigned aws_crc32c ( unsigned crc, const void * data, int len );
+
+/// Operations counted by the metrics
+enum
+{
+  AWS_OP_S3_GET,
+  AWS_OP_S3_PUT,
+  AWS_OP_S3_DELETE,
+  AWS_OP_S3_POST,
+  AWS_OP_SQS_CREATE_QUEUE,
+  AWS_OP_SQS_LIST_QUEUES,
+  AWS_OP_SQS_GET_ATTRIBUTES,
+  AWS_OP_SQS_SET_ATTRIBUTES,
+  AWS_OP_SQS_SEND,
+  AWS_OP_SQS_RECEIVE,
+  AWS_OP_SQS_DELETE,
+  AWS_OP_COUNT
+};
+
+/// Number of HTTP status slots, see aws_metrics_status
+#define AWS_METRICS_STATUS   20
+/// Number of latency histogram buckets, see aws_metrics_bucket_limit
+#define AWS_METRICS_BUCKETS  240
+
+/// Counters of one operation
+typedef struct
+{
+  unsigned long requests;                      /// <requests made
+  unsigned long errors;                        /// <requests that returned an error
+  unsigned long bytesUp;                       /// <body bytes sent
+  unsigned long bytesDown;                     /// <body bytes received
+  unsigned long status[AWS_METRICS_STATUS];    /// <requests by HTTP status slot
+  unsigned long latency[AWS_METRICS_BUCKETS];  /// <requests by latency bucket
+  unsigned long latencySum;                    /// <total latency in microseconds
+} AwsOpMetrics;
+
+/// Library wide metrics, see aws_metrics_snapshot
+typedef struct
+{
+  long inflight;                   /// <requests in progress
+  AwsOpMetrics op[AWS_OP_COUNT];   /// <counters by AWS_OP_*
+} AwsMetrics;
+
+void aws_set_metrics ( int on );
+void aws_metrics_snapshot ( AwsMetrics * m );
+const char * aws_metrics_op_name ( int op );
+const char * aws_metrics_status ( int slot );
+unsigned long aws_metrics_bucket_limit ( int bucket );
+unsigned long aws_metrics_percentile ( const AwsOpMetrics * m, double p );
+int aws_metrics_prometheus ( char * buf, int size );
+
+/// State of a request handed to the lifecycle hooks
+typedef struct
+{
+  int          op;         /// <AWS_OP_* of the request
+  const char * key;        /// <bucket/object of S3 requests, queue of SQS requests
+  IOBuf *      b;          /// <I/O buffer of the request
+  double       elapsed;    /// <seconds since the request started
+  long         bytesUp;    /// <body bytes sent so far
+  long         bytesDown;  /// <body bytes received so far
+  int          retries;    /// <number of times the request was resent
+  int          result;     /// <curl result code, set for complete
+  AwsTiming    timing;     /// <curl's phase timings so far, all of them for complete
+  void *       span;       /// <free for the hooks, kept for the whole request
+} AwsHookEvent;
+
+typedef void (*AwsHook) ( AwsHookEvent * e, void * user );
+
+/// Lifecycle hooks, see aws_set_hooks.  Any of them may be NULL
+typedef struct
+{
+  AwsHook start;       /// <request is about to be sent
+  AwsHook firstByte;   /// <first byte of the response arrived
+  AwsHook headers;     /// <all headers of the final response arrived
+  AwsHook retry;       /// <request is being resent
+  AwsHook complete;    /// <request finished or failed
+  void *  user;        /// <passed to every hook
+} AwsHooks;
+
+void aws_set_hooks ( const AwsHooks * h );
+
+/// Events recorded in the trace ring, see aws_set_trace
+enum
+{
+  AWS_TRACE_START,    /// <request started, a0 = bytes to send
+  AWS_TRACE_STATUS,   /// <status line received, a0 = HTTP code
+  AWS_TRACE_SEND,     /// <body data sent, a0 = bytes, a1 = total so far
+  AWS_TRACE_RECV,     /// <body data received, a0 = bytes, a1 = total so far
+  AWS_TRACE_RETRY,    /// <request resent, a0 = retry number
+  AWS_TRACE_END,      /// <request finished, a0 = result, a1 = HTTP code
+  AWS_TRACE_COUNT
+};
+
+/// Number of records kept per thread, a power of two
+#define AWS_TRACE_RECORDS  4096
+
+/// One trace record, 32 bytes
+typedef struct
+{
+  unsigned long long ts;      /// <CLOCK_MONOTONIC nanoseconds
+  unsigned int       thread;  /// <number of the thread, in order of first use
+  unsigned short     ev;      /// <AWS_TRACE_*
+  unsigned short     op;      /// <AWS_OP_* of the request
+  long long          a0;      /// <first argument
+  long long          a1;      /// <second argument
+} AwsTraceRec;
+
+/// Start of a trace dump, followed by AwsTraceRec records
+typedef struct
+{
+  char     magic[8];   /// <AWS_TRACE_MAGIC
+  unsigned recSize;    /// <sizeof(AwsTraceRec)
+  unsigned reserved;
+} AwsTraceHeader;
+
+#define AWS_TRACE_MAGIC  "AWS4CTR1"
+
+/// Limits of one endpoint or key prefix, see aws_set_rate_control
+typedef struct
+{
+  double rate;         /// <starting requests per second
+  double maxRate;      /// <most requests per second
+  int    inflight;     /// <starting number of requests in flight
+  int    maxInflight;  /// <most requests in flight
+} AwsLimit;
+
+/// Client side rate control
+typedef struct
+{
+  AwsLimit host;       /// <limits of each endpoint
+  AwsLimit prefix;     /// <limits of each key prefix or queue
+  int      retries;    /// <times a throttled request is resent
+} AwsRateControl;
+
+void aws_set_rate_control ( const AwsRateControl * rc );
+
+void aws_set_trace ( int on );
+int aws_trace_dump ( int fd );
+int aws_trace_signal ( int sig, int fd );
+const char * aws_trace_event_name ( int ev );
 
 IOBuf * aws_iobuf_new ();
+IOBuf * aws_iobuf_new_arena ( int size );
+void   aws_iobuf_reset ( IOBuf * b );
+IOBuf * aws_iobuf_acquire ();
+void   aws_iobuf_release ( IOBuf * b );
 void   aws_iobuf_append ( IOBuf *B, char * d, int len );
 int    aws_iobuf_getline   ( IOBuf * B, char * Line, int size );
+int    aws_iobuf_next_line ( IOBuf * B, char ** line, char * Line, int size );
+char * aws_iobuf_data ( IOBuf * B, int * len );
 void   aws_iobuf_free ( IOBuf * bf );
 
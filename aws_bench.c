@@ -0,0 +1,273 @@
+/*
+ *
+ * Copyright(c) 2009,  Vlad Korolev,  <vlad[@]v-lad.org >
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at http://www.gnu.org/licenses/lgpl-3.0.txt
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ */
+
+/// \file aws_bench.c
+/// End to end benchmark of the S3 and SQS calls, normally run
+/// against mock_server with 'make bench'.
+///
+/// For every object size and concurrency level the selected operations
+/// run one after another, each thread doing the same number of calls:
+///
+///    put      stores objects that get and delete then work on
+///    get      downloads them
+///    delete   removes them
+///    send     queues messages of the object size
+///    receive  receives them, keeping the receipt handles
+///    delmsg   deletes the received messages
+///
+/// Every run prints one JSON object per line with the throughput and
+/// the latency percentiles in microseconds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "aws4c.h"
+
+enum { OP_PUT, OP_GET, OP_DELETE, OP_SEND, OP_RECEIVE, OP_DELMSG, OP_COUNT };
+
+static const char * opNames[OP_COUNT] =
+  { "put", "get", "delete", "send", "receive", "delmsg" };
+
+/// Largest message SQS accepts
+#define SQS_MAX_MESSAGE 262144
+
+/// Size of a receipt handle buffer
+#define RECEIPT_SIZE 1024
+
+static char   queueUrl[256];
+static int    perThread = 200;    /// <calls per thread and run
+static char * payload   = NULL;   /// <object body, payloadLen 'x's
+static int    payloadLen;
+static char * receipts  = NULL;   /// <receipt handles by thread and call
+
+/// State of one benchmark thread
+typedef struct
+{
+  pthread_t t;
+  int      op;
+  int      id;         /// <thread number
+  int      size;       /// <object size
+  double * lat;        /// <latency of each call in microseconds
+  int      errors;     /// <calls that failed
+} Worker;
+
+
+/// Current time in microseconds
+static double now_us ()
+{
+  struct timespec ts;
+  clock_gettime ( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/// Run one call of a benchmark
+/// \return 0 if the call succeeded
+static int do_call ( Worker * w, int i )
+{
+  char key[128];
+  char * receipt = receipts + (size_t)( w->id * perThread + i ) * RECEIPT_SIZE;
+  IOBuf * b = aws_iobuf_new ();
+  int rc = 0;
+
+  snprintf ( key, sizeof(key), "bench/%d/%d/%d", w->size, w->id, i );
+
+  switch ( w->op )
+    {
+    case OP_PUT:
+      aws_iobuf_append ( b, payload, w->size );
+      rc = s3_put ( b, key );
+      break;
+    case OP_GET:
+      rc = s3_get ( b, key );
+      if ( rc == 0 && b->len != w->size ) rc = -1;
+      break;
+    case OP_DELETE:
+      rc = s3_delete ( b, key );
+      break;
+    case OP_SEND:
+      rc = sqs_send_message ( b, queueUrl, payload );
+      break;
+    case OP_RECEIVE:
+      receipt[0] = 0;
+      rc = sqs_get_message ( b, queueUrl, receipt );
+      if ( rc == 0 && receipt[0] == 0 ) rc = -1;
+      break;
+    case OP_DELMSG:
+      rc = sqs_delete_message ( b, queueUrl, receipt );
+      break;
+    }
+  if ( rc == 0 && b->code / 100 != 2 ) rc = -1;
+  aws_iobuf_free ( b );
+  return rc;
+}
+
+/// Benchmark thread
+static void * worker ( void * arg )
+{
+  Worker * w = arg;
+  int i;
+  for ( i = 0 ; i < perThread ; i ++ )
+    {
+      double t0 = now_us ();
+      if ( do_call ( w, i )) w->errors ++;
+      w->lat[i] = now_us () - t0;
+    }
+  return NULL;
+}
+
+static int cmp_double ( const void * a, const void * b )
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+/// Latency at a percentile of sorted samples
+static double percentile ( const double * v, int n, double p )
+{
+  int i = (int)( p * n + 0.999999 ) - 1;
+  if ( i < 0 ) i = 0;
+  if ( i >= n ) i = n - 1;
+  return v[i];
+}
+
+/// Run one operation with the given size and thread count
+/// and print its results
+static void run ( int op, int size, int threads )
+{
+  Worker * w = calloc ( threads, sizeof(Worker));
+  int n = threads * perThread;
+  double * lat = malloc ( n * sizeof(double));
+  int errors = 0;
+  int i;
+
+  /// SQS payloads are sent as strings
+  memset ( payload, 'x', payloadLen );
+  payload[size] = 0;
+
+  double t0 = now_us ();
+  for ( i = 0 ; i < threads ; i ++ )
+    {
+      w[i].op   = op;
+      w[i].id   = i;
+      w[i].size = size;
+      w[i].lat  = lat + i * perThread;
+      pthread_create ( &w[i].t, NULL, worker, &w[i] );
+    }
+  for ( i = 0 ; i < threads ; i ++ )
+    {
+      pthread_join ( w[i].t, NULL );
+      errors += w[i].errors;
+    }
+  double secs = ( now_us () - t0 ) / 1e6;
+
+  qsort ( lat, n, sizeof(double), cmp_double );
+  printf ( "{\"op\":\"%s\",\"size\":%d,\"threads\":%d,\"ops\":%d,\"errors\":%d,"
+	   "\"secs\":%.4f,\"ops_per_sec\":%.1f,\"mbytes_per_sec\":%.2f,"
+	   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+	   opNames[op], size, threads, n, errors, secs, n / secs,
+	   op == OP_DELETE || op == OP_DELMSG ? 0.0 : (double) n * size / secs / 1e6,
+	   percentile ( lat, n, 0.50 ), percentile ( lat, n, 0.99 ),
+	   percentile ( lat, n, 0.999 ), lat[n-1] );
+  fflush ( stdout );
+
+  free ( lat );
+  free ( w );
+}
+
+/// Parse a comma separated list of numbers
+/// \return number of values parsed
+static int parse_list ( char * s, int * v, int max )
+{
+  int n = 0;
+  char * tok;
+  for ( tok = strtok ( s, "," ) ; tok && n < max ; tok = strtok ( NULL, "," ))
+    v[n++] = atoi ( tok );
+  return n;
+}
+
+static void usage ( char * prog )
+{
+  fprintf ( stderr,
+	    "Usage: %s [-H host:port] [-o ops] [-s sizes] [-c threads] [-n calls]\n"
+	    "   -H  server (127.0.0.1:18080)\n"
+	    "   -o  operations (put,get,delete,send,receive,delmsg)\n"
+	    "   -s  object sizes in bytes (1024,65536,1048576)\n"
+	    "   -c  concurrency levels (1,4,16)\n"
+	    "   -n  calls per thread and run (200)\n", prog );
+  exit ( 1 );
+}
+
+
+int main ( int argc, char * argv[] )
+{
+  char * host = "127.0.0.1:18080";
+  char   opList[128]   = "put,get,delete,send,receive,delmsg";
+  char   sizeList[256] = "1024,65536,1048576";
+  char   concList[128] = "1,4,16";
+  int    ops[OP_COUNT], sizes[32], conc[32];
+  int    nOps = 0, nSizes, nConc;
+  int    opt, i, j, k;
+
+  while (( opt = getopt ( argc, argv, "H:o:s:c:n:" )) != -1 )
+    switch ( opt )
+      {
+      case 'H': host = optarg; break;
+      case 'o': snprintf ( opList, sizeof(opList), "%s", optarg ); break;
+      case 's': snprintf ( sizeList, sizeof(sizeList), "%s", optarg ); break;
+      case 'c': snprintf ( concList, sizeof(concList), "%s", optarg ); break;
+      case 'n': perThread = atoi ( optarg ); break;
+      default: usage ( argv[0] );
+      }
+
+  char * tok;
+  for ( tok = strtok ( opList, "," ) ; tok && nOps < OP_COUNT ; tok = strtok ( NULL, "," ))
+    {
+      for ( k = 0 ; k < OP_COUNT && strcmp ( tok, opNames[k] ) ; k ++ );
+      if ( k == OP_COUNT ) usage ( argv[0] );
+      ops[nOps++] = k;
+    }
+  nSizes = parse_list ( sizeList, sizes, 32 );
+  nConc  = parse_list ( concList, conc, 32 );
+  if ( perThread <= 0 || !nSizes || !nConc ) usage ( argv[0] );
+
+  int maxConc = 0;
+  payloadLen = 0;
+  for ( i = 0 ; i < nSizes ; i ++ ) if ( sizes[i] > payloadLen ) payloadLen = sizes[i];
+  for ( i = 0 ; i < nConc ; i ++ )  if ( conc[i] > maxConc ) maxConc = conc[i];
+  payload  = malloc ( payloadLen + 1 );
+  receipts = calloc ( (size_t) maxConc * perThread, RECEIPT_SIZE );
+
+  aws_init ();
+  aws_set_keyid ( "AKIDBENCHMARK" );
+  aws_set_key ( "benchmark-secret-key" );
+  s3_set_host ( host );
+  s3_set_bucket ( "bench" );
+  snprintf ( queueUrl, sizeof(queueUrl), "http://%s/bench", host );
+
+  for ( i = 0 ; i < nSizes ; i ++ )
+    for ( j = 0 ; j < nConc ; j ++ )
+      for ( k = 0 ; k < nOps ; k ++ )
+	{
+	  if ( ops[k] >= OP_SEND && sizes[i] > SQS_MAX_MESSAGE ) continue;
+	  run ( ops[k], sizes[i], conc[j] );
+	}
+
+  free ( payload );
+  free ( receipts );
+  return 0;
+}
@@ -0,0 +1,1043 @@
+/*
+ *
+ * Copyright(c) 2009,  Vlad Korolev,  <vlad[@]v-lad.org >
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at http://www.gnu.org/licenses/lgpl-3.0.txt
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ */
+
+/// \file mock_server.c
+/// Local stand-in for S3 and SQS, used by the benchmarks.
+///
+/// It speaks just enough HTTP/1.1 for libcurl: keep-alive,
+/// Expect: 100-continue and Content-Length bodies.
+///
+///    S3 objects are kept in memory, keyed by the request path.
+///    aws-chunked uploads are unframed, and the CRC32C of the
+///    object is returned when x-amz-checksum-mode is enabled.
+///    Uploads whose Content-MD5 or x-amz-checksum-crc32c does not 
+///    match get 400 BadDigest.
+///    GET takes a single Range of bytes.  Multipart uploads are
+///    put together when they complete.
+///    SQS queues are created on first use.  Received messages stay
+///    hidden until they are deleted.
+///    With -r requests over the given rate get 503 SlowDown, the
+///    way S3 throttles a busy prefix.
+///
+/// Signatures are not checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/md5.h>
+
+#include "aws4c.h"
+
+static int verbose = 0;  /// <log every request to stderr
+static double throttle = 0;  /// <requests per second served, 0 for no limit
+static double tokens = 0;    /// <requests that may be served now
+static double refill = 0;    /// <last time tokens were added
+static pthread_mutex_t throttleLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// Stored S3 object.  Objects are never modified, a PUT replaces the
+/// whole object.  Readers hold a reference while they send it.
+typedef struct _Obj
+{
+  struct _Obj * next;      /// <next object in the hash chain
+  int    refs;             /// <references held
+  char * key;              /// <request path
+  char * data;             /// <body
+  int    len;              /// <length of the body
+  char   eTag[48];         /// <quoted MD5 of the body
+  char   encoding[64];     /// <Content-Encoding, without aws-chunked
+  char   crc[16];          /// <base64 CRC32C of the body
+  time_t mtime;            /// <time of the upload
+} Obj;
+
+#define OBJ_BUCKETS 65536
+#define OBJ_LOCKS   256
+
+static Obj * objs[OBJ_BUCKETS];
+static pthread_mutex_t objLocks[OBJ_LOCKS];
+
+
+/// Multipart upload in progress, its parts are objects of their own
+typedef struct _Upload
+{
+  struct _Upload * next;
+  long   id;
+  char * key;              /// <request path of the object
+  Obj ** parts;            /// <parts by number, NULL where missing
+  int    nParts;           /// <room in parts
+} Upload;
+
+/// Most parts of an upload, as in S3
+#define MAX_PARTS 10000
+
+static Upload * uploads = NULL;
+static long     nextUpload = 1;
+static pthread_mutex_t uploadsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// Queued SQS message
+typedef struct _Msg
+{
+  struct _Msg * next;
+  long   id;               /// <message id, also the receipt handle
+  char * body;
+  int    len;
+} Msg;
+
+#define MSG_BUCKETS 4096
+
+/// SQS queue
+typedef struct _Queue
+{
+  struct _Queue * next;
+  char   name[256];
+  pthread_mutex_t lock;
+  Msg *  head;                   /// <visible messages, oldest first
+  Msg *  tail;
+  Msg *  hidden[MSG_BUCKETS];    /// <received messages by id
+  long   nextId;
+  int    nVisible;
+} Queue;
+
+static Queue * queues = NULL;
+static pthread_mutex_t queuesLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// Client connection with its input buffer
+typedef struct
+{
+  int    fd;
+  char   buf[65536];
+  int    pos;
+  int    len;
+  char * line;             /// <request line and header buffer
+  int    lineSize;
+} Conn;
+
+#define MAX_PARAMS 32
+
+/// Request being served
+typedef struct
+{
+  char   method[16];
+  char * path;             /// <path without the query
+  char * query;            /// <query string or NULL
+  int    contentLen;
+  int    keepAlive;
+  int    checksumMode;     /// <x-amz-checksum-mode: ENABLED
+  char   range[64];        /// <Range, empty without one
+  int    expect;           /// <Expect: 100-continue
+  char   encoding[64];     /// <Content-Encoding
+  char   md5[32];          /// <Content-MD5, empty without one
+  char   crc[16];          /// <x-amz-checksum-crc32c, empty without one
+  char * body;
+  int    bodyLen;
+  int    nParams;            /// <number of query parameters
+  char * name[MAX_PARAMS];   /// <parameter names
+  char * value[MAX_PARAMS];  /// <decoded parameter values
+} Request;
+
+
+
+/// FNV-1a hash of a string
+static unsigned __hash ( const char * s )
+{
+  unsigned h = 2166136261u;
+  while ( *s ) { h ^= (unsigned char) *s++; h *= 16777619u; }
+  return h;
+}
+
+/// Drop a reference to an object
+static void obj_release ( Obj * o )
+{
+  if ( __atomic_sub_fetch ( &o->refs, 1, __ATOMIC_ACQ_REL ) > 0 ) return;
+  free ( o->key );
+  free ( o->data );
+  free ( o );
+}
+
+/// Look an object up
+/// \return referenced object or NULL
+static Obj * obj_get ( const char * key )
+{
+  unsigned h = __hash ( key );
+  pthread_mutex_t * l = &objLocks[h % OBJ_LOCKS];
+  Obj * o;
+
+  pthread_mutex_lock ( l );
+  for ( o = objs[h % OBJ_BUCKETS] ; o ; o = o->next )
+    if ( !strcmp ( o->key, key )) { o->refs ++; break; }
+  pthread_mutex_unlock ( l );
+  return o;
+}
+
+/// Insert an object, replacing the one with the same key
+/// \param o new object, or NULL to delete
+/// \param key key of the object
+/// \return 1 if there was an object with this key
+static int obj_put ( Obj * o, const char * key )
+{
+  unsigned h = __hash ( key );
+  pthread_mutex_t * l = &objLocks[h % OBJ_LOCKS];
+  Obj ** p;
+  Obj * old = NULL;
+
+  pthread_mutex_lock ( l );
+  for ( p = &objs[h % OBJ_BUCKETS] ; *p ; p = &(*p)->next )
+    if ( !strcmp ( (*p)->key, key )) { old = *p; *p = old->next; break; }
+  if ( o ) { o->next = objs[h % OBJ_BUCKETS]; objs[h % OBJ_BUCKETS] = o; }
+  pthread_mutex_unlock ( l );
+
+  if ( old ) obj_release ( old );
+  return old != NULL;
+}
+
+
+/// Find a queue, creating it if needed
+static Queue * queue_get ( const char * name )
+{
+  Queue * q;
+  pthread_mutex_lock ( &queuesLock );
+  for ( q = queues ; q ; q = q->next )
+    if ( !strcmp ( q->name, name )) break;
+  if ( q == NULL )
+    {
+      q = calloc ( 1, sizeof(Queue));
+      snprintf ( q->name, sizeof(q->name), "%s", name );
+      pthread_mutex_init ( &q->lock, NULL );
+      q->nextId = 1;
+      q->next = queues;
+      queues  = q;
+    }
+  pthread_mutex_unlock ( &queuesLock );
+  return q;
+}
+
+
+
+/// Make sure there is unread input
+/// \return 0 at the end of the input
+static int conn_fill ( Conn * c )
+{
+  if ( c->pos < c->len ) return 1;
+  c->pos = 0;
+  c->len = read ( c->fd, c->buf, sizeof(c->buf));
+  return c->len > 0;
+}
+
+/// Read one line into c->line, without the CR LF
+/// \return length of the line or -1 at the end of the input
+static int conn_getline ( Conn * c )
+{
+  int n = 0;
+  for (;;)
+    {
+      if ( !conn_fill ( c )) return -1;
+      char * s = c->buf + c->pos;
+      char * e = memchr ( s, '\n', c->len - c->pos );
+      int k = e ? e - s : c->len - c->pos;
+      if ( n + k + 1 > c->lineSize )
+	{
+	  if ( n + k + 1 > 16 * 1024 * 1024 ) return -1;
+	  while ( c->lineSize < n + k + 1 ) c->lineSize *= 2;
+	  c->line = realloc ( c->line, c->lineSize );
+	}
+      memcpy ( c->line + n, s, k );
+      n += k;
+      c->pos += k;
+      if ( e ) { c->pos ++; break; }
+    }
+  if ( n > 0 && c->line[n-1] == '\r' ) n --;
+  c->line[n] = 0;
+  return n;
+}
+
+/// Read exactly n bytes
+/// \return 0 on success, -1 at the end of the input
+static int conn_read ( Conn * c, char * d, int n )
+{
+  while ( n > 0 )
+    {
+      if ( !conn_fill ( c )) return -1;
+      int k = c->len - c->pos < n ? c->len - c->pos : n;
+      memcpy ( d, c->buf + c->pos, k );
+      c->pos += k; d += k; n -= k;
+    }
+  return 0;
+}
+
+/// Send a response
+/// \param fd socket
+/// \param status status line without the protocol, e.g. "200 OK"
+/// \param headers extra header lines, each ending with CR LF
+/// \param body response body or NULL
+/// \param len length of the body, also sent for HEAD
+/// \param sendBody 0 to leave the body out
+/// \return 0 on success, -1 if the connection is gone
+static int respond ( int fd, const char * status, const char * headers,
+		     const char * body, int len, int sendBody )
+{
+  char head[2048];
+  struct iovec iov[2];
+  int n = snprintf ( head, sizeof(head),
+		     "HTTP/1.1 %s\r\n%sContent-Length: %d\r\n\r\n",
+		     status, headers, len );
+
+  iov[0].iov_base = head;
+  iov[0].iov_len  = n;
+  iov[1].iov_base = (char*) body;
+  iov[1].iov_len  = sendBody && body ? len : 0;
+  int cnt = 2;
+  struct iovec * v = iov;
+
+  while ( cnt > 0 )
+    {
+      ssize_t w = writev ( fd, v, cnt );
+      if ( w < 0 ) return -1;
+      while ( cnt > 0 && (size_t) w >= v->iov_len ) { w -= v->iov_len; v ++; cnt --; }
+      if ( cnt > 0 ) { v->iov_base = (char*) v->iov_base + w; v->iov_len -= w; }
+    }
+  return 0;
+}
+
+/// Send an S3 style XML error
+static int respond_error ( int fd, const char * status, const char * code,
+			   int sendBody )
+{
+  char body[256];
+  int n = snprintf ( body, sizeof(body),
+		     "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		     "<Error><Code>%s</Code><Message>%s</Message></Error>\n",
+		     code, code );
+  return respond ( fd, status, "Content-Type: application/xml\r\n",
+		   body, n, sendBody );
+}
+
+
+/// Decode %XX and '+' in place
+static void url_decode ( char * s )
+{
+  char * d = s;
+  for ( ; *s ; s ++ )
+    {
+      if ( *s == '+' ) *d++ = ' ';
+      else if ( *s == '%' && s[1] && s[2] )
+	{
+	  char hex[3] = { s[1], s[2], 0 };
+	  *d++ = strtol ( hex, NULL, 16 );
+	  s += 2;
+	}
+      else *d++ = *s;
+    }
+  *d = 0;
+}
+
+/// Split the query string into decoded parameters, in place
+static void parse_query ( Request * r )
+{
+  char * p = r->query;
+  while ( p && *p && r->nParams < MAX_PARAMS )
+    {
+      char * next = strchr ( p, '&' );
+      if ( next ) *next++ = 0;
+      char * v = strchr ( p, '=' );
+      if ( v ) *v++ = 0; else v = p + strlen ( p );
+      url_decode ( v );
+      r->name[r->nParams]  = p;
+      r->value[r->nParams] = v;
+      r->nParams ++;
+      p = next;
+    }
+}
+
+/// Find a query parameter
+/// \return decoded value or NULL
+static char * param ( Request * r, const char * name )
+{
+  int i;
+  for ( i = 0 ; i < r->nParams ; i ++ )
+    if ( !strcmp ( r->name[i], name )) return r->value[i];
+  return NULL;
+}
+
+/// Remove aws-chunked framing from an upload in place
+/// \return length of the payload or -1 if the framing is broken
+static int unchunk ( char * body, int len )
+{
+  char * p = body;
+  char * end = body + len;
+  char * d = body;
+
+  for (;;)
+    {
+      char * e = memchr ( p, '\n', end - p );
+      if ( e == NULL ) return -1;
+      int sz = strtol ( p, NULL, 16 );
+      p = e + 1;
+      if ( sz == 0 ) break;
+      if ( sz > end - p ) return -1;
+      memmove ( d, p, sz );
+      d += sz;
+      p += sz + 2;
+    }
+  return d - body;
+}
+
+
+/// Parse a Range header value against an object
+/// \param first,last set to the bytes asked for, first > last if 
+///        none of them exist
+/// \return 0 if the value is not a single byte range, which means
+///         the whole object is sent
+static int range_parse ( const char * v, int len, long * first, long * last )
+{
+  char * end;
+
+  if ( strncmp ( v, "bytes=", 6 ) || strchr ( v, ',' )) return 0;
+  v += 6;
+  if ( *v == '-' )
+    {
+      long n = strtol ( v + 1, &end, 10 );
+      if ( *end || n <= 0 ) return 0;
+      *first = n < len ? len - n : 0;
+      *last  = len - 1;
+      return 1;
+    }
+  *first = strtol ( v, &end, 10 );
+  if ( *end != '-' ) return 0;
+  if ( end[1] == 0 ) *last = len - 1;
+  else if (( *last = strtol ( end + 1, &end, 10 )) < *first || *end ) return 0;
+  if ( *last >= len ) *last = len - 1;
+  return 1;
+}
+
+/// Make an object of an upload
+/// \param key request path
+/// \param data body, taken over by the object
+/// \param len length of the body
+/// \param encoding Content-Encoding of the request
+/// \return object with one reference, NULL if aws-chunked framing is broken
+static Obj * obj_new ( const char * key, char * data, int len, const char * encoding )
+{
+  Obj * o = calloc ( 1, sizeof(Obj));
+  o->refs = 1;
+  o->key  = strdup ( key );
+  o->data = data;
+  o->len  = len;
+  o->mtime = time ( NULL );
+
+  const char * enc = encoding;
+  if ( !strncmp ( enc, "aws-chunked", 11 ))
+    {
+      o->len = unchunk ( o->data, o->len );
+      if ( o->len < 0 )
+	{
+	  obj_release ( o );
+	  return NULL;
+	}
+      enc += 11;
+      if ( *enc == ',' ) enc ++;
+    }
+  snprintf ( o->encoding, sizeof(o->encoding), "%s", enc );
+
+  unsigned char md[MD5_DIGEST_LENGTH];
+  int i;
+  MD5 ( (unsigned char*) o->data, o->len, md );
+  o->eTag[0] = '"';
+  for ( i = 0 ; i < MD5_DIGEST_LENGTH ; i ++ )
+    sprintf ( o->eTag + 1 + 2*i, "%02x", md[i] );
+  strcat ( o->eTag, "\"" );
+
+  unsigned crc = aws_crc32c ( 0, o->data, o->len );
+  unsigned char be[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+  aws_b64_encode ( be, 4, o->crc, sizeof(o->crc));
+  return o;
+}
+
+/// Take an upload out of the list
+/// \return upload or NULL if there is none with this id and key
+static Upload * upload_take ( const char * key, long id )
+{
+  Upload ** p, * u = NULL;
+  pthread_mutex_lock ( &uploadsLock );
+  for ( p = &uploads ; *p ; p = &(*p)->next )
+    if ( (*p)->id == id && !strcmp ( (*p)->key, key )) { u = *p; *p = u->next; break; }
+  pthread_mutex_unlock ( &uploadsLock );
+  return u;
+}
+
+static void upload_free ( Upload * u )
+{
+  int i;
+  for ( i = 0 ; i < u->nParts ; i ++ ) if ( u->parts[i] ) obj_release ( u->parts[i] );
+  free ( u->parts );
+  free ( u->key );
+  free ( u );
+}
+
+/// Store a part of an upload, replacing one with the same number
+/// \return 0, 1 if there is no such upload, 2 for a bad part number
+static int upload_part ( const char * key, long id, int num, Obj * o )
+{
+  Upload * u;
+  int rc = 0;
+
+  pthread_mutex_lock ( &uploadsLock );
+  for ( u = uploads ; u && ( u->id != id || strcmp ( u->key, key )) ; u = u->next );
+  if ( u == NULL ) rc = 1;
+  else if ( num < 1 || num > MAX_PARTS ) rc = 2;
+  else
+    {
+      if ( num > u->nParts )
+	{
+	  int n = u->nParts ? u->nParts : 16;
+	  while ( n < num ) n *= 2;
+	  u->parts = realloc ( u->parts, n * sizeof(Obj*));
+	  memset ( u->parts + u->nParts, 0, ( n - u->nParts ) * sizeof(Obj*));
+	  u->nParts = n;
+	}
+      if ( u->parts[num-1] ) obj_release ( u->parts[num-1] );
+      u->parts[num-1] = o;
+      o = NULL;
+    }
+  pthread_mutex_unlock ( &uploadsLock );
+  if ( o ) obj_release ( o );
+  return rc;
+}
+
+/// Put the parts listed in a complete request together into the
+/// object.  Its ETag is the MD5 of the part MD5s and the number of
+/// parts, like the one S3 gives.
+static int upload_complete ( Conn * c, Request * r, long id )
+{
+  char body[512];
+  Upload * u = upload_take ( r->path, id );
+  if ( u == NULL ) return respond_error ( c->fd, "404 Not Found", "NoSuchUpload", 1 );
+
+  const char * p;
+  int n = 0, len = 0, num;
+  for ( p = r->body ? r->body : "" ; ( p = strstr ( p, "<PartNumber>" )) ; p ++ )
+    {
+      num = atoi ( p + 12 );
+      if ( num < 1 || num > u->nParts || u->parts[num-1] == NULL )
+	{
+	  upload_free ( u );
+	  return respond_error ( c->fd, "400 Bad Request", "InvalidPart", 1 );
+	}
+      len += u->parts[num-1]->len;
+      n ++;
+    }
+
+  char * data = malloc ( len + 1 );
+  unsigned char md[MD5_DIGEST_LENGTH];
+  MD5_CTX m;
+  MD5_Init ( &m );
+  for ( p = r->body ? r->body : "", len = 0 ; ( p = strstr ( p, "<PartNumber>" )) ; p ++ )
+    {
+      Obj * part = u->parts[atoi ( p + 12 ) - 1];
+      memcpy ( data + len, part->data, part->len );
+      len += part->len;
+      MD5 ( (unsigned char*) part->data, part->len, md );
+      MD5_Update ( &m, md, sizeof(md));
+    }
+
+  Obj * o = obj_new ( r->path, data, len, "" );
+  MD5_Final ( md, &m );
+  for ( num = 0 ; num < MD5_DIGEST_LENGTH ; num ++ )
+    sprintf ( o->eTag + 1 + 2*num, "%02x", md[num] );
+  sprintf ( o->eTag + 1 + 2*MD5_DIGEST_LENGTH, "-%d\"", n );
+  upload_free ( u );
+
+  int k = snprintf ( body, sizeof(body),
+		     "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		     "<CompleteMultipartUploadResult><ETag>%s</ETag>"
+		     "</CompleteMultipartUploadResult>\n", o->eTag );
+  obj_put ( o, o->key );
+  return respond ( c->fd, "200 OK", "", body, k, 1 );
+}
+
+/// Check an upload against the Content-MD5 and CRC32C sent with it
+/// \return 1 if they match or none were sent
+static int body_matches ( Request * r, Obj * o )
+{
+  unsigned char md[MD5_DIGEST_LENGTH];
+  char md5[32];
+
+  if ( r->crc[0] && strcmp ( r->crc, o->crc )) return 0;
+  if ( r->md5[0] == 0 ) return 1;
+  MD5 ( (unsigned char*) o->data, o->len, md );
+  aws_b64_encode ( md, sizeof(md), md5, sizeof(md5));
+  return !strcmp ( md5, r->md5 );
+}
+
+/// Serve S3 requests
+static int serve_s3 ( Conn * c, Request * r )
+{
+  char hdr[512];
+  int head = !strcmp ( r->method, "HEAD" );
+
+  if ( !strcmp ( r->method, "PUT" ))
+    {
+      Obj * o = obj_new ( r->path, r->body, r->bodyLen, r->encoding );
+      r->body = NULL;
+      if ( o == NULL )
+	return respond_error ( c->fd, "400 Bad Request", "IncompleteBody", 1 );
+      if ( !body_matches ( r, o ))
+	{
+	  obj_release ( o );
+	  return respond_error ( c->fd, "400 Bad Request", "BadDigest", 1 );
+	}
+      snprintf ( hdr, sizeof(hdr), "ETag: %s\r\n", o->eTag );
+
+      char * id = param ( r, "uploadId" );
+      if ( id )
+	{
+	  char * num = param ( r, "partNumber" );
+	  int rc = upload_part ( r->path, atol ( id ), num ? atoi ( num ) : 0, o );
+	  if ( rc ) 
+	    return respond_error ( c->fd, rc == 1 ? "404 Not Found" : "400 Bad Request", 
+				   rc == 1 ? "NoSuchUpload" : "InvalidArgument", 1 );
+	  return respond ( c->fd, "200 OK", hdr, NULL, 0, 0 );
+	}
+      obj_put ( o, o->key );
+      return respond ( c->fd, "200 OK", hdr, NULL, 0, 0 );
+    }
+
+  if ( !strcmp ( r->method, "POST" ) && param ( r, "uploads" ))
+    {
+      char body[512];
+      Upload * u = calloc ( 1, sizeof(Upload));
+      u->key = strdup ( r->path );
+      pthread_mutex_lock ( &uploadsLock );
+      u->id   = nextUpload ++;
+      u->next = uploads;
+      uploads = u;
+      pthread_mutex_unlock ( &uploadsLock );
+      int n = snprintf ( body, sizeof(body),
+			 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			 "<InitiateMultipartUploadResult><UploadId>%ld</UploadId>"
+			 "</InitiateMultipartUploadResult>\n", u->id );
+      return respond ( c->fd, "200 OK", "", body, n, 1 );
+    }
+
+  if ( !strcmp ( r->method, "POST" ) && param ( r, "uploadId" ))
+    return upload_complete ( c, r, atol ( param ( r, "uploadId" )));
+
+  if ( !strcmp ( r->method, "DELETE" ) && param ( r, "uploadId" ))
+    {
+      Upload * u = upload_take ( r->path, atol ( param ( r, "uploadId" )));
+      if ( u == NULL )
+	return respond_error ( c->fd, "404 Not Found", "NoSuchUpload", 1 );
+      upload_free ( u );
+      return respond ( c->fd, "204 No Content", "", NULL, 0, 0 );
+    }
+
+  if ( !strcmp ( r->method, "DELETE" ))
+    {
+      obj_put ( NULL, r->path );
+      return respond ( c->fd, "204 No Content", "", NULL, 0, 0 );
+    }
+
+  if ( !strcmp ( r->method, "GET" ) || head )
+    {
+      Obj * o = obj_get ( r->path );
+      if ( o == NULL )
+	return respond_error ( c->fd, "404 Not Found", "NoSuchKey", !head );
+
+      char date[64];
+      struct tm tm;
+      gmtime_r ( &o->mtime, &tm );
+      strftime ( date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm );
+      int n = snprintf ( hdr, sizeof(hdr), "ETag: %s\r\nLast-Modified: %s\r\n",
+			 o->eTag, date );
+      if ( o->encoding[0] )
+	n += snprintf ( hdr + n, sizeof(hdr) - n, "Content-Encoding: %s\r\n",
+			o->encoding );
+
+      /// bytes=first-last, first- or -suffix
+      long first, last;
+      if ( r->range[0] && range_parse ( r->range, o->len, &first, &last ))
+	{
+	  if ( first > last )
+	    {
+	      obj_release ( o );
+	      return respond_error ( c->fd, "416 Requested Range Not Satisfiable", 
+				     "InvalidRange", !head );
+	    }
+	  snprintf ( hdr + n, sizeof(hdr) - n, "Content-Range: bytes %ld-%ld/%d\r\n",
+		     first, last, o->len );
+	  int rc = respond ( c->fd, "206 Partial Content", hdr, o->data + first, 
+			     last - first + 1, !head );
+	  obj_release ( o );
+	  return rc;
+	}
+
+      if ( r->checksumMode )
+	n += snprintf ( hdr + n, sizeof(hdr) - n, "x-amz-checksum-crc32c: %s\r\n",
+			o->crc );
+      int rc = respond ( c->fd, "200 OK", hdr, o->data, o->len, !head );
+      obj_release ( o );
+      return rc;
+    }
+
+  return respond_error ( c->fd, "405 Method Not Allowed", "MethodNotAllowed", 1 );
+}
+
+
+/// Escape a message body for XML
+static char * xml_escape ( const char * s, int len, int * outLen )
+{
+  char * d = malloc ( len * 6 + 1 );
+  int n = 0;
+  int i;
+  for ( i = 0 ; i < len ; i ++ )
+    switch ( s[i] )
+      {
+      case '&': memcpy ( d + n, "&amp;", 5 ); n += 5; break;
+      case '<': memcpy ( d + n, "&lt;", 4 );  n += 4; break;
+      case '>': memcpy ( d + n, "&gt;", 4 );  n += 4; break;
+      case '"': memcpy ( d + n, "&quot;", 6 ); n += 6; break;
+      default:  d[n++] = s[i];
+      }
+  d[n] = 0;
+  *outLen = n;
+  return d;
+}
+
+/// Serve SQS requests.  Parameters come in the query string.
+static int serve_sqs ( Conn * c, Request * r )
+{
+  char * action = param ( r, "Action" );
+  char   body[1024];
+  int    n;
+
+  /// Queue URLs look like http://host/name, requests add a '/'
+  char name[256];
+  snprintf ( name, sizeof(name), "%s", r->path + 1 );
+  n = strlen ( name );
+  if ( n > 0 && name[n-1] == '/' ) name[n-1] = 0;
+
+  if ( !strcmp ( action, "CreateQueue" ) || !strcmp ( action, "ListQueues" ))
+    {
+      char * qn = param ( r, "QueueName" );
+      if ( qn == NULL ) qn = param ( r, "QueueNamePrefix" );
+      if ( qn == NULL || !*qn ) qn = "default";
+      queue_get ( qn );
+      n = snprintf ( body, sizeof(body),
+		     "<%sResponse><%sResult><QueueUrl>http://%s/%s</QueueUrl>"
+		     "</%sResult></%sResponse>\n",
+		     action, action, "localhost", qn, action, action );
+      return respond ( c->fd, "200 OK", "", body, n, 1 );
+    }
+
+  Queue * q = queue_get ( name[0] ? name : "default" );
+
+  if ( !strcmp ( action, "SendMessage" ))
+    {
+      char * text = param ( r, "MessageBody" );
+      if ( text == NULL )
+	return respond_error ( c->fd, "400 Bad Request", "MissingParameter", 1 );
+
+      Msg * m = calloc ( 1, sizeof(Msg));
+      m->len  = strlen ( text );
+      m->body = strdup ( text );
+
+      pthread_mutex_lock ( &q->lock );
+      m->id = q->nextId ++;
+      if ( q->tail ) q->tail->next = m; else q->head = m;
+      q->tail = m;
+      q->nVisible ++;
+      pthread_mutex_unlock ( &q->lock );
+
+      unsigned char md[MD5_DIGEST_LENGTH];
+      char hex[2*MD5_DIGEST_LENGTH+1];
+      int i;
+      MD5 ( (unsigned char*) m->body, m->len, md );
+      for ( i = 0 ; i < MD5_DIGEST_LENGTH ; i ++ ) sprintf ( hex + 2*i, "%02x", md[i] );
+
+      n = snprintf ( body, sizeof(body),
+		     "<SendMessageResponse><SendMessageResult>"
+		     "<MD5OfMessageBody>%s</MD5OfMessageBody><MessageId>%ld</MessageId>"
+		     "</SendMessageResult></SendMessageResponse>\n", hex, m->id );
+      return respond ( c->fd, "200 OK", "", body, n, 1 );
+    }
+
+  if ( !strcmp ( action, "ReceiveMessage" ))
+    {
+      pthread_mutex_lock ( &q->lock );
+      Msg * m = q->head;
+      if ( m )
+	{
+	  q->head = m->next;
+	  if ( q->head == NULL ) q->tail = NULL;
+	  q->nVisible --;
+	  m->next = q->hidden[m->id % MSG_BUCKETS];
+	  q->hidden[m->id % MSG_BUCKETS] = m;
+	}
+      /// The body is copied under the lock, DeleteMessage may free it
+      int    len = 0;
+      char * esc = m ? xml_escape ( m->body, m->len, &len ) : NULL;
+      long   id  = m ? m->id : 0;
+      pthread_mutex_unlock ( &q->lock );
+
+      if ( esc == NULL )
+	{
+	  n = snprintf ( body, sizeof(body),
+			 "<ReceiveMessageResponse><ReceiveMessageResult/>"
+			 "</ReceiveMessageResponse>\n" );
+	  return respond ( c->fd, "200 OK", "", body, n, 1 );
+	}
+
+      char * out = malloc ( len + 512 );
+      n = sprintf ( out, "<ReceiveMessageResponse><ReceiveMessageResult><Message>\n"
+		    "<MessageId>%ld</MessageId><ReceiptHandle>%ld</ReceiptHandle>"
+		    "<Body>%s</Body>\n"
+		    "</Message></ReceiveMessageResult></ReceiveMessageResponse>\n",
+		    id, id, esc );
+      int rc = respond ( c->fd, "200 OK", "", out, n, 1 );
+      free ( out );
+      free ( esc );
+      return rc;
+    }
+
+  if ( !strcmp ( action, "DeleteMessage" ))
+    {
+      char * rh = param ( r, "ReceiptHandle" );
+      long id = rh ? atol ( rh ) : 0;
+      Msg ** p;
+      Msg * m = NULL;
+
+      pthread_mutex_lock ( &q->lock );
+      for ( p = &q->hidden[id % MSG_BUCKETS] ; *p ; p = &(*p)->next )
+	if ( (*p)->id == id ) { m = *p; *p = m->next; break; }
+      pthread_mutex_unlock ( &q->lock );
+
+      if ( m == NULL )
+	return respond_error ( c->fd, "400 Bad Request", "ReceiptHandleIsInvalid", 1 );
+      free ( m->body );
+      free ( m );
+      n = snprintf ( body, sizeof(body),
+		     "<DeleteMessageResponse></DeleteMessageResponse>\n" );
+      return respond ( c->fd, "200 OK", "", body, n, 1 );
+    }
+
+  if ( !strcmp ( action, "GetQueueAttributes" ))
+    {
+      n = snprintf ( body, sizeof(body),
+		     "<GetQueueAttributesResponse><GetQueueAttributesResult>\n"
+		     "<Attribute><Name>VisibilityTimeout</Name><Value>30</Value></Attribute>\n"
+		     "<Attribute><Name>ApproximateNumberOfMessages</Name><Value>%d</Value></Attribute>\n"
+		     "</GetQueueAttributesResult></GetQueueAttributesResponse>\n",
+		     q->nVisible );
+      return respond ( c->fd, "200 OK", "", body, n, 1 );
+    }
+
+  if ( !strcmp ( action, "SetQueueAttributes" ))
+    {
+      n = snprintf ( body, sizeof(body),
+		     "<SetQueueAttributesResponse></SetQueueAttributesResponse>\n" );
+      return respond ( c->fd, "200 OK", "", body, n, 1 );
+    }
+
+  return respond_error ( c->fd, "400 Bad Request", "InvalidAction", 1 );
+}
+
+
+/// Read one request
+/// \return 0 on success, -1 if the connection should be closed
+static int read_request ( Conn * c, Request * r )
+{
+  memset ( r, 0, sizeof(Request));
+
+  int n;
+  do n = conn_getline ( c ); while ( n == 0 );
+  if ( n < 0 ) return -1;
+
+  /// Request line: METHOD SP target SP version
+  char * sp = strchr ( c->line, ' ' );
+  if ( sp == NULL || sp - c->line >= (int) sizeof(r->method)) return -1;
+  memcpy ( r->method, c->line, sp - c->line );
+  r->path = strdup ( sp + 1 );
+  char * v = strrchr ( r->path, ' ' );
+  if ( v ) { *v = 0; r->keepAlive = strcmp ( v + 1, "HTTP/1.0" ) != 0; }
+  r->query = strchr ( r->path, '?' );
+  if ( r->query ) *r->query++ = 0;
+  parse_query ( r );
+
+  while (( n = conn_getline ( c )) > 0 )
+    {
+      char * h = c->line;
+      if ( !strncasecmp ( h, "Content-Length:", 15 ))
+	r->contentLen = atoi ( h + 15 );
+      else if ( !strncasecmp ( h, "Content-Encoding:", 17 ))
+	sscanf ( h + 17, " %63s", r->encoding );
+      else if ( !strncasecmp ( h, "Expect:", 7 ) && strstr ( h, "100" ))
+	r->expect = 1;
+      else if ( !strncasecmp ( h, "x-amz-checksum-mode:", 20 ))
+	r->checksumMode = 1;
+      else if ( !strncasecmp ( h, "Range:", 6 ))
+	sscanf ( h + 6, " %63s", r->range );
+      else if ( !strncasecmp ( h, "Content-MD5:", 12 ))
+	sscanf ( h + 12, " %31s", r->md5 );
+      else if ( !strncasecmp ( h, "x-amz-checksum-crc32c:", 22 ))
+	sscanf ( h + 22, " %15s", r->crc );
+      else if ( !strncasecmp ( h, "Connection:", 11 ) && strstr ( h, "close" ))
+	r->keepAlive = 0;
+    }
+  if ( n < 0 ) return -1;
+
+  if ( r->expect && r->contentLen > 0 )
+    {
+      const char * cont = "HTTP/1.1 100 Continue\r\n\r\n";
+      if ( write ( c->fd, cont, strlen(cont)) < 0 ) return -1;
+    }
+
+  r->body = malloc ( r->contentLen + 1 );
+  if ( conn_read ( c, r->body, r->contentLen )) return -1;
+  r->body[r->contentLen] = 0;
+  r->bodyLen = r->contentLen;
+  return 0;
+}
+
+/// Take a token of the -r rate limit
+/// \return 1 if the request may be served
+static int admit ()
+{
+  struct timespec ts;
+  int ok;
+
+  if ( throttle <= 0 ) return 1;
+  clock_gettime ( CLOCK_MONOTONIC, &ts );
+  double now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  pthread_mutex_lock ( &throttleLock );
+  tokens += ( now - refill ) * throttle;
+  if ( tokens > throttle / 10 + 1 ) tokens = throttle / 10 + 1;
+  refill = now;
+  ok = tokens >= 1;
+  if ( ok ) tokens -= 1;
+  pthread_mutex_unlock ( &throttleLock );
+  return ok;
+}
+
+/// Serve one client connection
+static void * serve ( void * arg )
+{
+  Conn * c = arg;
+  Request r;
+
+  for (;;)
+    {
+      int rc = read_request ( c, &r );
+      if ( rc == 0 )
+	{
+	  if ( verbose )
+	    fprintf ( stderr, "%s %s [%d]\n", r.method, r.path, r.bodyLen );
+	  if ( !admit ())
+	    rc = respond_error ( c->fd, "503 Slow Down", "SlowDown",
+				 strcmp ( r.method, "HEAD" ));
+	  else if ( param ( &r, "Action" ))
+	    rc = serve_sqs ( c, &r );
+	  else
+	    rc = serve_s3 ( c, &r );
+	}
+      free ( r.path );
+      free ( r.body );
+      if ( rc || !r.keepAlive ) break;
+    }
+
+  close ( c->fd );
+  free ( c->line );
+  free ( c );
+  return NULL;
+}
+
+
+int main ( int argc, char * argv[] )
+{
+  int port = 18080;
+  int opt;
+  int i;
+
+  while (( opt = getopt ( argc, argv, "p:r:v" )) != -1 )
+    switch ( opt )
+      {
+      case 'p': port = atoi ( optarg ); break;
+      case 'r': throttle = atof ( optarg ); break;
+      case 'v': verbose = 1; break;
+      default:
+	fprintf ( stderr, "Usage: %s [-p port] [-r requests/s] [-v]\n", argv[0] );
+	exit ( 1 );
+      }
+
+  signal ( SIGPIPE, SIG_IGN );
+  for ( i = 0 ; i < OBJ_LOCKS ; i ++ ) pthread_mutex_init ( &objLocks[i], NULL );
+
+  int s = socket ( AF_INET, SOCK_STREAM, 0 );
+  int one = 1;
+  setsockopt ( s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset ( &addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons ( port );
+  addr.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+
+  if ( bind ( s, (struct sockaddr*) &addr, sizeof(addr)) || listen ( s, 1024 ))
+    {
+      perror ( "mock_server" );
+      exit ( 1 );
+    }
+  fprintf ( stderr, "mock_server listening on 127.0.0.1:%d\n", port );
+
+  pthread_attr_t attr;
+  pthread_attr_init ( &attr );
+  pthread_attr_setdetachstate ( &attr, PTHREAD_CREATE_DETACHED );
+  pthread_attr_setstacksize ( &attr, 256 * 1024 );
+
+  for (;;)
+    {
+      int fd = accept ( s, NULL, NULL );
+      if ( fd < 0 ) continue;
+      setsockopt ( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      Conn * c = calloc ( 1, sizeof(Conn));
+      c->fd = fd;
+      c->lineSize = 4096;
+      c->line = malloc ( c->lineSize );
+
+      pthread_t t;
+      if ( pthread_create ( &t, &attr, serve, c ))
+	{
+	  close ( fd );
+	  free ( c->line );
+	  free ( c );
+	}
+    }
+  return 0;
+}
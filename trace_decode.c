@@ -0,0 +1,92 @@
+/*
+ *
+ * Copyright(c) 2009,  Vlad Korolev,  <vlad[@]v-lad.org >
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at http://www.gnu.org/licenses/lgpl-3.0.txt
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ */
+
+/// \file trace_decode.c
+/// Print a trace written by aws_trace_dump as text, one event per
+/// line in time order:
+///
+///    <microseconds since first event> t<thread> <event> <op> <args>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aws4c.h"
+
+static int cmp_rec ( const void * a, const void * b )
+{
+  const AwsTraceRec * x = a, * y = b;
+  return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+int main ( int argc, char * argv[] )
+{
+  AwsTraceHeader h;
+  AwsTraceRec * rec;
+  char * data = NULL;
+  size_t len = 0, size = 0, pos = 0;
+  int n = 0, i;
+  FILE * f = argc > 1 ? fopen ( argv[1], "rb" ) : stdin;
+
+  if ( argc > 2 || f == NULL )
+    {
+      fprintf ( stderr, "Usage: %s [dump file]\n", argv[0] );
+      return 1;
+    }
+  do
+    {
+      if ( len == size )
+	{
+	  size = size ? size * 2 : 1 << 20;
+	  data = realloc ( data, size );
+	  if ( data == NULL ) { fprintf ( stderr, "Out of memory\n" ); return 1; }
+	}
+      len += fread ( data + len, 1, size - len, f );
+    }
+  while ( len == size );
+
+  /// Several dumps may be concatenated, e.g. after repeated signals.
+  /// Records are packed in place, dropping the headers.
+  rec = (AwsTraceRec*) data;
+  while ( pos + sizeof(h) <= len )
+    {
+      memcpy ( &h, data + pos, sizeof(h));
+      if ( memcmp ( h.magic, AWS_TRACE_MAGIC, sizeof(h.magic)) ||
+	   h.recSize != sizeof(AwsTraceRec))
+	{
+	  fprintf ( stderr, "Not an aws4c trace\n" );
+	  return 1;
+	}
+      pos += sizeof(h);
+      while ( pos + sizeof(AwsTraceRec) <= len &&
+	      memcmp ( data + pos, AWS_TRACE_MAGIC, sizeof(h.magic)))
+	{
+	  memmove ( &rec[n++], data + pos, sizeof(AwsTraceRec));
+	  pos += sizeof(AwsTraceRec);
+	}
+    }
+
+  qsort ( rec, n, sizeof(AwsTraceRec), cmp_rec );
+  for ( i = 0 ; i < n ; i ++ )
+    {
+      /// Records seen by more than one dump
+      if ( i && !memcmp ( &rec[i], &rec[i-1], sizeof(AwsTraceRec))) continue;
+      printf ( "%12.3f t%-3u %-6s %-30s %lld %lld\n",
+	       ( rec[i].ts - rec[0].ts ) / 1e3, rec[i].thread,
+	       aws_trace_event_name ( rec[i].ev ), aws_metrics_op_name ( rec[i].op ),
+	       rec[i].a0, rec[i].a1 );
+    }
+  free ( data );
+  return 0;
+}